@@ -0,0 +1,60 @@
+#pragma once
+
+#include "interval.hpp"
+#include "ray.hpp"
+#include <utility>
+
+// Axis-aligned bounding box
+class aabb {
+public:
+  interval x, y, z;
+
+  aabb() {} // Default box is empty
+  aabb(const interval &x, const interval &y, const interval &z)
+      : x(x), y(y), z(z) {}
+  aabb(const point3 &a, const point3 &b);
+  aabb(const aabb &a, const aabb &b); // Tightest box enclosing both
+
+  const interval &axis_interval(int n) const {
+    if (n == 1)
+      return y;
+    if (n == 2)
+      return z;
+    return x;
+  }
+
+  bool is_empty() const;
+  bool is_bounded() const;
+  int longest_axis() const;
+  double surface_area() const;
+  point3 centroid() const;
+
+  bool hit(const point3 &origin, const vec3 &inv_direction,
+           interval ray_t) const {
+    double t_entry;
+    return this->hit(origin, inv_direction, ray_t, t_entry);
+  }
+
+  // Also gives where the ray enters the box, clipped to the interval
+  bool hit(const point3 &origin, const vec3 &inv_direction, interval ray_t,
+           double &t_entry) const {
+    // Slab test against the three pairs of planes, using the precomputed
+    // inverse of the ray direction to avoid divisions
+    for (int axis = 0; axis < 3; axis++) {
+      const interval &slab = this->axis_interval(axis);
+      double t0 = (slab.min - origin[axis]) * inv_direction[axis];
+      double t1 = (slab.max - origin[axis]) * inv_direction[axis];
+      if (t0 > t1)
+        std::swap(t0, t1);
+
+      ray_t.min = std::fmax(t0, ray_t.min);
+      ray_t.max = std::fmin(t1, ray_t.max);
+      if (ray_t.max < ray_t.min)
+        return false;
+    }
+    t_entry = ray_t.min;
+    return true;
+  }
+
+  static const aabb empty, universe;
+};
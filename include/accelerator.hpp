@@ -0,0 +1,85 @@
+#pragma once
+
+#include "object.hpp"
+#include <vector>
+
+class thread_pool;
+
+// Spatial index answering ray queries over a fixed set of objects it does not
+// own
+class accelerator {
+public:
+  virtual ~accelerator() = default;
+
+  virtual bool check_hit(const ray &r, interval ray_t,
+                         hit_record &record) const = 0;
+
+  // Any-hit query for shadow rays, returning on the first blocker found
+  virtual bool check_occluded(const ray &r, interval ray_t) const = 0;
+
+  // Closest hits of up to max_packet_size rays, flagged in `hits`. Indexes
+  // able to trace coherent rays together override it; by default the rays
+  // are traced one at a time
+  virtual void check_hit_packet(const ray *rays, int count, interval ray_t,
+                                hit_record *records, bool *hits) const {
+    for (int l = 0; l < count; l++)
+      hits[l] = this->check_hit(rays[l], ray_t, records[l]);
+  }
+
+  // Brings the index up to date after the given objects moved or changed
+  // size, sharing the work with the pool. Indexes that cannot do so return
+  // false, and must then be built again
+  virtual bool refit(const std::vector<const object *> &, thread_pool &) {
+    return false;
+  }
+
+  // Bytes held by the index itself, not counting the objects
+  virtual size_t memory_usage() const = 0;
+
+  static const int max_packet_size = 8;
+
+  // Asks for every cache line of the value ahead of its use
+  template <typename T> static void prefetch(const T &value) {
+    const char *bytes = reinterpret_cast<const char *>(&value);
+    for (size_t offset = 0; offset < sizeof(T); offset += 64)
+      __builtin_prefetch(bytes + offset);
+  }
+
+protected:
+  template <typename T> static size_t vector_bytes(const std::vector<T> &v) {
+    return v.size() * sizeof(T);
+  }
+
+  // Closest hit among the unbounded objects within the interval, whose max
+  // shrinks to it, leaving the part of the ray the index must still search
+  bool check_unbounded(const ray &r, interval &ray_t,
+                       hit_record &record) const {
+    hit_record temp_rec;
+    bool hit_anything = false;
+    for (auto obj : this->unbounded) {
+      if (obj->check_hit(r, ray_t, temp_rec)) {
+        hit_anything = true;
+        ray_t.max = temp_rec.t;
+        record = temp_rec;
+      }
+    }
+    return hit_anything;
+  }
+
+  bool check_unbounded_occluded(const ray &r, interval ray_t) const {
+    for (auto obj : this->unbounded)
+      if (obj->check_occluded(r, ray_t))
+        return true;
+    return false;
+  }
+
+  // Reciprocal of the ray's direction, for the slab tests of the boxes
+  static vec3 inverse_direction(const ray &r) {
+    vec3 direction = r.get_direction();
+    return vec3(1.0 / direction.x(), 1.0 / direction.y(), 1.0 / direction.z());
+  }
+
+  // Infinite objects (e.g. open polyhedra) cannot be partitioned, so indexes
+  // over bounding boxes keep them here and every ray tests them directly
+  std::vector<object *> unbounded;
+};
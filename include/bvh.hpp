@@ -0,0 +1,177 @@
+#pragma once
+
+#include "accelerator.hpp"
+#include "sphere_set.hpp"
+#include <vector>
+
+// Bounding volume hierarchy built with the surface area heuristic (SAH)
+class bvh : public accelerator {
+public:
+  // With spatial splits, a node may also be split by a plane, with the
+  // objects straddling it referenced from both sides, each reference bounded
+  // by the part of the object on its side (Stich et al., "Spatial Splits in
+  // Bounding Volume Hierarchies", 2009). Leaves then repeat some objects, but
+  // boxes around objects much larger than their neighbors overlap far less
+  bvh(const std::vector<object *> &objects, bool spatial_splits = false);
+
+  bool check_hit(const ray &r, interval ray_t,
+                 hit_record &record) const override;
+
+  bool check_occluded(const ray &r, interval ray_t) const override;
+
+  // Traverses the tree once for the whole packet, testing each node against
+  // every ray still active below it
+  void check_hit_packet(const ray *rays, int count, interval ray_t,
+                        hit_record *records, bool *hits) const override;
+
+  // Refits the boxes above the changed objects bottom-up, a level of the tree
+  // at a time, and rebuilds the subtrees whose SAH cost grew too much since
+  // they were built. Only the changed objects and their ancestors are visited,
+  // unless some subtree is rebuilt, which takes one more pass over the tree
+  bool refit(const std::vector<const object *> &changed,
+             thread_pool &pool) override;
+
+  int node_count() const { return int(this->nodes.size()); }
+  int reference_count() const {
+    return int(this->primitives.size()) + this->spheres.size();
+  }
+  int unbounded_count() const { return int(this->unbounded.size()); }
+
+  size_t memory_usage() const override {
+    return vector_bytes(this->nodes) + vector_bytes(this->primitives) +
+           this->spheres.memory_usage() + vector_bytes(this->unbounded) +
+           vector_bytes(this->parents) + vector_bytes(this->cost) +
+           vector_bytes(this->built_cost) + vector_bytes(this->references);
+  }
+
+private:
+  // Read the tree to collapse it into wider ones
+  friend class wide_bvh;
+  friend class compressed_bvh;
+
+  // Splits its top levels as the tree does
+  friend class lazy_bvh;
+
+  // Holds the subtrees rebuilt by refit, and those lazy_bvh builds
+  bvh() = default;
+
+  // Nodes are stored depth-first: an interior node's first child comes right
+  // after it and `offset` points to the second one. A leaf keeps its spheres
+  // in `spheres`, starting at `sphere_offset`, and its other objects in
+  // `primitives`, starting at `offset`. Subtrees rebuilt in place by refit
+  // may leave some nodes unused, with a negative count, out of every subtree
+  class node {
+  public:
+    aabb bounds;
+    int offset;
+    int count; // Number of objects, zero for interior nodes
+    int axis;  // Split axis, used to visit the nearest child first
+    int sphere_offset;
+    int sphere_count;
+  };
+
+  // Object reference used while building
+  class build_entry {
+  public:
+    const object *obj;
+    aabb bounds;
+    point3 centroid;
+  };
+
+  // Packet rays as a structure of arrays, indexed by axis and then lane
+  class ray_packet {
+  public:
+    double origin[3][max_packet_size];
+    double inv_direction[3][max_packet_size];
+  };
+
+  // Builds the whole tree over the entries, reordering them
+  void build_root(std::vector<build_entry> &entries);
+
+  // Builds the subtree over entries [begin, end). Spatial splits are made
+  // only if given a budget, the number of references they may still add
+  int build(std::vector<build_entry> &entries, int begin, int end, int depth,
+            int *split_budget);
+
+  // Cheapest split of the objects into those whose centroids fall before
+  // bin `split` of the axis and the others, binning the centroids' box;
+  // returns its cost, or infinity if every centroid coincides
+  static double find_object_split(const std::vector<build_entry> &entries,
+                                  int begin, int end, const aabb &bounds,
+                                  const aabb &centroid_bounds, int &axis,
+                                  int &split);
+
+  // Applies an object split, returning where its right side starts
+  static int partition_objects(std::vector<build_entry> &entries, int begin,
+                               int end, const aabb &centroid_bounds, int axis,
+                               int split);
+
+  // Cheapest split of the box by a plane adding at most max_references
+  // references, giving its axis and position; returns its cost, or infinity
+  static double find_spatial_split(const std::vector<build_entry> &entries,
+                                   int begin, int end, const aabb &bounds,
+                                   int max_references, int &axis,
+                                   double &plane);
+
+  // Entry for the part of an object within [min, max] along the axis
+  static build_entry clip_entry(const build_entry &e, int axis, double min,
+                                double max);
+
+  // Works out the cost of every node from the boxes it was built with
+  void init_costs();
+
+  // Finds each node's parent and the leaves referencing each object
+  void link_nodes();
+
+  // Cost of the subtree, from the node's box and its children's costs
+  double subtree_cost(int index) const;
+
+  // Recomputes the node's box and cost from its children or objects
+  void refit_node(int index);
+
+  int node_depth(int index) const;
+
+  // Index past the last node of the subtree rooted at the index
+  int subtree_end(int index) const;
+
+  // Turns the cheapest pairs of sibling leaves into single leaves until the
+  // tree has at most max_nodes nodes; returns false if it cannot
+  bool merge_leaves(int max_nodes);
+
+  // Builds the subtrees rooted at the given nodes again, over the same
+  // objects, and puts them in place of the old ones. The roots are sorted
+  // and none lies within another's subtree
+  void rebuild_subtrees(const std::vector<int> &roots, thread_pool &pool);
+
+  // Subtrees replacing the interior node `index` in a tree of up to `width`
+  // children per node; returns how many were written to `children`
+  int collapse_children(int index, int width, int *children) const;
+
+  bool check_leaf(const node &n, const ray &r, interval ray_t,
+                  hit_record &record) const;
+
+  static unsigned packet_box_hits(const aabb &box, const ray_packet &packet,
+                                  double t_min, const double *t_max,
+                                  unsigned active);
+
+  std::vector<node> nodes;
+  std::vector<const object *> primitives;
+  sphere_set spheres;
+  bool spatial_splits = false;
+
+  // Leaf referencing an object, at a sphere if sphere >= 0
+  class reference {
+  public:
+    const object *obj;
+    int node;
+    int sphere;
+  };
+
+  // Left empty until the first refit. The cost of a subtree is its expected
+  // SAH cost times the area of its root, and it is compared to the cost the
+  // subtree had when built to decide when to rebuild it
+  std::vector<int> parents;
+  std::vector<double> cost;
+  std::vector<double> built_cost;
+  std::vector<reference> references; // Sorted by object
+};
@@ -2,10 +2,20 @@
 
 #include "color.hpp"
 #include "world.hpp"
+#include <string>
+#include <vector>
+
+class thread_pool;
+
+// How the color of a pixel sample is estimated: `tree` traces every lobe of
+// every hit, `path` follows one randomly chosen lobe per hit and `mis` does
+// the same while also sampling the bulbs, combining both with multiple
+// importance sampling
+enum class integrator_type { tree, path, mis };
 
 class camera {
 public:
-  void render(const world &w, std::ofstream &output_file);
+  void render(const world &w, const std::string &output_path);
 
   // Image parameters
   int img_width = 800;
@@ -23,11 +33,180 @@ public:
   int samples_per_pixel = 10;
   int max_recursion_depth = 10;
   color background_color = color(0.0f, 0.0f, 0.0f);
+  int num_threads = 0; // 0 uses every hardware thread
+  uint64_t seed = 0;
+  integrator_type integrator = integrator_type::tree;
+  bool light_sampling = false; // Samples the bulbs directly at diffuse hits
+
+  // Adaptive sampling: when adaptive_error is positive, each pixel stops
+  // sampling once the 95% confidence interval of its luminance is within that
+  // fraction of the mean, taking between min_samples_per_pixel and
+  // samples_per_pixel samples. The count taken by each pixel can be written to
+  // sample_map_path as a grayscale image
+  double adaptive_error = 0.0f;
+  int min_samples_per_pixel = 8;
+  std::string sample_map_path;
+
+  // Progressive rendering: when samples_per_pass is positive, the samples are
+  // taken in passes over the whole image, and the image so far is written out
+  // every preview_every_passes passes or preview_every_seconds seconds
+  int samples_per_pass = 0;
+  int preview_every_passes = 0;
+  double preview_every_seconds = 0.0;
+
+  // Time budget: when positive, the render takes as many samples per pixel
+  // (up to samples_per_pixel) as fit in that many seconds
+  double time_budget = 0.0;
+
+  // Ray tree pruning: branches whose weight on the pixel falls below the
+  // epsilon are not traced, and each lobe type may have its own depth cap
+  // (-1 leaves it limited by max_recursion_depth alone)
+  double prune_epsilon = 0.0f;
+  int max_diffuse_depth = -1;
+  int max_reflection_depth = -1;
+  int max_refraction_depth = -1;
+
+  // Camera rays of neighboring pixels are traced together in packets of this
+  // many rays (at most accelerator::max_packet_size); 1 traces them one by one
+  int packet_size = accelerator::max_packet_size;
+
+  // Wavefront rendering (path and mis integrators only): instead of following
+  // each sample to its end, the samples of up to wavefront_batch_size pixels
+  // advance together one bounce at a time, in separate intersection, sorting
+  // and shading stages
+  bool wavefront = false;
+  int wavefront_batch_size = 1 << 16;
+
+  // Sorts the wavefront's secondary rays by direction octant and origin cell
+  // (Morton order) before intersecting them, so that rays traversing the same
+  // parts of the scene are traced one after the other
+  bool sort_rays = false;
 
 private:
+  // Side of the square blocks of pixels handed out to the render threads
+  static const int tile_size = 16;
+
+  // Bounce after which paths may be terminated by Russian roulette
+  static const int roulette_start_bounce = 3;
+
+  // Samples gathered so far by a pixel
+  class pixel_state {
+  public:
+    color sum;
+    int samples = 0;
+
+    // Running statistics of the samples' luminance, for adaptive sampling
+    double mean = 0.0;
+    double squared_deviations = 0.0;
+    bool converged = false;
+  };
+
+  // Camera ray traced ahead of its shading, as part of a packet
+  class primary_hit {
+  public:
+    bool found;
+    hit_record record;
+  };
+
+  // Path of the path and mis integrators between two bounces
+  class path_state {
+  public:
+    ray current; // Ray to trace next
+    color radiance;
+    color throughput;
+    bool skips_emission; // Set after diffuse bounces with light sampling
+
+    // Where the last bounce happened and the density of the direction it
+    // took, zero for the camera ray and specular bounces
+    point3 last_point;
+    double last_bsdf_pdf;
+
+    int bounce;
+    bool is_alive; // Still has a ray to trace
+    rng gen;
+  };
+
+  // Timings of the secondary intersections with ray sorting. The first few
+  // queues are also traced unsorted, as the baseline of the speedup
+  class ray_sort_stats {
+  public:
+    double unsorted_seconds = 0.0;
+    long long unsorted_rays = 0;
+    double sorted_seconds = 0.0;
+    long long sorted_rays = 0;
+    double sorting_seconds = 0.0;
+  };
+
+  // Secondary rays traced unsorted for the baseline
+  static const long long sort_baseline_rays = 1 << 20;
+
+  // Lobes of the ray tree, in the order they are scattered
+  static const int lobe_diffuse = 0;
+  static const int lobe_reflective = 1;
+  static const int lobe_refractive = 2;
+  static const int num_lobes = 3;
+
+  // Node of the ray tree while it is being evaluated
+  class ray_frame {
+  public:
+    ray r;
+    int depth;                 // Remaining recursion depth
+    int lobe_depth[num_lobes]; // Bounces taken so far through each lobe
+    color weight;              // Scale of this node's color on the sample
+
+    bool skips_emission; // Bulbs it hits were already sampled directly
+
+    hit_record record;
+    bool is_shaded; // Hit a material, so its lobes add up to its color
+    int next_lobe;
+    color final_color;
+
+    double coeff[num_lobes];
+    color attenuation[num_lobes];
+    color lobe_color[num_lobes];
+  };
+
   void initialize();
-  ray get_ray_sample(int i, int j) const;
-  color ray_color(const ray &r, int depth, const world &w) const;
+  void render_pixel(int i, int j, const world &w, pixel_state &pixel,
+                    int sample_end) const;
+  void render_span(int i, int j_begin, int j_end, const world &w,
+                   pixel_state *pixels, int sample_end) const;
+  void render_wavefront(const world &w, std::vector<pixel_state> &pixels,
+                        int sample_end, int span_size, thread_pool &pool,
+                        ray_sort_stats &sort_stats) const;
+  void add_sample(pixel_state &pixel, const color &sample) const;
+  color sample_color(const ray &r, const world &w, rng &gen,
+                     const primary_hit *primary) const;
+  int budget_pass_size(double remaining_seconds,
+                       double seconds_per_sample) const;
+  void write_image(const std::string &path,
+                   const std::vector<pixel_state> &pixels) const;
+  void write_sample_map(const std::vector<pixel_state> &pixels) const;
+  ray get_ray_sample(int i, int j, rng &gen) const;
+  color ray_color(const ray &r, int depth, const world &w, rng &gen,
+                  const primary_hit *primary) const;
+  void open_ray_frame(ray_frame &frame, const world &w, rng &gen,
+                      const primary_hit *primary) const;
+  bool spawn_ray_frame(ray_frame &parent, ray_frame &child, rng &gen) const;
+  bool scatter_lobe(int lobe, const ray &incident, const hit_record &record,
+                    color &attenuation, ray &scattered, double &coeff,
+                    rng &gen) const;
+  color path_color(const ray &r, const world &w, rng &gen,
+                   const primary_hit *primary) const;
+  void start_path(path_state &path, const ray &r, const rng &gen) const;
+  void extend_path(path_state &path, bool hit_anything,
+                   const hit_record &record, const world &w) const;
+  color sky_color(const ray &r) const;
+  color sample_direct_light(const hit_record &record, const world &w,
+                            rng &gen) const;
+  color sample_light_mis(const ray &incident, const hit_record &record,
+                         const double lobe_coeffs[], double total,
+                         const color &albedo, const world &w, rng &gen) const;
+  double bsdf_pdf(const ray &incident, const hit_record &record,
+                  const double lobe_coeffs[], double total,
+                  const vec3 &direction) const;
+  double light_pdf(const world &w, const point3 &origin,
+                   const light *lig) const;
 
   // Image parameters
   double aspect_ratio;
@@ -39,7 +218,4 @@ private:
   vec3 u, v, w; // Camera's coordinate system
   vec3 defocus_disk_hor_radius;
   vec3 defocus_disk_ver_radius;
-
-  // Rendering parameters
-  double pixel_sample_color_scale;
 };
\ No newline at end of file
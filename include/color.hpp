@@ -6,3 +6,8 @@
 using color = vec3;
 
 void write_color(std::ofstream &out, const color &pixel_color);
+
+inline double luminance(const color &c) {
+  // Perceived brightness of a linear color (Rec. 709 weights)
+  return 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z();
+}
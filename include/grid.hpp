@@ -0,0 +1,57 @@
+#pragma once
+
+#include "accelerator.hpp"
+#include <vector>
+
+// Uniform grid over the scene's box, with about cells_per_object cells per
+// object. Each cell lists the objects overlapping it, and rays walk the cells
+// they cross in order with a 3D-DDA (Amanatides and Woo, "A Fast Voxel
+// Traversal Algorithm for Ray Tracing", 1987), stopping at the first cell
+// holding a hit. Building takes two passes over the objects, so it suits
+// dense, evenly spread scenes; objects much larger than the typical one
+// (e.g. a ground sphere) would fill every cell, so they are kept out of the
+// grid and tested by every ray, like unbounded ones
+class grid : public accelerator {
+public:
+  grid(const std::vector<object *> &objects);
+
+  bool check_hit(const ray &r, interval ray_t,
+                 hit_record &record) const override;
+
+  bool check_occluded(const ray &r, interval ray_t) const override;
+
+  size_t memory_usage() const override {
+    return vector_bytes(this->cell_start) + vector_bytes(this->cell_objects) +
+           vector_bytes(this->objects) + vector_bytes(this->out_of_band);
+  }
+
+  int resolution(int axis) const { return this->cells[axis]; }
+  int out_of_band_count() const { return int(this->out_of_band.size()); }
+
+private:
+  // Range of cells overlapped by a box, per axis
+  void cell_range(const aabb &box, int *first, int *last) const;
+
+  int cell_index(int x, int y, int z) const {
+    return (z * this->cells[1] + y) * this->cells[0] + x;
+  }
+
+  // Walks the cells crossed by the ray within the interval, calling
+  // visit(begin, end, t_exit) with the range of cell_objects of each one and
+  // where the ray leaves it, until visit returns true
+  template <typename cell_visitor>
+  void walk(const ray &r, interval ray_t, const cell_visitor &visit) const;
+
+  aabb bounds;
+  int cells[3] = {0, 0, 0};
+  vec3 cell_size;
+
+  // Objects of cell c are objects[cell_objects[cell_start[c]]] up to
+  // objects[cell_objects[cell_start[c + 1]]]
+  std::vector<int> cell_start;
+  std::vector<int> cell_objects;
+  std::vector<object *> objects;
+
+  // Large and unbounded objects, tested by every ray
+  std::vector<object *> out_of_band;
+};
@@ -0,0 +1,41 @@
+#pragma once
+
+#include "object.hpp"
+#include "transform.hpp"
+#include "world.hpp"
+
+// A built world placed in another one under an affine transform, so that
+// geometry repeated across a scene is stored and indexed once: the instance
+// keeps a pointer to the shared world, whose own accelerator is searched in
+// its local space by rays brought there through the inverse transform. The
+// shared world must outlive its instances, and its bulbs are hit by rays but
+// not sampled as lights. An instance takes a few hundred bytes, so it only
+// saves memory for shared worlds larger than that, not for a lone sphere
+class instance : public object {
+public:
+  // With a material given, it replaces the materials of the shared world's
+  // objects; the instance then owns it
+  instance(const world *prototype, const transform &to_world,
+           material *mat = nullptr);
+  ~instance();
+
+  bool check_hit(const ray &r, interval ray_t,
+                 hit_record &record) const override;
+
+  bool check_occluded(const ray &r, interval ray_t) const override;
+
+  aabb bounding_box() const override { return this->bbox; }
+
+  // Instances of a lone sphere under a rotation and uniform scale are spheres
+  // too, so accelerators still batch them
+  bool get_sphere(point3 &center, double &radius) const override;
+
+private:
+  const world *prototype;
+  transform to_world;
+  transform to_local;
+  aabb bbox;
+
+  // Color properties
+  material *mat;
+};
@@ -10,6 +10,9 @@ public:
       : min(+mathconst::infinity), max(-mathconst::infinity) {
   } // Default interval is empty
   interval(double min, double max) : min(min), max(max) {}
+  interval(const interval &a, const interval &b)
+      : min(std::fmin(a.min, b.min)), max(std::fmax(a.max, b.max)) {
+  } // Tightest interval enclosing both
 
   double size() const { return max - min; }
   bool contains(double x) const { return min <= x && x <= max; }
@@ -0,0 +1,64 @@
+#pragma once
+
+#include "accelerator.hpp"
+#include "bvh.hpp"
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+// Bounding volume hierarchy built on demand: only the top levels are built
+// up front, with the binned SAH splits of bvh until few enough objects
+// remain, and each group of objects left below them becomes a bvh the first
+// time a ray reaches it. Tracing starts almost at once, and the parts of the
+// scene no ray enters are never built
+class lazy_bvh : public accelerator {
+public:
+  // Spatial splits are made in the subtrees, see bvh
+  lazy_bvh(const std::vector<object *> &objects, bool spatial_splits = false);
+  ~lazy_bvh();
+
+  bool check_hit(const ray &r, interval ray_t,
+                 hit_record &record) const override;
+
+  bool check_occluded(const ray &r, interval ray_t) const override;
+
+  int node_count() const { return int(this->nodes.size()); }
+  int subtree_count() const { return int(this->subtrees.size()); }
+  int unbounded_count() const { return int(this->unbounded.size()); }
+
+  // Counts the subtrees built so far
+  size_t memory_usage() const override;
+
+private:
+  // Top nodes are stored depth-first as in bvh: an interior node's first
+  // child comes right after it and `offset` points to the second one, while
+  // a leaf refers to the subtree `offset`
+  class node {
+  public:
+    aabb bounds;
+    int offset;
+    int axis; // Split axis, -1 for leaves
+  };
+
+  // Built by the first ray to reach it, while any other waits on the lock
+  class subtree {
+  public:
+    mutable std::mutex lock;
+    mutable std::atomic<bvh *> tree{nullptr};
+  };
+
+  // Builds the top over entries [begin, end), leaving subtrees unbuilt
+  int build(int begin, int end, int depth);
+
+  // The subtree's tree, built if no ray reached it before
+  const bvh &expand(int index) const;
+
+  std::vector<node> nodes;
+  std::vector<subtree> subtrees;
+
+  // Objects of subtree i are entries[subtree_offsets[i], subtree_offsets[i +
+  // 1]), so a last entry marks where the objects end
+  std::vector<bvh::build_entry> entries;
+  std::vector<int> subtree_offsets;
+  bool spatial_splits;
+};
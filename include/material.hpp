@@ -16,15 +16,25 @@ public:
 
   bool scatter_diffuse(const ray &incident, const hit_record &record,
                        color &attenuation, ray &scattered,
-                       double &diffuse_coeff) const;
+                       double &diffuse_coeff, rng &gen) const;
 
   bool scatter_reflective(const ray &incident, const hit_record &record,
                           color &attenuation, ray &scattered,
-                          double &reflection_coeff) const;
+                          double &reflection_coeff, rng &gen) const;
 
   bool scatter_refractive(const ray &incident, const hit_record &record,
                           color &attenuation, ray &scattered,
-                          double &refraction_coeff) const;
+                          double &refraction_coeff, rng &gen) const;
+
+  // Solid angle densities with which the scatter functions above produce the
+  // unit direction, for the lobes that are not perfectly specular
+  double pdf_diffuse(const hit_record &record, const vec3 &direction) const;
+  double pdf_reflective(const ray &incident, const hit_record &record,
+                        const vec3 &direction) const;
+
+  // A mirror without fuzz reflects along a single direction, which has no
+  // density to speak of (refraction always does)
+  bool is_reflection_specular() const { return this->fuzz <= 0.0f; }
 
   color emitted(double u, double v, const point3 &p) const {
     return color(0.0f, 0.0f, 0.0f);
@@ -36,6 +46,13 @@ public:
     return this->coloration->value(u, v, p);
   }
 
+  void get_lobe_coeffs(double &diffuse_coeff, double &reflection_coeff,
+                       double &refraction_coeff) const {
+    diffuse_coeff = this->diffuse_coeff;
+    reflection_coeff = this->reflection_coeff;
+    refraction_coeff = this->refraction_coeff;
+  }
+
 private:
   static double reflectance(double cosine, double refraction_index) {
     // Uses Schlick's approximation for reflectance
@@ -0,0 +1,70 @@
+#pragma once
+
+#include "mesh_file.hpp"
+#include "object.hpp"
+#include <string>
+
+// Triangle mesh read from a mesh_file mapped into memory, whose vertices,
+// triangles and BVH are used in place after one pass validating them, with
+// nothing parsed, copied or built at load. Triangles are hit with the
+// watertight test of Woop et al. ("Watertight Ray/Triangle Intersection",
+// 2013), so no ray slips between triangles sharing an edge
+class mesh : public object {
+public:
+  // Leaves the mesh empty, with an error message, if the file cannot be read
+  // or is not a valid mesh_file
+  mesh(const std::string &path, material *mat);
+  ~mesh();
+
+  bool check_hit(const ray &r, interval ray_t,
+                 hit_record &record) const override;
+
+  bool check_occluded(const ray &r, interval ray_t) const override;
+
+  aabb bounding_box() const override { return this->bbox; }
+
+  int triangle_count() const { return int(this->num_of_triangles); }
+
+private:
+  // The ray sheared so that it runs along the z axis from the origin, which
+  // reduces each triangle test to 2D edge functions
+  class sheared_ray {
+  public:
+    explicit sheared_ray(const ray &r);
+
+    point3 origin;
+    vec3 inv_direction;
+    int kx, ky, kz; // Axes permuted so that kz is the dominant one
+    double sx, sy, sz;
+  };
+
+  // Distance along the ray where it hits the triangle within the interval,
+  // with the barycentric coordinates of its second and third vertices
+  bool hit_triangle(const sheared_ray &s, uint32_t triangle, interval ray_t,
+                    double &t, double &b1, double &b2) const;
+
+  // Runs visit(triangle, ray_t) on the triangles of every leaf the ray
+  // reaches within the interval, nearest child first. visit returns the
+  // interval to keep searching, which is empty to stop
+  template <typename visitor>
+  void traverse(const sheared_ray &s, interval ray_t, visitor visit) const;
+
+  point3 vertex(uint32_t index) const {
+    const float *v = this->vertices + 3 * size_t(index);
+    return point3(v[0], v[1], v[2]);
+  }
+
+  // Mapping of the whole file
+  void *data = nullptr;
+  size_t size = 0;
+
+  // Geometric properties, within the mapping
+  const float *vertices = nullptr;
+  const uint32_t *triangles = nullptr;
+  const mesh_file::node *nodes = nullptr;
+  uint32_t num_of_triangles = 0;
+  aabb bbox;
+
+  // Color properties
+  material *mat;
+};
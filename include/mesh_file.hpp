@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Binary triangle mesh, laid out to be mapped into memory and read in place:
+// a header, then the vertices as three floats each, the triangles as three
+// vertex indices each and a BVH over the triangles. Sections start at
+// multiples of section_alignment bytes, and numbers are little-endian
+class mesh_file {
+public:
+  static const uint32_t version = 1;
+  static const size_t section_alignment = 64;
+
+  class header {
+  public:
+    char magic[8];
+    uint32_t version;
+    uint32_t vertex_count;
+    uint32_t triangle_count;
+    uint32_t node_count;
+    uint64_t vertex_offset;   // Bytes from the start of the file
+    uint64_t triangle_offset; // Ordered as the leaves refer to them
+    uint64_t node_offset;
+  };
+
+  // Nodes are stored depth-first as in bvh: an interior node's first child
+  // comes right after it and `offset` points to the second one, while a leaf
+  // holds the triangles [offset, offset + count)
+  class node {
+  public:
+    float lower[3];
+    float upper[3];
+    uint32_t offset;
+    uint16_t count; // Zero for interior nodes
+    uint16_t axis;  // Split axis, used to visit the nearest child first
+  };
+
+  // Deeper trees would overflow the traversal stack
+  static const int max_depth = 60;
+
+  // Whether a file of the given size is a valid mesh: its header, with every
+  // section within the file, every triangle's vertices, and a tree whose
+  // nodes refer to nodes and triangles that exist, no deeper than max_depth.
+  // Takes one pass over the triangles and the nodes
+  static bool check(const void *data, size_t size);
+
+  // Builds the BVH over the triangles, reordering them, and writes the file.
+  // Returns false if it cannot be written
+  static bool write(const std::string &path, const std::vector<float> &vertices,
+                    std::vector<uint32_t> &triangles);
+
+private:
+  static const char magic[8];
+
+  // Triangle reference used while building, in floats to halve the memory
+  // that meshes of millions of triangles take
+  class build_entry {
+  public:
+    float lower[3];
+    float upper[3];
+    uint32_t triangle;
+
+    float centroid(int axis) const {
+      return 0.5f * (this->lower[axis] + this->upper[axis]);
+    }
+  };
+
+  // Builds the subtree over entries [begin, end) with the binned SAH of bvh
+  static int build(std::vector<build_entry> &entries, int begin, int end,
+                   int depth, std::vector<node> &nodes);
+};
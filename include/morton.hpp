@@ -0,0 +1,31 @@
+#pragma once
+
+#include "aabb.hpp"
+#include <cstdint>
+
+// Spreads the lowest 10 bits of v so that two zero bits follow each one
+inline uint32_t morton_expand_bits(uint32_t v) {
+  v &= 0x3FF;
+  v = (v | (v << 16)) & 0x030000FF;
+  v = (v | (v << 8)) & 0x0300F00F;
+  v = (v | (v << 4)) & 0x030C30C3;
+  v = (v | (v << 2)) & 0x09249249;
+  return v;
+}
+
+// 30-bit Morton code of a point on a 1024^3 grid spanning the box, which
+// orders points along a Z-order curve so that nearby points get nearby codes.
+// Points outside the box are clamped onto its faces
+inline uint32_t morton_code(const point3 &p, const aabb &bounds) {
+  uint32_t cell[3];
+  for (int axis = 0; axis < 3; axis++) {
+    const interval &extent = bounds.axis_interval(axis);
+    double f = (extent.size() > 0.0)
+                   ? (p[axis] - extent.min) / extent.size()
+                   : 0.5;
+    f = std::fmin(std::fmax(f * 1024.0, 0.0), 1023.0);
+    cell[axis] = uint32_t(f);
+  }
+  return (morton_expand_bits(cell[0]) << 2) |
+         (morton_expand_bits(cell[1]) << 1) | morton_expand_bits(cell[2]);
+}
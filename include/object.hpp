@@ -1,7 +1,9 @@
 #pragma once
 
+#include "aabb.hpp"
 #include "interval.hpp"
 #include "ray.hpp"
+#include <vector>
 
 // Pre-defined class to avoid circular reference
 class material;
@@ -36,6 +38,24 @@ public:
 
   virtual bool check_hit(const ray &r, interval ray_t,
                          hit_record &rec) const = 0;
+
+  // Checks if the ray hits the object at all within the interval, without
+  // working out where
+  virtual bool check_occluded(const ray &r, interval ray_t) const {
+    hit_record rec;
+    return this->check_hit(r, ray_t, rec);
+  }
+
+  // Box enclosing the whole object, unbounded if the object is infinite
+  virtual aabb bounding_box() const = 0;
+
+  // Gives the center and radius of objects whose surface is a sphere, which
+  // accelerators may then batch into a sphere_set
+  virtual bool get_sphere(point3 &, double &) const { return false; }
+
+  // Moves and resizes objects whose surface is a sphere, returning false for
+  // any other object. Accelerators holding the object must then be refit
+  virtual bool set_sphere(const point3 &, double) { return false; }
 };
 
 class sphere : public object {
@@ -46,6 +66,14 @@ public:
   bool check_hit(const ray &r, interval ray_t,
                  hit_record &record) const override;
 
+  bool check_occluded(const ray &r, interval ray_t) const override;
+
+  aabb bounding_box() const override;
+
+  bool get_sphere(point3 &center, double &radius) const override;
+
+  bool set_sphere(const point3 &center, double radius) override;
+
   static void get_sphere_uv(const point3 &p, double &u, double &v);
 
 private:
@@ -65,6 +93,24 @@ public:
   bool check_hit(const ray &r, interval ray_t,
                  hit_record &record) const override;
 
+  bool check_occluded(const ray &r, interval ray_t) const override;
+
+  // Samples a unit direction from origin towards the bulb, uniformly over the
+  // cone it subtends, with pdf as the solid angle density of the direction
+  bool sample_direction(const point3 &origin, vec3 &direction, double &pdf,
+                        rng &gen) const;
+
+  // Density of sample_direction for any direction within the cone
+  double pdf_direction(const point3 &origin) const;
+
+  const light *get_light() const { return this->lig; }
+
+  aabb bounding_box() const override;
+
+  bool get_sphere(point3 &center, double &radius) const override;
+
+  bool set_sphere(const point3 &center, double radius) override;
+
   static void get_sphere_uv(const point3 &p, double &u, double &v);
 
 private:
@@ -76,6 +122,8 @@ private:
   light *lig;
 };
 
+// Convex region where dot(normals[i], p) + intercepts[i] <= 0 for every
+// face i, taking ownership of both arrays
 class polyhedron : public object {
 public:
   polyhedron(int num_of_faces, vec3 *normals, double *intercepts,
@@ -85,15 +133,53 @@ public:
   bool check_hit(const ray &r, interval ray_t,
                  hit_record &record) const override;
 
+  bool check_occluded(const ray &r, interval ray_t) const override;
+
+  aabb bounding_box() const override { return this->bbox; }
+
   static void get_polyhedron_uv(const point3 &p, const point3 &normal,
                                 double &u, double &v);
 
 private:
+  // Distance along the ray where it hits the polyhedron within the interval,
+  // from outside or else from inside, with the face it crosses there
+  bool find_hit(const ray &r, interval ray_t, double &t, int &face) const;
+
   // Geometric properties
   int num_of_faces;
-  vec3 *normals;
+  vec3 *normals; // Scaled to unit length, with the intercepts
   double *intercepts;
+  aabb bbox;
+
+  // The faces' planes again as a structure of arrays, padded with planes
+  // that bound nothing to a whole number of SIMD registers
+  std::vector<double> plane_x, plane_y, plane_z, plane_d;
 
   // Color properties
   material *mat;
-};
\ No newline at end of file
+};
+
+// Plane where dot(normal, p) + intercept = 0, hit as a polyhedron with that
+// single face would be, without the loop over faces. Being unbounded, it is
+// kept out of the spatial indexes and tested by every ray
+class plane : public object {
+public:
+  plane(const vec3 &normal, double intercept, material *mat);
+  ~plane();
+
+  bool check_hit(const ray &r, interval ray_t,
+                 hit_record &record) const override;
+
+  bool check_occluded(const ray &r, interval ray_t) const override;
+
+  aabb bounding_box() const override { return aabb::universe; }
+
+private:
+  // Geometric properties
+  vec3 normal; // Scaled to unit length, with the intercept
+  double intercept;
+  vec3 u_axis, v_axis; // Texture axes of polyhedron::get_polyhedron_uv
+
+  // Color properties
+  material *mat;
+};
@@ -0,0 +1,24 @@
+#pragma once
+
+#include "accelerator.hpp"
+#include "sphere_set.hpp"
+#include <vector>
+
+// Tests every object in turn, batching the spheres into a sphere_set
+class object_list : public accelerator {
+public:
+  object_list(const std::vector<object *> &objects);
+
+  bool check_hit(const ray &r, interval ray_t,
+                 hit_record &record) const override;
+
+  bool check_occluded(const ray &r, interval ray_t) const override;
+
+  size_t memory_usage() const override {
+    return this->spheres.memory_usage() + vector_bytes(this->others);
+  }
+
+private:
+  sphere_set spheres;
+  std::vector<object *> others;
+};
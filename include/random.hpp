@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstdint>
+
+// Counter-based random number generator. Every draw is a hash of the
+// stream's key and a running counter, so a stream is fully determined by what
+// it is keyed on (seed, pixel, sample and bounce) and never shares state with
+// other threads.
+class rng {
+public:
+  rng(uint64_t seed = 0) : key(mix(seed)), stream(key) {}
+
+  rng(uint64_t seed, uint64_t pixel, uint64_t sample)
+      : key(mix(mix(mix(seed) ^ pixel) ^ sample)), stream(key) {}
+
+  void set_bounce(int bounce) {
+    // Switches to the stream of the given bounce; the counter keeps running so
+    // sibling branches of the ray tree never repeat each other's draws
+    this->stream = mix(this->key + uint64_t(bounce) * increment);
+  }
+
+  uint64_t next() { return mix(this->stream + (++this->counter) * increment); }
+
+  double next_double() {
+    // Returns a random real in [0,1) from the top 53 bits of the next draw
+    return (this->next() >> 11) * 0x1.0p-53;
+  }
+
+private:
+  static uint64_t mix(uint64_t x) {
+    // SplitMix64 finalizer, a strong 64-bit bijective hash
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+  }
+
+  static const uint64_t increment = 0x9e3779b97f4a7c15ULL;
+
+  uint64_t key;
+  uint64_t stream;
+  uint64_t counter = 0;
+};
@@ -0,0 +1,48 @@
+#pragma once
+
+#include "object.hpp"
+#include <vector>
+
+// Spheres stored as a structure of arrays, so that several of them are tested
+// against a ray with each SIMD instruction: eight with AVX-512, four with AVX2
+// and one at a time when the build enables neither. Each sphere remembers the
+// object it was taken from, which fills in the record of the nearest hit
+class sphere_set {
+public:
+  // Number of spheres tested per instruction
+  static const int lanes;
+
+  void add(const object *owner, const point3 &center, double radius);
+
+  // Appends the spheres [begin, end) of another set
+  void append(const sphere_set &other, int begin, int end);
+
+  // Overwrites the spheres from `begin` on with those of another set
+  void replace(int begin, const sphere_set &other);
+
+  // Moves and resizes the sphere at the index
+  void set(int index, const point3 &center, double radius);
+
+  int size() const { return int(this->owners.size()); }
+
+  const object *owner(int index) const { return this->owners[index]; }
+
+  size_t memory_usage() const {
+    return this->owners.size() * (4 * sizeof(double) + sizeof(object *));
+  }
+
+  // Closest hit among the spheres in [begin, end)
+  bool check_hit(const ray &r, interval ray_t, int begin, int end,
+                 hit_record &record) const;
+
+  // Checks if any sphere in [begin, end) blocks the ray within the interval
+  bool check_occluded(const ray &r, interval ray_t, int begin, int end) const;
+
+private:
+  // Index of the nearest sphere hit within the interval, or -1 if none
+  int nearest_hit(const ray &r, interval ray_t, int begin, int end) const;
+
+  std::vector<double> center_x, center_y, center_z;
+  std::vector<double> radius_squared;
+  std::vector<const object *> owners;
+};
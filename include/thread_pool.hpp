@@ -0,0 +1,49 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class thread_pool {
+public:
+  thread_pool(int num_threads);
+  ~thread_pool();
+
+  // Runs task(i) for every i in [0, num_tasks) and blocks until all are done
+  void run(int num_tasks, const std::function<void(int)> &task);
+
+  int size() const { return this->num_threads; }
+
+  static int hardware_threads();
+
+private:
+  // Each worker owns a deque of task indices, taking from its front and
+  // stealing from the back of the others once it runs dry
+  class work_queue {
+  public:
+    std::mutex lock;
+    std::deque<int> tasks;
+  };
+
+  void worker_loop(int worker_index);
+  void work(int worker_index);
+  bool pop_task(int worker_index, int &task_index);
+  bool steal_task(int worker_index, int &task_index);
+
+  int num_threads;
+  std::vector<std::thread> workers;
+  std::vector<work_queue> queues;
+
+  // Current job
+  const std::function<void(int)> *job = nullptr;
+  int generation = 0;
+  int workers_busy = 0;
+  bool stopping = false;
+
+  std::mutex state_lock;
+  std::condition_variable job_posted;
+  std::condition_variable job_finished;
+};
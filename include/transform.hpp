@@ -0,0 +1,37 @@
+#pragma once
+
+#include "aabb.hpp"
+#include "vec3.hpp"
+
+// Affine transform p -> L p + t, with L a 3x3 matrix stored by rows
+class transform {
+public:
+  transform(); // Identity
+
+  static transform translation(const vec3 &offset);
+  static transform scaling(double factor);
+  static transform scaling(const vec3 &factors);
+  static transform rotation(const vec3 &axis, double degrees);
+
+  // Applies `other` first, then this transform
+  transform operator*(const transform &other) const;
+
+  transform inverse() const;
+
+  point3 apply_point(const point3 &p) const;
+  vec3 apply_vector(const vec3 &v) const;
+
+  // Applies the transpose of L, which maps normals through the inverse
+  // transform: normals of a transformed surface are L^-T n
+  vec3 apply_transposed(const vec3 &v) const;
+
+  // Box enclosing the transformed box
+  aabb apply_box(const aabb &box) const;
+
+  // Checks if L is a rotation times a uniform scale, giving the scale
+  bool is_similarity(double &scale) const;
+
+private:
+  double linear[3][3];
+  vec3 offset;
+};
@@ -0,0 +1,35 @@
+#pragma once
+
+// Counts of the work rays take to trace, to compare acceleration structures:
+// rays traced, nodes (or grid cells) visited and objects tested. Counting
+// slows traversal down, so it is only compiled in when
+// RAYTRACER_TRAVERSAL_STATS is defined, and the counters do nothing otherwise
+class traversal_stats {
+public:
+#if defined(RAYTRACER_TRAVERSAL_STATS)
+  static void count_rays(int n) { local().rays += n; }
+  static void count_nodes(int n) { local().nodes += n; }
+  static void count_objects(int n) { local().objects += n; }
+#else
+  static void count_rays(int) {}
+  static void count_nodes(int) {}
+  static void count_objects(int) {}
+#endif
+
+  // Prints the averages per ray over what the calling thread and every
+  // finished thread counted. Rays into an instanced world count again there
+  static void report();
+
+private:
+  // Each thread counts on its own, adding its counts to the totals as it ends
+  class counters {
+  public:
+    long long rays = 0;
+    long long nodes = 0;
+    long long objects = 0;
+
+    ~counters();
+  };
+
+  static counters &local();
+};
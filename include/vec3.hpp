@@ -1,6 +1,7 @@
 #pragma once
 
 #include "constants.hpp"
+#include "random.hpp"
 #include <cmath>
 #include <iostream>
 
@@ -9,14 +10,14 @@ inline double degrees_to_radians(double degrees) {
   return degrees * mathconst::pi / 180.0;
 }
 
-inline double random_double() {
+inline double random_double(rng &gen) {
   // Returns a random real in [0,1).
-  return std::rand() / (RAND_MAX + 1.0);
+  return gen.next_double();
 }
 
-inline double random_double(double min, double max) {
+inline double random_double(rng &gen, double min, double max) {
   // Returns a random real in [min,max).
-  return min + (max - min) * random_double();
+  return min + (max - min) * random_double(gen);
 }
 
 class vec3 {
@@ -56,13 +57,13 @@ public:
     return e[0] * e[0] + e[1] * e[1] + e[2] * e[2];
   }
 
-  static vec3 random() {
-    return vec3(random_double(), random_double(), random_double());
+  static vec3 random(rng &gen) {
+    return vec3(random_double(gen), random_double(gen), random_double(gen));
   }
 
-  static vec3 random(double min, double max) {
-    return vec3(random_double(min, max), random_double(min, max),
-                random_double(min, max));
+  static vec3 random(rng &gen, double min, double max) {
+    return vec3(random_double(gen, min, max), random_double(gen, min, max),
+                random_double(gen, min, max));
   }
 
   bool near_zero() const {
@@ -114,20 +115,29 @@ inline vec3 cross(const vec3 &u, const vec3 &v) {
 
 inline vec3 unit_vector(const vec3 &v) { return v / v.length(); }
 
-inline vec3 random_unit_vector() {
+inline vec3 random_unit_vector(rng &gen) {
   // Samples random vectors until one is inside a unit sphere
   // and has significant length to avoid underflow
   while (true) {
-    vec3 p = vec3::random(-1, 1);
+    vec3 p = vec3::random(gen, -1, 1);
     double lensq = p.length_squared();
     if (1e-160 < lensq && lensq <= 1)
       return p / sqrt(lensq);
   }
 }
 
-inline vec3 random_on_hemisphere(const vec3 &normal) {
+inline void orthonormal_basis(const vec3 &n, vec3 &t, vec3 &b) {
+  // Completes the unit vector n to an orthonormal basis (Duff et al. 2017)
+  double sign = std::copysign(1.0, n.z());
+  double a = -1.0 / (sign + n.z());
+  double c = n.x() * n.y() * a;
+  t = vec3(1.0 + sign * n.x() * n.x() * a, sign * c, -sign * n.x());
+  b = vec3(c, sign + n.y() * n.y() * a, -n.y());
+}
+
+inline vec3 random_on_hemisphere(rng &gen, const vec3 &normal) {
   // Generates a random unit vector
-  vec3 on_unit_sphere = random_unit_vector();
+  vec3 on_unit_sphere = random_unit_vector(gen);
   // Adjusts it to be under 90 degrees from the normal
   if (dot(on_unit_sphere, normal) > 0.0)
     return on_unit_sphere;
@@ -135,10 +145,10 @@ inline vec3 random_on_hemisphere(const vec3 &normal) {
     return -on_unit_sphere;
 }
 
-inline vec3 sample_square() {
+inline vec3 sample_square(rng &gen) {
   // Returns the vector to a random point in the [-.5,-.5]-[+.5,+.5] unit
   // square
-  return vec3(random_double() - 0.5, random_double() - 0.5, 0);
+  return vec3(random_double(gen) - 0.5, random_double(gen) - 0.5, 0);
 }
 
 inline vec3 reflect(const vec3 &v, const vec3 &n) {
@@ -156,20 +166,20 @@ inline vec3 refract(const vec3 &v, const vec3 &n, double etai_over_etat) {
   return r_out_perp + r_out_parallel;
 }
 
-inline vec3 random_in_unit_disk() {
+inline vec3 random_in_unit_disk(rng &gen) {
   // Samples random vectors until one is inside a unit circunference (2D)
   // and has significant length to avoid underflow
   while (true) {
-    vec3 p = vec3(random_double(-1, 1), random_double(-1, 1), 0);
+    vec3 p = vec3(random_double(gen, -1, 1), random_double(gen, -1, 1), 0);
     if (p.length_squared() < 1)
       return p;
   }
 }
 
-inline point3 sample_disk(vec3 center, vec3 horizontal_radius,
+inline point3 sample_disk(rng &gen, vec3 center, vec3 horizontal_radius,
                           vec3 vertical_radius) {
   // Returns a random point in the camera defocus disk
-  vec3 p = random_in_unit_disk();
+  vec3 p = random_in_unit_disk(gen);
   return center + (p[0] * horizontal_radius) + (p[1] * vertical_radius);
 }
 
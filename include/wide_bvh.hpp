@@ -0,0 +1,125 @@
+#pragma once
+
+#include "accelerator.hpp"
+#include "bvh.hpp"
+#include "sphere_set.hpp"
+#include <vector>
+
+// Bounding volume hierarchy with up to `width` children per node, made by
+// collapsing the levels of a SAH tree. The children's boxes are stored as a
+// structure of arrays, so that a ray is tested against all of them with one
+// SIMD instruction per slab: eight at a time with AVX-512 and four otherwise
+class wide_bvh : public accelerator {
+public:
+#if defined(__AVX512F__)
+  static constexpr int width = 8;
+#else
+  static constexpr int width = 4;
+#endif
+
+  // Spatial splits are made in the SAH tree, see bvh
+  wide_bvh(const std::vector<object *> &objects, bool spatial_splits = false);
+
+  bool check_hit(const ray &r, interval ray_t,
+                 hit_record &record) const override;
+
+  bool check_occluded(const ray &r, interval ray_t) const override;
+
+  // Refits the children's boxes above the changed objects, from their leaves
+  // up, visiting only those and their ancestors, one depth at a time shared
+  // with the pool as in bvh. Unlike bvh, no part of the tree is rebuilt: once
+  // its SAH cost grows too much since it was built, refit returns false so
+  // that it is built again whole
+  bool refit(const std::vector<const object *> &changed,
+             thread_pool &pool) override;
+
+  int node_count() const { return int(this->nodes.size()); }
+  int reference_count() const {
+    return int(this->primitives.size()) + this->spheres.size();
+  }
+  int leaf_count() const { return int(this->leaves.size()); }
+  int unbounded_count() const { return int(this->unbounded.size()); }
+
+  size_t memory_usage() const override {
+    return vector_bytes(this->nodes) + vector_bytes(this->leaves) +
+           vector_bytes(this->primitives) + this->spheres.memory_usage() +
+           vector_bytes(this->unbounded) + vector_bytes(this->node_slots) +
+           vector_bytes(this->leaf_slots) + vector_bytes(this->references);
+  }
+
+private:
+  // Children are stored in `child`: an index c >= 0 refers to another node,
+  // and c < 0 to the leaf ~c. Slots past `count` are unused. Nodes start on a
+  // cache line, and are stored depth-first so that a subtree stays together
+  class alignas(64) node {
+  public:
+    double lower[3][width]; // Box minimums, by axis and then child
+    double upper[3][width];
+    int child[width];
+    int count;
+  };
+
+  // A leaf keeps its spheres in `spheres`, starting at `sphere_offset`, and
+  // its other objects in `primitives`, starting at `offset`
+  class leaf {
+  public:
+    int offset;
+    int count; // Number of objects other than spheres
+    int sphere_offset;
+    int sphere_count;
+  };
+
+  // Where a node or leaf is referenced from: child `index` of `node`
+  class slot {
+  public:
+    int node;
+    int index;
+  };
+
+  // Leaf referencing an object, at a sphere if sphere >= 0
+  class reference {
+  public:
+    const object *obj;
+    int leaf;
+    int sphere;
+  };
+
+  int collapse(const bvh &binary, int binary_index);
+
+  // Finds the slot of each node and leaf and the leaves referencing each
+  // object, and works out the cost of the tree
+  void link_nodes();
+
+  // Part of the tree's SAH cost due to the child's box, its area times the
+  // cost of entering it
+  double slot_cost(const slot &s) const;
+
+  // Recomputes the box of a child (a node, or the leaf ~child) in its slot,
+  // adding the change of the tree's cost to cost_change. Returns whether the
+  // box changed
+  bool refit_child(int child, double &cost_change);
+
+  // Depth of a child's slot, one past its parent's
+  int child_depth(int child) const;
+
+  bool check_leaf(const leaf &l, const ray &r, interval ray_t,
+                  hit_record &record) const;
+
+  // Mask of the children whose boxes the ray crosses within [t_min, t_max],
+  // with the distance where it enters each of them
+  static unsigned child_hits(const node &n, const point3 &origin,
+                             const vec3 &inv_direction, double t_min,
+                             double t_max, double *t_entry);
+
+  std::vector<node> nodes;
+  std::vector<leaf> leaves;
+  std::vector<const object *> primitives;
+  sphere_set spheres;
+
+  // Left empty until the first refit. The root has no slot, with node -1
+  std::vector<slot> node_slots;
+  std::vector<slot> leaf_slots;
+  std::vector<reference> references; // Sorted by object
+  double cost = 0.0;
+  double built_cost = 0.0;
+};
@@ -0,0 +1,112 @@
+#pragma once
+
+#include "accelerator.hpp"
+#include "traversal_stats.hpp"
+#include <bit>
+#include <vector>
+
+// Traversal of the trees whose nodes reference up to `width` children in
+// `child`, c >= 0 being another node and c < 0 the leaf ~c: wide_bvh and
+// compressed_bvh. They differ only in how a node's child boxes are stored,
+// so each passes child_hits(index, t_min, t_max, t_entry), returning the mask
+// of node `index`'s children the ray crosses within [t_min, t_max], with the
+// distance where it enters each of them. The traversal is inlined into its
+// caller, which keeps the ray and the tests' state in registers; as a call
+// it traced about a tenth slower
+template <typename node_type, int width> class wide_traversal {
+public:
+  // Visits the leaves the ray reaches within the interval, nearest first.
+  // check_leaf(leaf, ray_t) returns the interval to keep searching, shrunk
+  // to the nearest hit it finds
+  template <typename hits_test, typename leaf_test>
+  [[gnu::always_inline]] static void
+  closest_hit(const std::vector<node_type> &nodes, interval ray_t,
+              hits_test child_hits, leaf_test check_leaf) {
+    // Each stack entry remembers where the ray enters it, so that it is
+    // skipped if a nearer hit turns up before it is popped
+    int stack[max_stack_size];
+    double stack_entry[max_stack_size];
+    stack[0] = 0;
+    stack_entry[0] = ray_t.min;
+    int stack_size = 1;
+    while (stack_size > 0) {
+      stack_size--;
+      int current = stack[stack_size];
+      if (stack_entry[stack_size] > ray_t.max)
+        continue;
+
+      if (current < 0) {
+        ray_t = check_leaf(~current, ray_t);
+        continue;
+      }
+
+      const node_type &n = nodes[current];
+      traversal_stats::count_nodes(1);
+      double t_entry[width];
+      unsigned hits = child_hits(current, ray_t.min, ray_t.max, t_entry);
+      if (hits == 0)
+        continue;
+
+      // Children are pushed farthest first, so that the nearest one is
+      // visited next and its hits shrink the interval tested against the
+      // others
+      int order[width];
+      int num_hits = 0;
+      while (hits != 0) {
+        int c = std::countr_zero(hits);
+        hits &= hits - 1;
+        int k = num_hits++;
+        for (; k > 0 && t_entry[order[k - 1]] < t_entry[c]; k--)
+          order[k] = order[k - 1];
+        order[k] = c;
+      }
+
+      for (int k = 0; k < num_hits; k++) {
+        stack[stack_size] = n.child[order[k]];
+        stack_entry[stack_size] = t_entry[order[k]];
+        stack_size++;
+      }
+
+      int next = n.child[order[num_hits - 1]];
+      if (next >= 0)
+        accelerator::prefetch(nodes[next]);
+    }
+  }
+
+  // Whether check_leaf(leaf) finds a blocker in any leaf the ray reaches
+  // within the interval. Any blocker will do, so children are visited in
+  // storage order
+  template <typename hits_test, typename leaf_test>
+  [[gnu::always_inline]] static bool
+  any_hit(const std::vector<node_type> &nodes, interval ray_t,
+          hits_test child_hits, leaf_test check_leaf) {
+    int stack[max_stack_size];
+    stack[0] = 0;
+    int stack_size = 1;
+    while (stack_size > 0) {
+      int current = stack[--stack_size];
+      if (current < 0) {
+        if (check_leaf(~current))
+          return true;
+        continue;
+      }
+
+      const node_type &n = nodes[current];
+      traversal_stats::count_nodes(1);
+      double t_entry[width];
+      unsigned hits = child_hits(current, ray_t.min, ray_t.max, t_entry);
+      for (int c = width - 1; c >= 0; c--)
+        if ((hits >> c) & 1u)
+          stack[stack_size++] = n.child[c];
+
+      if (stack_size > 0 && stack[stack_size - 1] >= 0)
+        accelerator::prefetch(nodes[stack[stack_size - 1]]);
+    }
+    return false;
+  }
+
+private:
+  // Every level of the binary tree fills at most one level here, and each
+  // level leaves at most width - 1 siblings pending on the stack
+  static constexpr int max_stack_size = 64 * width;
+};
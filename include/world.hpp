@@ -1,8 +1,37 @@
 #pragma once
 
+#include "accelerator.hpp"
 #include "object.hpp"
+#include "transform.hpp"
+#include <string>
 #include <vector>
 
+// Spatial index used by world::check_hit; `wide_bvh` is the fastest to trace
+// and `bvh` is the binary tree it is collapsed from; `compressed_bvh` stores
+// the wide nodes in a fraction of the memory; `lbvh` builds much faster, in
+// parallel, but traces slower; `grid` is a uniform grid, quick to build and
+// good for dense, evenly spread scenes; `lazy_bvh` builds only the top of a
+// tree up front and the rest as rays reach it, so tracing starts at once;
+// `list` tests every object in turn, spheres several at a time, and is kept
+// for debugging
+enum class accel_type {
+  list,
+  bvh,
+  wide_bvh,
+  compressed_bvh,
+  lbvh,
+  grid,
+  lazy_bvh
+};
+
+// New center and radius of a sphere or bulb, see world::update
+class object_update {
+public:
+  object *obj;
+  point3 center;
+  double radius;
+};
+
 class world {
 public:
   world();
@@ -12,9 +41,53 @@ public:
   void add_bulb(point3 center, double radius, light *lig);
   void add_polyhedron(int num_of_faces, vec3 *normals, double *intercepts,
                       material *mat);
+  void add_plane(const vec3 &normal, double intercept, material *mat);
+
+  // Maps a mesh written by obj2mesh, see mesh
+  void add_mesh(const std::string &path, material *mat);
+
+  // Places a built world in this one, see instance
+  void add_instance(const world *prototype, const transform &to_world,
+                    material *mat = nullptr);
+
+  // Builds the spatial index over the objects added so far; must be called
+  // again after adding more objects. Parallel builders use num_threads, or
+  // every hardware thread if it is not positive. Spatial splits apply to the
+  // SAH trees (bvh, wide_bvh, compressed_bvh and lazy_bvh), see bvh
+  void build(accel_type type = accel_type::wide_bvh, int num_threads = 0,
+             bool spatial_splits = false);
+
+  // Moves and resizes spheres and bulbs of this world between frames, and
+  // brings the spatial index up to date. A bvh or wide_bvh is refit, with
+  // the cost proportional to the objects changed: a bvh is rebuilt only
+  // where its quality degrades too much, and a wide_bvh whole once it does.
+  // The other indexes are built again as they were.
+  // Returns false if some object is neither a sphere nor a bulb, leaving it
+  // as it was. Instances of this world do not see their bounds change
+  bool update(const std::vector<object_update> &updates, int num_threads = 0);
 
   bool check_hit(const ray &r, interval ray_t, hit_record &record) const;
 
+  // Closest hits of a packet of up to accelerator::max_packet_size rays
+  void check_hit_packet(const ray *rays, int count, interval ray_t,
+                        hit_record *records, bool *hits) const;
+
+  // Checks if anything blocks the ray within the interval
+  bool check_occluded(const ray &r, interval ray_t) const;
+
+  const std::vector<object *> &get_objects() const { return this->objects; }
+  const std::vector<bulb *> &get_lights() const { return this->lights; }
+
+  // Box enclosing every bounded object
+  aabb bounding_box() const;
+
 private:
   std::vector<object *> objects;
+  std::vector<bulb *> lights; // Also in objects, which owns them
+  accelerator *accel = nullptr;
+
+  // How the index was last built, to build it again after updates
+  accel_type type = accel_type::wide_bvh;
+  int num_threads = 0;
+  bool spatial_splits = false;
 };
\ No newline at end of file
@@ -0,0 +1,51 @@
+#include "aabb.hpp"
+
+// Spelled out instead of using interval::empty/universe, whose initialization
+// order relative to these is unspecified
+const aabb aabb::empty = aabb();
+const aabb aabb::universe =
+    aabb(interval(-mathconst::infinity, +mathconst::infinity),
+         interval(-mathconst::infinity, +mathconst::infinity),
+         interval(-mathconst::infinity, +mathconst::infinity));
+
+aabb::aabb(const point3 &a, const point3 &b) {
+  // Treats the two points as opposite corners, in any order
+  this->x = interval(std::fmin(a.x(), b.x()), std::fmax(a.x(), b.x()));
+  this->y = interval(std::fmin(a.y(), b.y()), std::fmax(a.y(), b.y()));
+  this->z = interval(std::fmin(a.z(), b.z()), std::fmax(a.z(), b.z()));
+}
+
+aabb::aabb(const aabb &a, const aabb &b)
+    : x(a.x, b.x), y(a.y, b.y), z(a.z, b.z) {}
+
+bool aabb::is_empty() const {
+  return (this->x.min > this->x.max) || (this->y.min > this->y.max) ||
+         (this->z.min > this->z.max);
+}
+
+bool aabb::is_bounded() const {
+  return std::isfinite(this->x.size()) && std::isfinite(this->y.size()) &&
+         std::isfinite(this->z.size());
+}
+
+int aabb::longest_axis() const {
+  if (this->x.size() > this->y.size())
+    return (this->x.size() > this->z.size()) ? 0 : 2;
+  return (this->y.size() > this->z.size()) ? 1 : 2;
+}
+
+double aabb::surface_area() const {
+  if (this->is_empty())
+    return 0.0;
+
+  double dx = this->x.size();
+  double dy = this->y.size();
+  double dz = this->z.size();
+  return 2.0 * (dx * dy + dy * dz + dz * dx);
+}
+
+point3 aabb::centroid() const {
+  return point3(0.5 * (this->x.min + this->x.max),
+                0.5 * (this->y.min + this->y.max),
+                0.5 * (this->z.min + this->z.max));
+}
@@ -0,0 +1,1096 @@
+#include "bvh.hpp"
+#include "thread_pool.hpp"
+#include "traversal_stats.hpp"
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <functional>
+#include <unordered_set>
+
+#if defined(__AVX512F__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+// Binned SAH parameters
+static const int num_bins = 12;
+static const int max_leaf_size = 4;
+static const double traversal_cost = 1.0; // Relative to one object test
+
+// Deeper trees would overflow the traversal stack
+static const int max_depth = 60;
+
+// Spatial splits may add up to this fraction of the objects in references.
+// Without the overlap threshold of Stich et al. (see build), this cap alone
+// bounds the memory and building time they take. The SAH only splits where
+// it pays off, so few scenes come near it, and it is kept loose so that the
+// scenes gaining most from splits are not cut off midway
+static const double max_extra_references = 0.3;
+
+// Refit rebuilds a subtree once its cost grows past this factor of the cost
+// it was built with
+static const double max_cost_growth = 1.5;
+
+// Nodes refit by each task, as smaller levels are not worth sharing out
+static const int refit_chunk_size = 1024;
+
+static int bin_index(double value, const interval &extent) {
+  // Bin of the given coordinate within the extent
+  int b = int(num_bins * (value - extent.min) / extent.size());
+  return std::min(num_bins - 1, b);
+}
+
+static double bin_plane(int b, const interval &extent) {
+  // Lower boundary of bin b of the extent, or its end past the last bin
+  if (b >= num_bins)
+    return extent.max;
+  return extent.min + b * (extent.size() / num_bins);
+}
+
+bvh::bvh(const std::vector<object *> &objects, bool spatial_splits)
+    : spatial_splits(spatial_splits) {
+  std::vector<build_entry> entries;
+  entries.reserve(objects.size());
+  for (auto obj : objects) {
+    aabb bounds = obj->bounding_box();
+    if (!bounds.is_bounded())
+      this->unbounded.emplace_back(obj);
+    else if (!bounds.is_empty())
+      entries.push_back(build_entry{obj, bounds, bounds.centroid()});
+  }
+
+  this->build_root(entries);
+}
+
+void bvh::build_root(std::vector<build_entry> &entries) {
+  if (entries.empty())
+    return;
+
+  this->nodes.reserve(2 * entries.size());
+  int split_budget = int(max_extra_references * entries.size());
+  this->build(entries, 0, int(entries.size()), 0,
+              this->spatial_splits ? &split_budget : nullptr);
+}
+
+int bvh::build(std::vector<build_entry> &entries, int begin, int end,
+               int depth, int *split_budget) {
+  int index = int(this->nodes.size());
+  this->nodes.emplace_back();
+
+  aabb bounds;
+  aabb centroid_bounds;
+  for (int i = begin; i < end; i++) {
+    bounds = aabb(bounds, entries[i].bounds);
+    centroid_bounds =
+        aabb(centroid_bounds, aabb(entries[i].centroid, entries[i].centroid));
+  }
+  this->nodes[index].bounds = bounds;
+
+  int count = end - begin;
+  int best_axis = -1;
+  int best_split = 0;
+  double best_cost = mathconst::infinity;
+  if (count > 1 && depth < max_depth)
+    best_cost = find_object_split(entries, begin, end, bounds, centroid_bounds,
+                                  best_axis, best_split);
+
+  // A spatial split replaces the object split when cheaper, which happens where
+  // the halves of the object split overlap much, as around objects far larger
+  // than their neighbors. The overlap threshold of Stich et al. is left out:
+  // taken relative to the root, it never lets a scene with a ground sphere
+  // split, and the reference budget already bounds the building time
+  int spatial_axis = -1;
+  double spatial_plane = 0.0;
+  if (split_budget != nullptr && *split_budget > 0 && count > 1 &&
+      depth < max_depth) {
+    int axis;
+    double plane;
+    double cost = find_spatial_split(entries, begin, end, bounds,
+                                     *split_budget, axis, plane);
+    if (cost < best_cost) {
+      best_cost = cost;
+      spatial_axis = axis;
+      spatial_plane = plane;
+    }
+  }
+
+  // Makes a leaf when splitting does not pay off, unless it would be too big
+  if (count <= max_leaf_size && best_cost >= count) {
+    best_axis = -1;
+    spatial_axis = -1;
+  }
+
+  if (spatial_axis >= 0) {
+    // Objects straddling the plane go to both sides, clipped to each
+    std::vector<build_entry> left, right;
+    for (int i = begin; i < end; i++) {
+      const interval &slab = entries[i].bounds.axis_interval(spatial_axis);
+      if (slab.max <= spatial_plane) {
+        left.push_back(entries[i]);
+      } else if (slab.min >= spatial_plane) {
+        right.push_back(entries[i]);
+      } else {
+        left.push_back(clip_entry(entries[i], spatial_axis, slab.min,
+                                  spatial_plane));
+        right.push_back(clip_entry(entries[i], spatial_axis, spatial_plane,
+                                   slab.max));
+      }
+    }
+
+    // The binned counts only estimate the sides, so a side may still end
+    // up empty or with every object, in which case the object split is used
+    if (!left.empty() && !right.empty() && int(left.size()) < count &&
+        int(right.size()) < count) {
+      *split_budget -= int(left.size() + right.size()) - count;
+      this->build(left, 0, int(left.size()), depth + 1, split_budget);
+      int second_child =
+          this->build(right, 0, int(right.size()), depth + 1, split_budget);
+      this->nodes[index].offset = second_child;
+      this->nodes[index].count = 0;
+      this->nodes[index].axis = spatial_axis;
+      this->nodes[index].sphere_offset = 0;
+      this->nodes[index].sphere_count = 0;
+      return index;
+    }
+  }
+
+  int mid = begin;
+  if (best_axis >= 0) {
+    mid = partition_objects(entries, begin, end, centroid_bounds, best_axis,
+                            best_split);
+  } else if (count > max_leaf_size && depth < max_depth) {
+    // Every centroid coincides, so any halving is as good as another
+    best_axis = bounds.longest_axis();
+    mid = begin + count / 2;
+  }
+
+  if (best_axis < 0) {
+    this->nodes[index].offset = int(this->primitives.size());
+    this->nodes[index].count = count;
+    this->nodes[index].axis = 0;
+    this->nodes[index].sphere_offset = this->spheres.size();
+    point3 center;
+    double radius;
+    for (int i = begin; i < end; i++) {
+      if (entries[i].obj->get_sphere(center, radius))
+        this->spheres.add(entries[i].obj, center, radius);
+      else
+        this->primitives.emplace_back(entries[i].obj);
+    }
+    this->nodes[index].sphere_count =
+        this->spheres.size() - this->nodes[index].sphere_offset;
+    return index;
+  }
+
+  this->build(entries, begin, mid, depth + 1, split_budget);
+  int second_child = this->build(entries, mid, end, depth + 1, split_budget);
+  this->nodes[index].offset = second_child;
+  this->nodes[index].count = 0;
+  this->nodes[index].axis = best_axis;
+  this->nodes[index].sphere_offset = 0;
+  this->nodes[index].sphere_count = 0;
+  return index;
+}
+
+double bvh::find_object_split(const std::vector<build_entry> &entries,
+                              int begin, int end, const aabb &bounds,
+                              const aabb &centroid_bounds, int &best_axis,
+                              int &best_split) {
+  // Looks for the cheapest split among the bin boundaries of every axis,
+  // with costs measured relative to the area of the node
+  double best_cost = mathconst::infinity;
+  double parent_area = bounds.surface_area();
+
+  for (int axis = 0; axis < 3; axis++) {
+    const interval &extent = centroid_bounds.axis_interval(axis);
+    if (extent.size() <= 0.0)
+      continue;
+
+    aabb bin_bounds[num_bins];
+    int bin_count[num_bins] = {0};
+    for (int i = begin; i < end; i++) {
+      int b = bin_index(entries[i].centroid[axis], extent);
+      bin_bounds[b] = aabb(bin_bounds[b], entries[i].bounds);
+      bin_count[b]++;
+    }
+
+    // Sweeps from the right to know the cost of every right-hand side
+    double right_area[num_bins];
+    int right_count[num_bins];
+    aabb sweep;
+    int sweep_count = 0;
+    for (int b = num_bins - 1; b > 0; b--) {
+      sweep = aabb(sweep, bin_bounds[b]);
+      sweep_count += bin_count[b];
+      right_area[b] = sweep.surface_area();
+      right_count[b] = sweep_count;
+    }
+
+    // Then from the left, splitting before bin b
+    sweep = aabb();
+    sweep_count = 0;
+    for (int b = 1; b < num_bins; b++) {
+      sweep = aabb(sweep, bin_bounds[b - 1]);
+      sweep_count += bin_count[b - 1];
+      if (sweep_count == 0 || right_count[b] == 0)
+        continue;
+
+      double cost = traversal_cost + (sweep.surface_area() * sweep_count +
+                                      right_area[b] * right_count[b]) /
+                                         parent_area;
+      if (cost < best_cost) {
+        best_cost = cost;
+        best_axis = axis;
+        best_split = b;
+      }
+    }
+  }
+  return best_cost;
+}
+
+int bvh::partition_objects(std::vector<build_entry> &entries, int begin,
+                           int end, const aabb &centroid_bounds, int axis,
+                           int split) {
+  const interval &extent = centroid_bounds.axis_interval(axis);
+  auto first_right =
+      std::partition(entries.begin() + begin, entries.begin() + end,
+                     [&](const build_entry &e) {
+                       return bin_index(e.centroid[axis], extent) < split;
+                     });
+  return int(first_right - entries.begin());
+}
+
+double bvh::find_spatial_split(const std::vector<build_entry> &entries,
+                               int begin, int end, const aabb &bounds,
+                               int max_references, int &best_axis,
+                               double &best_plane) {
+  int count = end - begin;
+  double parent_area = bounds.surface_area();
+  double best_cost = mathconst::infinity;
+
+  for (int axis = 0; axis < 3; axis++) {
+    const interval &extent = bounds.axis_interval(axis);
+    if (extent.size() <= 0.0)
+      continue;
+
+    // Bins of equal width over the node's box, each bounding the parts of
+    // the objects within it. Objects are counted where they start and where
+    // they end, as they belong to the left side of any plane past their start
+    // and to the right side of any plane before their end
+    aabb bin_bounds[num_bins];
+    int entering[num_bins] = {0};
+    int leaving[num_bins] = {0};
+    for (int i = begin; i < end; i++) {
+      const interval &slab = entries[i].bounds.axis_interval(axis);
+      int first = bin_index(slab.min, extent);
+      int last = bin_index(slab.max, extent);
+      for (int b = first; b <= last; b++) {
+        double min = std::fmax(slab.min, bin_plane(b, extent));
+        double max = std::fmin(slab.max, bin_plane(b + 1, extent));
+        bin_bounds[b] =
+            aabb(bin_bounds[b], clip_entry(entries[i], axis, min, max).bounds);
+      }
+      entering[first]++;
+      leaving[last]++;
+    }
+
+    // Sweeps as in build, now with objects counted on both sides
+    double right_area[num_bins];
+    int right_count[num_bins];
+    aabb sweep;
+    int sweep_count = 0;
+    for (int b = num_bins - 1; b > 0; b--) {
+      sweep = aabb(sweep, bin_bounds[b]);
+      sweep_count += leaving[b];
+      right_area[b] = sweep.surface_area();
+      right_count[b] = sweep_count;
+    }
+
+    sweep = aabb();
+    sweep_count = 0;
+    for (int b = 1; b < num_bins; b++) {
+      sweep = aabb(sweep, bin_bounds[b - 1]);
+      sweep_count += entering[b - 1];
+
+      // Each side must lose some objects, or clusters of objects straddling
+      // every plane would be split over and over
+      if (sweep_count == 0 || right_count[b] == 0 || sweep_count >= count ||
+          right_count[b] >= count ||
+          sweep_count + right_count[b] - count > max_references)
+        continue;
+
+      double cost = traversal_cost + (sweep.surface_area() * sweep_count +
+                                      right_area[b] * right_count[b]) /
+                                         parent_area;
+      if (cost < best_cost) {
+        best_cost = cost;
+        best_axis = axis;
+        best_plane = bin_plane(b, extent);
+      }
+    }
+  }
+  return best_cost;
+}
+
+bvh::build_entry bvh::clip_entry(const build_entry &e, int axis, double min,
+                                 double max) {
+  interval slabs[3] = {e.bounds.x, e.bounds.y, e.bounds.z};
+  slabs[axis] = interval(std::fmax(min, slabs[axis].min),
+                         std::fmin(max, slabs[axis].max));
+
+  // A sphere's part is also bounded across the axis by the circle it cuts on
+  // the plane nearest its center, padded for the rounding of that circle
+  point3 center;
+  double radius;
+  if (e.obj->get_sphere(center, radius)) {
+    double distance = std::fmax(
+        0.0, std::fmax(slabs[axis].min - center[axis],
+                       center[axis] - slabs[axis].max));
+    double half_width =
+        std::sqrt(std::fmax(0.0, radius * radius - distance * distance)) +
+        1e-9 * radius;
+    for (int other = 0; other < 3; other++) {
+      if (other == axis)
+        continue;
+      slabs[other] =
+          interval(std::fmax(slabs[other].min, center[other] - half_width),
+                   std::fmin(slabs[other].max, center[other] + half_width));
+    }
+  }
+
+  aabb bounds(slabs[0], slabs[1], slabs[2]);
+  return build_entry{e.obj, bounds, bounds.centroid()};
+}
+
+bool bvh::refit(const std::vector<const object *> &changed,
+                thread_pool &pool) {
+  if (this->parents.size() != this->nodes.size()) {
+    this->init_costs();
+    this->link_nodes();
+  }
+
+  // Moves the spheres, and sorts the leaves holding the changed objects by
+  // their depth
+  std::vector<std::vector<int>> levels(max_depth + 1);
+  auto by_object = [](const reference &ref, const object *obj) {
+    return std::less<const object *>()(ref.obj, obj);
+  };
+  for (auto obj : changed) {
+    auto ref = std::lower_bound(this->references.begin(),
+                                this->references.end(), obj, by_object);
+    if (ref == this->references.end() || ref->obj != obj) {
+      // Objects outside the tree may only stay out while unbounded
+      if (!obj->bounding_box().is_bounded() &&
+          std::find(this->unbounded.begin(), this->unbounded.end(), obj) !=
+              this->unbounded.end())
+        continue;
+      return false;
+    }
+
+    point3 center;
+    double radius;
+    obj->get_sphere(center, radius);
+    for (; ref != this->references.end() && ref->obj == obj; ref++) {
+      if (ref->sphere >= 0)
+        this->spheres.set(ref->sphere, center, radius);
+      levels[this->node_depth(ref->node)].push_back(ref->node);
+    }
+  }
+
+  // Nodes of the same depth do not depend on each other, so each level is
+  // refit in parallel once the one below it is done
+  std::vector<int> refit_nodes;
+  for (int depth = max_depth; depth >= 0; depth--) {
+    std::vector<int> &level = levels[depth];
+    if (level.empty())
+      continue;
+    std::sort(level.begin(), level.end());
+    level.erase(std::unique(level.begin(), level.end()), level.end());
+
+    int size = int(level.size());
+    int num_tasks =
+        std::min(pool.size(), (size + refit_chunk_size - 1) / refit_chunk_size);
+    if (num_tasks > 1) {
+      pool.run(num_tasks, [&](int task) {
+        int begin = int((long long)size * task / num_tasks);
+        int end = int((long long)size * (task + 1) / num_tasks);
+        for (int i = begin; i < end; i++)
+          this->refit_node(level[i]);
+      });
+    } else {
+      for (int index : level)
+        this->refit_node(index);
+    }
+
+    for (int index : level) {
+      refit_nodes.push_back(index);
+      if (depth > 0)
+        levels[depth - 1].push_back(this->parents[index]);
+    }
+  }
+
+  // Rebuilding a subtree also rebuilds the degraded ones within it, so only
+  // the topmost are taken. Leaves would come out the same
+  std::sort(refit_nodes.begin(), refit_nodes.end());
+  std::vector<int> roots;
+  int covered_end = 0;
+  for (int index : refit_nodes) {
+    if (index < covered_end || this->nodes[index].count > 0)
+      continue;
+    if (this->cost[index] > max_cost_growth * this->built_cost[index]) {
+      roots.push_back(index);
+      covered_end = this->subtree_end(index);
+    }
+  }
+
+  if (!roots.empty())
+    this->rebuild_subtrees(roots, pool);
+  return true;
+}
+
+void bvh::init_costs() {
+  // Children come after their parent, so costs are summed backwards
+  this->cost.assign(this->nodes.size(), 0.0);
+  for (int i = int(this->nodes.size()) - 1; i >= 0; i--)
+    if (this->nodes[i].count >= 0)
+      this->cost[i] = this->subtree_cost(i);
+  this->built_cost = this->cost;
+}
+
+void bvh::link_nodes() {
+  this->parents.assign(this->nodes.size(), -1);
+  this->references.clear();
+  this->references.reserve(this->reference_count());
+  for (int i = 0; i < int(this->nodes.size()); i++) {
+    const node &n = this->nodes[i];
+    if (n.count < 0)
+      continue;
+    if (n.count == 0) {
+      this->parents[i + 1] = i;
+      this->parents[n.offset] = i;
+      continue;
+    }
+
+    int others_end = n.offset + n.count - n.sphere_count;
+    for (int k = n.offset; k < others_end; k++)
+      this->references.push_back(reference{this->primitives[k], i, -1});
+    for (int k = n.sphere_offset; k < n.sphere_offset + n.sphere_count; k++)
+      this->references.push_back(reference{this->spheres.owner(k), i, k});
+  }
+
+  std::sort(this->references.begin(), this->references.end(),
+            [](const reference &a, const reference &b) {
+              return std::less<const object *>()(a.obj, b.obj);
+            });
+}
+
+double bvh::subtree_cost(int index) const {
+  const node &n = this->nodes[index];
+  if (n.count > 0)
+    return n.bounds.surface_area() * n.count;
+  return traversal_cost * n.bounds.surface_area() + this->cost[index + 1] +
+         this->cost[n.offset];
+}
+
+void bvh::refit_node(int index) {
+  node &n = this->nodes[index];
+  if (n.count > 0) {
+    // Parts of objects referenced by spatial splits grow back to the whole
+    // object, which always bounds them
+    aabb bounds;
+    int others_end = n.offset + n.count - n.sphere_count;
+    for (int k = n.offset; k < others_end; k++)
+      bounds = aabb(bounds, this->primitives[k]->bounding_box());
+    for (int k = n.sphere_offset; k < n.sphere_offset + n.sphere_count; k++)
+      bounds = aabb(bounds, this->spheres.owner(k)->bounding_box());
+    n.bounds = bounds;
+  } else {
+    n.bounds =
+        aabb(this->nodes[index + 1].bounds, this->nodes[n.offset].bounds);
+  }
+  this->cost[index] = this->subtree_cost(index);
+}
+
+int bvh::node_depth(int index) const {
+  int depth = 0;
+  for (int p = this->parents[index]; p >= 0; p = this->parents[p])
+    depth++;
+  return depth;
+}
+
+int bvh::subtree_end(int index) const {
+  // A subtree ends with the leaf reached by following second children
+  while (this->nodes[index].count == 0)
+    index = this->nodes[index].offset;
+  return index + 1;
+}
+
+bool bvh::merge_leaves(int max_nodes) {
+  // Merged leaves become candidates in the next round
+  while (this->node_count() > max_nodes) {
+    // Interior nodes over two leaves, by the cost of making them one leaf.
+    // The second leaf comes right after the first, and so do its objects
+    std::vector<std::pair<double, int>> candidates;
+    for (int i = 0; i < this->node_count(); i++) {
+      const node &n = this->nodes[i];
+      if (n.count != 0 || this->nodes[i + 1].count <= 0 ||
+          this->nodes[n.offset].count <= 0)
+        continue;
+      const node &first = this->nodes[i + 1];
+      const node &second = this->nodes[n.offset];
+      double area = n.bounds.surface_area();
+      double added = area * (first.count + second.count) -
+                     traversal_cost * area -
+                     first.bounds.surface_area() * first.count -
+                     second.bounds.surface_area() * second.count;
+      candidates.emplace_back(added, i);
+    }
+    if (candidates.empty())
+      return false;
+
+    // Each merge removes two nodes
+    int num_merges = std::min(int(candidates.size()),
+                              (this->node_count() - max_nodes + 1) / 2);
+    std::partial_sort(candidates.begin(), candidates.begin() + num_merges,
+                      candidates.end());
+
+    std::vector<int> new_index(this->nodes.size(), 0);
+    for (int k = 0; k < num_merges; k++) {
+      new_index[candidates[k].second + 1] = -1;
+      new_index[candidates[k].second + 2] = -1;
+    }
+    int size = 0;
+    for (int i = 0; i < this->node_count(); i++)
+      new_index[i] = (new_index[i] == 0) ? size++ : -1;
+
+    std::vector<node> nodes;
+    nodes.reserve(size);
+    for (int i = 0; i < this->node_count(); i++) {
+      if (new_index[i] < 0)
+        continue;
+      node n = this->nodes[i];
+      if (n.count == 0 && new_index[i + 1] < 0) {
+        const node &first = this->nodes[i + 1];
+        const node &second = this->nodes[i + 2];
+        n.offset = first.offset;
+        n.count = first.count + second.count;
+        n.axis = 0;
+        n.sphere_offset = first.sphere_offset;
+        n.sphere_count = first.sphere_count + second.sphere_count;
+      } else if (n.count == 0) {
+        n.offset = new_index[n.offset];
+      }
+      nodes.push_back(n);
+    }
+    this->nodes = std::move(nodes);
+  }
+  return true;
+}
+
+void bvh::rebuild_subtrees(const std::vector<int> &roots, thread_pool &pool) {
+  // A new subtree, with the ranges of nodes, primitives and spheres it
+  // replaces. Subtrees are stored depth-first, so each range is contiguous
+  class part {
+  public:
+    bvh tree;
+    int depth;
+    int node_begin, node_end;
+    int primitive_begin, primitive_end;
+    int sphere_begin, sphere_end;
+    bool in_place = false;
+  };
+
+  std::vector<part> parts(roots.size());
+  for (size_t k = 0; k < roots.size(); k++) {
+    part &p = parts[k];
+    p.depth = this->node_depth(roots[k]);
+    p.node_begin = roots[k];
+    p.node_end = this->subtree_end(roots[k]);
+
+    int first = roots[k];
+    while (this->nodes[first].count == 0)
+      first++;
+    const node &last = this->nodes[p.node_end - 1];
+    p.primitive_begin = this->nodes[first].offset;
+    p.primitive_end = last.offset + last.count - last.sphere_count;
+    p.sphere_begin = this->nodes[first].sphere_offset;
+    p.sphere_end = last.sphere_offset + last.sphere_count;
+  }
+
+  auto by_object = [](const reference &ref, const object *obj) {
+    return std::less<const object *>()(ref.obj, obj);
+  };
+  pool.run(int(parts.size()), [&](int k) {
+    part &p = parts[k];
+    std::vector<build_entry> entries;
+    std::unordered_set<const object *> seen;
+    auto add_entry = [&](const object *obj) {
+      // Spatial splits may have referenced the object from several leaves
+      if (this->spatial_splits && !seen.insert(obj).second)
+        return;
+      aabb bounds = obj->bounding_box();
+      entries.push_back(build_entry{obj, bounds, bounds.centroid()});
+    };
+    for (int i = p.primitive_begin; i < p.primitive_end; i++)
+      add_entry(this->primitives[i]);
+    for (int i = p.sphere_begin; i < p.sphere_end; i++)
+      add_entry(this->spheres.owner(i));
+
+    // Built as deep as it sits, so the whole tree stays within max_depth
+    p.tree.nodes.reserve(2 * entries.size());
+    int split_budget = int(max_extra_references * entries.size());
+    p.tree.build(entries, 0, int(entries.size()), p.depth,
+                 this->spatial_splits ? &split_budget : nullptr);
+
+    // Without spatial splits, the new subtree has the same objects as the
+    // old one, so it takes its place if it has no more nodes. Leftover nodes
+    // are marked unused, and reused when a subtree around them is rebuilt
+    if (this->spatial_splits ||
+        !p.tree.merge_leaves(p.node_end - p.node_begin))
+      return;
+    p.tree.init_costs();
+    p.in_place = true;
+
+    for (int i = 0; i < p.tree.node_count(); i++) {
+      node n = p.tree.nodes[i];
+      int index = p.node_begin + i;
+      if (n.count == 0) {
+        n.offset += p.node_begin;
+        this->parents[index + 1] = index;
+        this->parents[n.offset] = index;
+      } else {
+        n.offset += p.primitive_begin;
+        n.sphere_offset += p.sphere_begin;
+        int others_end = n.offset + n.count - n.sphere_count;
+        for (int j = n.offset; j < others_end; j++) {
+          const object *obj = p.tree.primitives[j - p.primitive_begin];
+          this->primitives[j] = obj;
+          std::lower_bound(this->references.begin(), this->references.end(),
+                           obj, by_object)
+              ->node = index;
+        }
+        for (int j = n.sphere_offset; j < n.sphere_offset + n.sphere_count;
+             j++) {
+          auto ref =
+              std::lower_bound(this->references.begin(), this->references.end(),
+                               p.tree.spheres.owner(j - p.sphere_begin),
+                               by_object);
+          ref->node = index;
+          ref->sphere = j;
+        }
+      }
+      this->nodes[index] = n;
+      this->cost[index] = p.tree.cost[i];
+      this->built_cost[index] = p.tree.cost[i];
+    }
+    this->spheres.replace(p.sphere_begin, p.tree.spheres);
+
+    for (int index = p.node_begin + p.tree.node_count(); index < p.node_end;
+         index++) {
+      this->nodes[index].count = -1;
+      this->parents[index] = -1;
+      this->cost[index] = 0.0;
+      this->built_cost[index] = 0.0;
+    }
+  });
+
+  // The other subtrees are spliced in, moving everything after them
+  std::vector<part *> spliced;
+  for (part &p : parts)
+    if (!p.in_place)
+      spliced.push_back(&p);
+  if (spliced.empty()) {
+    for (int root : roots)
+      for (int p = this->parents[root]; p >= 0; p = this->parents[p])
+        this->refit_node(p);
+    return;
+  }
+
+  // Old positions outside the spliced ranges move by the growth of the
+  // ranges before them
+  class shift_table {
+  public:
+    std::vector<int> ends;
+    std::vector<int> shifts{0};
+
+    void add(int begin, int end, int new_size) {
+      this->ends.push_back(end);
+      this->shifts.push_back(this->shifts.back() + new_size - (end - begin));
+    }
+
+    int operator()(int old) const {
+      auto passed = std::upper_bound(this->ends.begin(), this->ends.end(), old);
+      return old + this->shifts[passed - this->ends.begin()];
+    }
+  };
+
+  shift_table node_shift, primitive_shift, sphere_shift;
+  for (part *p : spliced) {
+    p->tree.init_costs();
+    node_shift.add(p->node_begin, p->node_end, p->tree.node_count());
+    primitive_shift.add(p->primitive_begin, p->primitive_end,
+                        int(p->tree.primitives.size()));
+    sphere_shift.add(p->sphere_begin, p->sphere_end, p->tree.spheres.size());
+  }
+
+  // Copies the old tree between the new subtrees, in one pass
+  std::vector<node> nodes;
+  std::vector<const object *> primitives;
+  sphere_set spheres;
+  std::vector<double> cost, built_cost;
+  int size = node_shift(this->node_count());
+  nodes.reserve(size);
+  cost.reserve(size);
+  built_cost.reserve(size);
+  primitives.reserve(primitive_shift(int(this->primitives.size())));
+  int node_cursor = 0;
+  int primitive_cursor = 0;
+  int sphere_cursor = 0;
+  auto copy_old = [&](int node_end, int primitive_end, int sphere_end) {
+    for (int i = node_cursor; i < node_end; i++) {
+      node n = this->nodes[i];
+      if (n.count == 0) {
+        n.offset = node_shift(n.offset);
+      } else if (n.count > 0) {
+        n.offset = primitive_shift(n.offset);
+        n.sphere_offset = sphere_shift(n.sphere_offset);
+      }
+      nodes.push_back(n);
+      cost.push_back(this->cost[i]);
+      built_cost.push_back(this->built_cost[i]);
+    }
+    primitives.insert(primitives.end(),
+                      this->primitives.begin() + primitive_cursor,
+                      this->primitives.begin() + primitive_end);
+    spheres.append(this->spheres, sphere_cursor, sphere_end);
+  };
+
+  for (const part *p : spliced) {
+    copy_old(p->node_begin, p->primitive_begin, p->sphere_begin);
+    int node_base = int(nodes.size());
+    int primitive_base = int(primitives.size());
+    int sphere_base = spheres.size();
+    for (int i = 0; i < p->tree.node_count(); i++) {
+      node n = p->tree.nodes[i];
+      if (n.count == 0) {
+        n.offset += node_base;
+      } else {
+        n.offset += primitive_base;
+        n.sphere_offset += sphere_base;
+      }
+      nodes.push_back(n);
+      cost.push_back(p->tree.cost[i]);
+      built_cost.push_back(p->tree.cost[i]);
+    }
+    primitives.insert(primitives.end(), p->tree.primitives.begin(),
+                      p->tree.primitives.end());
+    spheres.append(p->tree.spheres, 0, p->tree.spheres.size());
+
+    node_cursor = p->node_end;
+    primitive_cursor = p->primitive_end;
+    sphere_cursor = p->sphere_end;
+  }
+  copy_old(this->node_count(), int(this->primitives.size()),
+           this->spheres.size());
+
+  this->nodes = std::move(nodes);
+  this->primitives = std::move(primitives);
+  this->spheres = std::move(spheres);
+  this->cost = std::move(cost);
+  this->built_cost = std::move(built_cost);
+  this->link_nodes();
+
+  // The new subtrees cost less, and so do their ancestors
+  for (int root : roots) {
+    int moved = node_shift(root);
+    for (int p = this->parents[moved]; p >= 0; p = this->parents[p])
+      this->refit_node(p);
+  }
+}
+
+int bvh::collapse_children(int index, int width, int *children) const {
+  // Starts from the node's two children and keeps replacing the interior one
+  // with the largest area by its own children, as that is the one most rays
+  // would have to open next
+  children[0] = index + 1;
+  children[1] = this->nodes[index].offset;
+  int count = 2;
+  while (count < width) {
+    int largest = -1;
+    double largest_area = -1.0;
+    for (int c = 0; c < count; c++) {
+      const node &n = this->nodes[children[c]];
+      if (n.count == 0 && n.bounds.surface_area() > largest_area) {
+        largest = c;
+        largest_area = n.bounds.surface_area();
+      }
+    }
+    if (largest < 0)
+      break;
+
+    int opened = children[largest];
+    children[largest] = opened + 1;
+    children[count++] = this->nodes[opened].offset;
+  }
+  return count;
+}
+
+bool bvh::check_hit(const ray &r, interval ray_t, hit_record &record) const {
+  hit_record temp_rec;
+  bool hit_anything = this->check_unbounded(r, ray_t, record);
+  double closest_so_far = ray_t.max;
+
+  if (this->nodes.empty())
+    return hit_anything;
+
+  point3 origin = r.get_origin();
+  vec3 direction = r.get_direction();
+  vec3 inv_direction = inverse_direction(r);
+
+  int stack[max_depth + 1];
+  int stack_size = 0;
+  int current = 0;
+  while (true) {
+    const node &n = this->nodes[current];
+    traversal_stats::count_nodes(1);
+    if (n.bounds.hit(origin, inv_direction,
+                     interval(ray_t.min, closest_so_far))) {
+      if (n.count > 0) {
+        if (this->check_leaf(n, r, interval(ray_t.min, closest_so_far),
+                             temp_rec)) {
+          hit_anything = true;
+          closest_so_far = temp_rec.t;
+          record = temp_rec;
+        }
+      } else {
+        // Visits the child nearest to the ray's origin first, so that hits
+        // found there shrink the interval tested against the other one
+        if (direction[n.axis] < 0) {
+          stack[stack_size++] = current + 1;
+          current = n.offset;
+        } else {
+          stack[stack_size++] = n.offset;
+          current = current + 1;
+        }
+        continue;
+      }
+    }
+
+    if (stack_size == 0)
+      break;
+    current = stack[--stack_size];
+  }
+
+  return hit_anything;
+}
+
+void bvh::check_hit_packet(const ray *rays, int count, interval ray_t,
+                           hit_record *records, bool *hits) const {
+  hit_record temp_rec;
+  // Every lane is set, as the SIMD box tests load all of them; lanes past
+  // the packet's rays are never active
+  double closest_so_far[max_packet_size];
+  std::fill_n(closest_so_far, max_packet_size, ray_t.max);
+  for (int l = 0; l < count; l++) {
+    interval lane_t = ray_t;
+    hits[l] = this->check_unbounded(rays[l], lane_t, records[l]);
+    closest_so_far[l] = lane_t.max;
+  }
+
+  if (this->nodes.empty() || count <= 0)
+    return;
+
+  // Lanes past the packet's rays repeat its first one and are never active
+  ray_packet packet;
+  for (int l = 0; l < max_packet_size; l++) {
+    const ray &r = rays[(l < count) ? l : 0];
+    point3 origin = r.get_origin();
+    vec3 direction = r.get_direction();
+    for (int axis = 0; axis < 3; axis++) {
+      packet.origin[axis][l] = origin[axis];
+      packet.inv_direction[axis][l] = 1.0 / direction[axis];
+    }
+  }
+
+  // Each stack entry remembers which rays entered the parent node
+  int stack[max_depth + 1];
+  unsigned stack_active[max_depth + 1];
+  int stack_size = 0;
+  int current = 0;
+  unsigned active = (1u << count) - 1;
+  while (true) {
+    const node &n = this->nodes[current];
+    traversal_stats::count_nodes(std::popcount(active));
+    active = packet_box_hits(n.bounds, packet, ray_t.min, closest_so_far,
+                             active);
+    if (active != 0) {
+      if (n.count > 0) {
+        for (int l = 0; l < count; l++) {
+          if (((active >> l) & 1u) &&
+              this->check_leaf(n, rays[l],
+                               interval(ray_t.min, closest_so_far[l]),
+                               temp_rec)) {
+            hits[l] = true;
+            closest_so_far[l] = temp_rec.t;
+            records[l] = temp_rec;
+          }
+        }
+      } else {
+        // The rays are coherent, so the child nearest to the first active
+        // one is likely nearest to the others as well
+        int first = std::countr_zero(active);
+        stack_active[stack_size] = active;
+        if (rays[first].get_direction()[n.axis] < 0) {
+          stack[stack_size++] = current + 1;
+          current = n.offset;
+        } else {
+          stack[stack_size++] = n.offset;
+          current = current + 1;
+        }
+        continue;
+      }
+    }
+
+    if (stack_size == 0)
+      break;
+    stack_size--;
+    current = stack[stack_size];
+    active = stack_active[stack_size];
+  }
+}
+
+bool bvh::check_leaf(const node &n, const ray &r, interval ray_t,
+                     hit_record &record) const {
+  // Closest hit among the leaf's objects
+  traversal_stats::count_objects(n.count);
+  hit_record temp_rec;
+  bool hit_anything = false;
+  int others_end = n.offset + n.count - n.sphere_count;
+  for (int i = n.offset; i < others_end; i++) {
+    if (this->primitives[i]->check_hit(r, ray_t, temp_rec)) {
+      hit_anything = true;
+      ray_t.max = temp_rec.t;
+      record = temp_rec;
+    }
+  }
+
+  if (n.sphere_count > 0 &&
+      this->spheres.check_hit(r, ray_t, n.sphere_offset,
+                              n.sphere_offset + n.sphere_count, temp_rec)) {
+    hit_anything = true;
+    record = temp_rec;
+  }
+
+  return hit_anything;
+}
+
+// The slab test of aabb::hit against every lane of a packet at once. With
+// entry = min(t0, t1) and exit = max(t0, t1) on each axis, max(entry, t_near)
+// and min(exit, t_far) are done as the SIMD max and min instructions define
+// them, which keep the second operand when the first is NaN, as std::fmax and
+// std::fmin do in the single ray test
+unsigned bvh::packet_box_hits(const aabb &box, const ray_packet &packet,
+                              double t_min, const double *t_max,
+                              unsigned active) {
+#if defined(__AVX512F__)
+  __m512d t_near = _mm512_set1_pd(t_min);
+  __m512d t_far = _mm512_loadu_pd(t_max);
+  for (int axis = 0; axis < 3; axis++) {
+    const interval &slab = box.axis_interval(axis);
+    __m512d origin = _mm512_loadu_pd(packet.origin[axis]);
+    __m512d inv_direction = _mm512_loadu_pd(packet.inv_direction[axis]);
+    __m512d t0 = _mm512_mul_pd(_mm512_sub_pd(_mm512_set1_pd(slab.min), origin),
+                               inv_direction);
+    __m512d t1 = _mm512_mul_pd(_mm512_sub_pd(_mm512_set1_pd(slab.max), origin),
+                               inv_direction);
+    __mmask8 swap = _mm512_cmp_pd_mask(t0, t1, _CMP_GT_OQ);
+    __m512d entry = _mm512_mask_blend_pd(swap, t0, t1);
+    __m512d exit = _mm512_mask_blend_pd(swap, t1, t0);
+    t_near = _mm512_max_pd(entry, t_near);
+    t_far = _mm512_min_pd(exit, t_far);
+  }
+  return _mm512_cmp_pd_mask(t_far, t_near, _CMP_GE_OQ) & active;
+#elif defined(__AVX2__)
+  // Two halves of four lanes each
+  unsigned hit = 0;
+  for (int half = 0; half < max_packet_size; half += 4) {
+    __m256d t_near = _mm256_set1_pd(t_min);
+    __m256d t_far = _mm256_loadu_pd(t_max + half);
+    for (int axis = 0; axis < 3; axis++) {
+      const interval &slab = box.axis_interval(axis);
+      __m256d origin = _mm256_loadu_pd(packet.origin[axis] + half);
+      __m256d inv_direction =
+          _mm256_loadu_pd(packet.inv_direction[axis] + half);
+      __m256d t0 = _mm256_mul_pd(
+          _mm256_sub_pd(_mm256_set1_pd(slab.min), origin), inv_direction);
+      __m256d t1 = _mm256_mul_pd(
+          _mm256_sub_pd(_mm256_set1_pd(slab.max), origin), inv_direction);
+      __m256d swap = _mm256_cmp_pd(t0, t1, _CMP_GT_OQ);
+      __m256d entry = _mm256_blendv_pd(t0, t1, swap);
+      __m256d exit = _mm256_blendv_pd(t1, t0, swap);
+      t_near = _mm256_max_pd(entry, t_near);
+      t_far = _mm256_min_pd(exit, t_far);
+    }
+    hit |= unsigned(_mm256_movemask_pd(
+               _mm256_cmp_pd(t_far, t_near, _CMP_GE_OQ)))
+           << half;
+  }
+  return hit & active;
+#else
+  unsigned hit = 0;
+  for (int l = 0; l < max_packet_size; l++) {
+    if (!((active >> l) & 1u))
+      continue;
+
+    interval ray_t(t_min, t_max[l]);
+    point3 origin(packet.origin[0][l], packet.origin[1][l],
+                  packet.origin[2][l]);
+    vec3 inv_direction(packet.inv_direction[0][l],
+                       packet.inv_direction[1][l],
+                       packet.inv_direction[2][l]);
+    if (box.hit(origin, inv_direction, ray_t))
+      hit |= 1u << l;
+  }
+  return hit;
+#endif
+}
+
+bool bvh::check_occluded(const ray &r, interval ray_t) const {
+  if (this->check_unbounded_occluded(r, ray_t))
+    return true;
+
+  if (this->nodes.empty())
+    return false;
+
+  point3 origin = r.get_origin();
+  vec3 inv_direction = inverse_direction(r);
+
+  // Any blocker will do, so children are visited in storage order
+  int stack[max_depth + 1];
+  int stack_size = 0;
+  int current = 0;
+  while (true) {
+    const node &n = this->nodes[current];
+    traversal_stats::count_nodes(1);
+    if (n.bounds.hit(origin, inv_direction, ray_t)) {
+      if (n.count == 0) {
+        stack[stack_size++] = n.offset;
+        current = current + 1;
+        continue;
+      }
+
+      traversal_stats::count_objects(n.count);
+
+      int others_end = n.offset + n.count - n.sphere_count;
+      for (int i = n.offset; i < others_end; i++)
+        if (this->primitives[i]->check_occluded(r, ray_t))
+          return true;
+      if (this->spheres.check_occluded(r, ray_t, n.sphere_offset,
+                                       n.sphere_offset + n.sphere_count))
+        return true;
+    }
+
+    if (stack_size == 0)
+      return false;
+    current = stack[--stack_size];
+  }
+}
\ No newline at end of file
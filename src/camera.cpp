@@ -1,45 +1,300 @@
 #include "camera.hpp"
 #include "material.hpp"
+#include "thread_pool.hpp"
 #include "vec3.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <vector>
+
+static double power_heuristic(double pdf, double other_pdf) {
+  // Multiple importance sampling weight of the first of two techniques
+  double a = pdf * pdf;
+  double b = other_pdf * other_pdf;
+  return (a + b > 0.0) ? a / (a + b) : 0.0;
+}
 
 // Renders and outputs the image
-void camera::render(const world &w, std::ofstream &output_file) {
+void camera::render(const world &w, const std::string &output_path) {
   this->initialize();
 
-  // PPM header
-  output_file << "P3" << std::endl
-              << this->img_width << " " << this->img_height << std::endl
-              << "255" << std::endl;
+  // Splits the image into tiles, each of which writes only its own pixels of
+  // the shared accumulation buffer
+  int tiles_x = (this->img_width + tile_size - 1) / tile_size;
+  int tiles_y = (this->img_height + tile_size - 1) / tile_size;
+  int num_tiles = tiles_x * tiles_y;
+  std::vector<pixel_state> pixels(this->img_width * this->img_height);
+
+  int num_threads = (this->num_threads > 0) ? this->num_threads
+                                            : thread_pool::hardware_threads();
+  thread_pool pool(num_threads);
+  std::cout << "Rendering " << num_tiles << " tiles on " << pool.size()
+            << " threads." << std::endl;
 
-  // Printing the RGB values of each pixel
-  for (int i = 0; i < this->img_height; i++) {
-    for (int j = 0; j < this->img_width; j++) {
+  int span_size =
+      std::clamp(this->packet_size, 1, int(accelerator::max_packet_size));
 
-      // Computes the color of the pixel
-      color pixel_color = color(0.0f, 0.0f, 0.0f);
+  // Progressive renders split the samples into passes over the whole image
+  int pass_samples = (this->samples_per_pass > 0) ? this->samples_per_pass
+                                                  : this->samples_per_pixel;
+  bool show_passes = (this->samples_per_pass > 0 || this->time_budget > 0.0);
 
-      // Traverses the amount of sample rays to consider
-      for (int k = 0; k < this->samples_per_pixel; k++) {
+  // Under a time budget, a pilot pass of one sample per pixel measures how
+  // long a sample over the whole image takes, and the passes after it are
+  // sized to what the remaining time affords. Every pass covers the whole
+  // image, so running out of time only lowers the sample count
+  auto start = std::chrono::steady_clock::now();
+  auto last_write = start;
+  ray_sort_stats sort_stats;
+  int samples_done = 0;
+  int pass_size = (this->time_budget > 0.0) ? 1 : pass_samples;
+  for (int pass = 0; pass_size > 0; pass++) {
+    int sample_end = std::min(this->samples_per_pixel,
+                              samples_done + pass_size);
+    auto pass_start = std::chrono::steady_clock::now();
 
-        // Gets the ray (camera -> random sample around pixel)
-        ray r = this->get_ray_sample(i, j);
+    if (this->wavefront) {
+      this->render_wavefront(w, pixels, sample_end, span_size, pool,
+                             sort_stats);
+    } else {
+      int tiles_remaining = num_tiles;
+      std::mutex log_lock;
+      pool.run(num_tiles, [&](int tile) {
+        int i_begin = (tile / tiles_x) * tile_size;
+        int j_begin = (tile % tiles_x) * tile_size;
+        int i_end = std::min(i_begin + tile_size, this->img_height);
+        int j_end = std::min(j_begin + tile_size, this->img_width);
 
-        // Sums its color contribution to the total color
-        pixel_color += this->pixel_sample_color_scale *
-                       this->ray_color(r, this->max_recursion_depth, w);
-      }
+        for (int i = i_begin; i < i_end; i++) {
+          if (span_size > 1) {
+            for (int j = j_begin; j < j_end; j += span_size)
+              this->render_span(i, j, std::min(j + span_size, j_end), w,
+                                &pixels[i * this->img_width], sample_end);
+          } else {
+            for (int j = j_begin; j < j_end; j++)
+              this->render_pixel(i, j, w, pixels[i * this->img_width + j],
+                                 sample_end);
+          }
+        }
 
-      // Writes the pixel to the image
-      write_color(output_file, pixel_color);
+        // Logging
+        std::lock_guard<std::mutex> guard(log_lock);
+        std::cout << "\r";
+        if (show_passes)
+          std::cout << "Pass " << (pass + 1) << " (" << sample_end << "/"
+                    << this->samples_per_pixel << " samples), ";
+        std::cout << "Tiles remaining: " << --tiles_remaining << ' '
+                  << std::flush;
+      });
     }
 
-    // Logging
-    std::cout << "\rScanlines remaining: " << (this->img_height - i) << ' '
-              << std::flush;
+    auto now = std::chrono::steady_clock::now();
+    double pass_seconds =
+        std::chrono::duration<double>(now - pass_start).count();
+    double seconds_per_sample = pass_seconds / (sample_end - samples_done);
+    samples_done = sample_end;
+
+    // Sizes the next pass, if any
+    pass_size = std::min(pass_samples, this->samples_per_pixel - samples_done);
+    if (this->time_budget > 0.0) {
+      double elapsed = std::chrono::duration<double>(now - start).count();
+      pass_size = std::min(pass_size,
+                           this->budget_pass_size(this->time_budget - elapsed,
+                                                  seconds_per_sample));
+    }
+
+    // Writes the current estimate out every few passes or seconds, and always
+    // after the last pass
+    double seconds = std::chrono::duration<double>(now - last_write).count();
+    bool is_last = (pass_size <= 0);
+    bool preview_due =
+        (this->preview_every_passes > 0 &&
+         (pass + 1) % this->preview_every_passes == 0) ||
+        (this->preview_every_seconds > 0.0 &&
+         seconds >= this->preview_every_seconds);
+    if (is_last || preview_due) {
+      this->write_image(output_path, pixels);
+      last_write = now;
+      if (!is_last)
+        std::cout << std::endl << "Wrote preview with " << sample_end
+                  << " samples per pixel." << std::endl;
+    }
   }
 
   // Logging
   std::cout << "\rDone.                 " << std::endl; // Logging
+
+  if (this->time_budget > 0.0) {
+    double elapsed = std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - start)
+                         .count();
+    std::cout << "Took " << samples_done << " samples per pixel in "
+              << elapsed << " of " << this->time_budget << " seconds."
+              << std::endl;
+  }
+
+  if (this->wavefront && this->sort_rays && sort_stats.sorted_rays > 0 &&
+      sort_stats.unsorted_rays > 0) {
+    double unsorted = sort_stats.unsorted_seconds / sort_stats.unsorted_rays;
+    double sorted = sort_stats.sorted_seconds / sort_stats.sorted_rays;
+    double sorting = sort_stats.sorting_seconds / sort_stats.sorted_rays;
+    std::cout << "Secondary ray traversal: " << 1e9 * unsorted
+              << " ns/ray unsorted, " << 1e9 * sorted
+              << " ns/ray sorted plus " << 1e9 * sorting
+              << " ns/ray to sort (" << unsorted / sorted << "x faster, "
+              << unsorted / (sorted + sorting) << "x overall)." << std::endl;
+  }
+
+  if (this->adaptive_error > 0.0) {
+    long long total_samples = 0;
+    for (const pixel_state &pixel : pixels)
+      total_samples += pixel.samples;
+    std::cout << "Average samples per pixel: "
+              << double(total_samples) / pixels.size() << std::endl;
+
+    if (!this->sample_map_path.empty())
+      this->write_sample_map(pixels);
+  }
+}
+
+int camera::budget_pass_size(double remaining_seconds,
+                             double seconds_per_sample) const {
+  // Keeps a small margin for the final image write and timing noise
+  double usable = 0.95 * remaining_seconds;
+  if (usable <= 0.0)
+    return 0;
+  if (seconds_per_sample <= 0.0)
+    return this->samples_per_pixel;
+
+  double affordable = std::floor(usable / seconds_per_sample);
+  if (affordable >= this->samples_per_pixel)
+    return this->samples_per_pixel;
+
+  // Large remainders are spent half at a time, so that the cost per sample is
+  // measured again before committing the rest of the budget
+  int size = int(affordable);
+  return (size >= 8) ? size / 2 : size;
+}
+
+void camera::write_image(const std::string &path,
+                         const std::vector<pixel_state> &pixels) const {
+  // Writes to a temporary file first and then renames it over the output, so
+  // readers never see a partially written image
+  std::string temp_path = path + ".tmp";
+  {
+    std::ofstream output_file(temp_path);
+
+    // PPM header
+    output_file << "P3" << std::endl
+                << this->img_width << " " << this->img_height << std::endl
+                << "255" << std::endl;
+
+    // Printing the RGB values of each pixel
+    for (const pixel_state &pixel : pixels)
+      write_color(output_file, pixel.sum / std::max(1, pixel.samples));
+  }
+
+  if (std::rename(temp_path.c_str(), path.c_str()) != 0)
+    std::cout << "Could not write '" << path << "'!" << std::endl;
+}
+
+void camera::write_sample_map(const std::vector<pixel_state> &pixels) const {
+  // Grayscale image where white means samples_per_pixel samples were taken
+  std::ofstream map_file(this->sample_map_path);
+  map_file << "P3" << std::endl
+           << this->img_width << " " << this->img_height << std::endl
+           << "255" << std::endl;
+
+  for (const pixel_state &pixel : pixels) {
+    int level = (255 * pixel.samples) / this->samples_per_pixel;
+    map_file << level << ' ' << level << ' ' << level << '\n';
+  }
+}
+
+void camera::render_pixel(int i, int j, const world &w, pixel_state &pixel,
+                          int sample_end) const {
+  // Traverses the sample rays up to sample_end, stopping early once the
+  // adaptive estimate is precise enough
+  while (!pixel.converged && pixel.samples < sample_end) {
+    // Every sample draws from its own stream, so the image does not depend on
+    // which thread rendered it, in which order or in which pass
+    rng gen(this->seed, uint64_t(i) * this->img_width + j, pixel.samples);
+
+    // Gets the ray (camera -> random sample around pixel)
+    ray r = this->get_ray_sample(i, j, gen);
+
+    // Sums its color contribution to the total color
+    this->add_sample(pixel, this->sample_color(r, w, gen, nullptr));
+  }
+}
+
+void camera::render_span(int i, int j_begin, int j_end, const world &w,
+                         pixel_state *pixels, int sample_end) const {
+  // Same as render_pixel over a few pixels of a row at once: each round takes
+  // the next sample of every pixel still sampling, traces their camera rays
+  // together as a packet and then shades them one by one
+  int lanes[accelerator::max_packet_size];
+  rng gens[accelerator::max_packet_size];
+  ray rays[accelerator::max_packet_size];
+  hit_record records[accelerator::max_packet_size];
+  bool found[accelerator::max_packet_size];
+
+  while (true) {
+    int count = 0;
+    for (int j = j_begin; j < j_end; j++) {
+      pixel_state &pixel = pixels[j];
+      if (pixel.converged || pixel.samples >= sample_end)
+        continue;
+
+      gens[count] = rng(this->seed, uint64_t(i) * this->img_width + j,
+                        pixel.samples);
+      rays[count] = this->get_ray_sample(i, j, gens[count]);
+      lanes[count++] = j;
+    }
+    if (count == 0)
+      return;
+
+    w.check_hit_packet(rays, count, interval(0.001f, mathconst::infinity),
+                       records, found);
+
+    for (int l = 0; l < count; l++) {
+      primary_hit primary;
+      primary.found = found[l];
+      primary.record = records[l];
+      this->add_sample(pixels[lanes[l]],
+                       this->sample_color(rays[l], w, gens[l], &primary));
+    }
+  }
+}
+
+void camera::add_sample(pixel_state &pixel, const color &sample) const {
+  pixel.sum += sample;
+  int k = ++pixel.samples;
+
+  if (this->adaptive_error <= 0.0)
+    return;
+
+  // Running mean and squared deviations of the samples' luminance
+  double value = luminance(sample);
+  double delta = value - pixel.mean;
+  pixel.mean += delta / k;
+  pixel.squared_deviations += delta * (value - pixel.mean);
+
+  // Stops when the 95% confidence interval of the mean is narrow enough
+  if (k >= this->min_samples_per_pixel && k > 1) {
+    double variance = pixel.squared_deviations / (k - 1);
+    double half_width = 1.96 * std::sqrt(variance / k);
+    pixel.converged = half_width <= this->adaptive_error *
+                                        std::fmax(pixel.mean, 1.0 / 256.0);
+  }
+}
+
+color camera::sample_color(const ray &r, const world &w, rng &gen,
+                           const primary_hit *primary) const {
+  return (this->integrator == integrator_type::tree)
+             ? this->ray_color(r, this->max_recursion_depth, w, gen, primary)
+             : this->path_color(r, w, gen, primary);
 }
 
 void camera::initialize() {
@@ -47,9 +302,6 @@ void camera::initialize() {
   double actual_aspect_ratio =
       double(this->img_width) / double(this->img_height);
 
-  // Rendering parameters
-  this->pixel_sample_color_scale = 1.0 / samples_per_pixel;
-
   // Camera parameters
   double theta = degrees_to_radians(this->fov);
   double h = std::tan(theta / 2.0f);
@@ -77,9 +329,9 @@ void camera::initialize() {
   this->defocus_disk_ver_radius = this->v * defocus_radius;
 }
 
-ray camera::get_ray_sample(int i, int j) const {
+ray camera::get_ray_sample(int i, int j, rng &gen) const {
   // Samples a pixel position around the center of the given pixel
-  vec3 offset = sample_square();
+  vec3 offset = sample_square(gen);
   vec3 pixel_sample = this->pixel_pos_upper_left +
                       ((j + offset.x()) * this->pixel_u) +
                       ((i + offset.y()) * this->pixel_v);
@@ -88,73 +340,427 @@ ray camera::get_ray_sample(int i, int j) const {
   point3 ray_origin =
       ((this->defocus_angle) <= 0.0f)
           ? this->eye
-          : sample_disk(this->eye, this->defocus_disk_hor_radius,
+          : sample_disk(gen, this->eye, this->defocus_disk_hor_radius,
                         this->defocus_disk_ver_radius);
   vec3 ray_direction = pixel_sample - ray_origin;
   return ray(ray_origin, ray_direction);
 }
 
-color camera::ray_color(const ray &r, int depth, const world &w) const {
-  // Stops if the maximum depth has been reached
-  if (depth <= 0)
-    return color(0.0f, 0.0f, 0.0f);
+color camera::ray_color(const ray &r, int depth, const world &w, rng &gen,
+                        const primary_hit *primary) const {
+  // Evaluates the ray tree depth-first with an explicit stack. Each frame
+  // scatters its diffuse, reflective and refractive lobes in turn and waits
+  // for the child ray spawned by each, which consumes random numbers in the
+  // same order as the recursive definition of the tree
+  thread_local std::vector<ray_frame> stack;
+  stack.clear();
+
+  ray_frame root;
+  root.r = r;
+  root.depth = depth;
+  root.weight = color(1.0, 1.0, 1.0);
+  root.skips_emission = false;
+  for (int lobe = 0; lobe < num_lobes; lobe++)
+    root.lobe_depth[lobe] = 0;
+  stack.push_back(root);
+  this->open_ray_frame(stack.back(), w, gen, primary);
+
+  while (true) {
+    ray_frame &frame = stack.back();
 
-  // Gets the first object the ray hits, if it hits any
-  hit_record record;
-  bool hit_anything =
-      w.check_hit(r, interval(0.001f, mathconst::infinity), record);
-
-  // If an object was hit, decides the color of the pixel based on its color
-  // Recursive calls this function for the reflected ray
-  if (hit_anything) {
-    // Just return its color if it is a light
-    if (record.is_light) {
-      return record.lig->emitted(record.tex_u, record.tex_v, record.point);
+    // Scatters the next lobe and descends into its ray, if it is worth it
+    if (frame.next_lobe < num_lobes) {
+      ray_frame child;
+      if (this->spawn_ray_frame(frame, child, gen)) {
+        stack.push_back(child);
+        this->open_ray_frame(stack.back(), w, gen, nullptr);
+      } else
+        frame.next_lobe++;
+      continue;
     }
 
-    ray scattered;
-    color attenuation;
-    bool ray_was_scattered_by_object;
-    color final_color = color(0.0f, 0.0f, 0.0f);
-
-    // Ambient color
-    double ambient_light_coeff;
-    color object_color = record.mat->get_ambient(
-        ambient_light_coeff, record.tex_u, record.tex_v, record.point);
-    final_color += ambient_light_coeff * object_color;
-
-    // Diffuse ray
-    double diffuse_c;
-    color diffuse_color;
-    ray_was_scattered_by_object = record.mat->scatter_diffuse(
-        r, record, attenuation, scattered, diffuse_c);
-    if (ray_was_scattered_by_object && (diffuse_c > 0.0f))
-      diffuse_color = attenuation * ray_color(scattered, depth - 1, w);
-
-    // Reflective ray
-    double reflective_c;
-    color reflective_color;
-    ray_was_scattered_by_object = record.mat->scatter_reflective(
-        r, record, attenuation, scattered, reflective_c);
-    if (ray_was_scattered_by_object && (reflective_c > 0.0f))
-      reflective_color = attenuation * ray_color(scattered, depth - 1, w);
-
-    // Refractive ray
-    double refractive_c;
-    color refractive_color;
-    ray_was_scattered_by_object = record.mat->scatter_refractive(
-        r, record, attenuation, scattered, refractive_c);
-    if (ray_was_scattered_by_object && (refractive_c > 0.0f))
-      refractive_color = attenuation * ray_color(scattered, depth - 1, w);
-
-    final_color += (diffuse_c * diffuse_color) +
-                   (reflective_c * reflective_color) +
-                   (refractive_c * refractive_color);
-    return final_color;
+    // Every lobe is done, so the frame's color is final
+    color result = frame.final_color;
+    if (frame.is_shaded)
+      result += (frame.coeff[lobe_diffuse] * frame.lobe_color[lobe_diffuse]) +
+                (frame.coeff[lobe_reflective] *
+                 frame.lobe_color[lobe_reflective]) +
+                (frame.coeff[lobe_refractive] *
+                 frame.lobe_color[lobe_refractive]);
+
+    // Hands it to the lobe of the parent that spawned it
+    stack.pop_back();
+    if (stack.empty())
+      return result;
+
+    ray_frame &parent = stack.back();
+    int lobe = parent.next_lobe;
+    parent.lobe_color[lobe] = parent.attenuation[lobe] * result;
+    parent.next_lobe++;
   }
+}
+
+void camera::open_ray_frame(ray_frame &frame, const world &w, rng &gen,
+                            const primary_hit *primary) const {
+  // Frames start as leaves, only shaded surfaces have lobes to scatter
+  frame.is_shaded = false;
+  frame.next_lobe = num_lobes;
+  frame.final_color = color(0.0f, 0.0f, 0.0f);
+
+  // Stops if the maximum depth has been reached
+  if (frame.depth <= 0)
+    return;
+  gen.set_bounce(this->max_recursion_depth - frame.depth);
+
+  // Gets the first object the ray hits, if it hits any, unless it was
+  // already traced in a packet
+  bool hit_anything;
+  if (primary) {
+    hit_anything = primary->found;
+    frame.record = primary->record;
+  } else
+    hit_anything = w.check_hit(
+        frame.r, interval(0.001f, mathconst::infinity), frame.record);
 
   // If the ray hits nothing, returns background color
+  if (!hit_anything) {
+    frame.final_color = this->sky_color(frame.r);
+    return;
+  }
+
+  // Just return its color if it is a light
+  const hit_record &record = frame.record;
+  if (record.is_light) {
+    if (!frame.skips_emission)
+      frame.final_color =
+          record.lig->emitted(record.tex_u, record.tex_v, record.point);
+    return;
+  }
+
+  // Ambient color, the lobes are added as their rays come back
+  double ambient_light_coeff;
+  color object_color = record.mat->get_ambient(
+      ambient_light_coeff, record.tex_u, record.tex_v, record.point);
+  frame.final_color += ambient_light_coeff * object_color;
+
+  // Light reaching the diffuse lobe straight from the bulbs
+  if (this->light_sampling) {
+    double diffuse_c, reflective_c, refractive_c;
+    record.mat->get_lobe_coeffs(diffuse_c, reflective_c, refractive_c);
+    if (diffuse_c > 0.0f)
+      frame.final_color += diffuse_c * object_color *
+                           this->sample_direct_light(record, w, gen);
+  }
+
+  frame.is_shaded = true;
+  frame.next_lobe = lobe_diffuse;
+  for (int lobe = 0; lobe < num_lobes; lobe++)
+    frame.lobe_color[lobe] = color(0.0f, 0.0f, 0.0f);
+}
+
+bool camera::spawn_ray_frame(ray_frame &parent, ray_frame &child,
+                             rng &gen) const {
+  // Scatters the parent's next lobe; the random numbers are drawn even if the
+  // child ends up not being traced
+  int lobe = parent.next_lobe;
+  const hit_record &record = parent.record;
+  color attenuation;
+  double coeff;
+  bool ray_was_scattered_by_object = this->scatter_lobe(
+      lobe, parent.r, record, attenuation, child.r, coeff, gen);
+
+  parent.coeff[lobe] = coeff;
+  parent.attenuation[lobe] = attenuation;
+  if (!ray_was_scattered_by_object || (coeff <= 0.0f))
+    return false;
+
+  // Respects the depth cap of the lobe type, if it has one
+  for (int l = 0; l < num_lobes; l++)
+    child.lobe_depth[l] = parent.lobe_depth[l];
+  child.lobe_depth[lobe]++;
+
+  int lobe_cap = (lobe == lobe_diffuse)      ? this->max_diffuse_depth
+                 : (lobe == lobe_reflective) ? this->max_reflection_depth
+                                             : this->max_refraction_depth;
+  if (lobe_cap >= 0 && child.lobe_depth[lobe] > lobe_cap)
+    return false;
+
+  // Prunes branches that could barely change the pixel
+  child.weight = parent.weight * (coeff * attenuation);
+  double max_weight = std::fmax(child.weight.x(),
+                                std::fmax(child.weight.y(), child.weight.z()));
+  if (max_weight < this->prune_epsilon)
+    return false;
+
+  child.depth = parent.depth - 1;
+  child.skips_emission = this->light_sampling && (lobe == lobe_diffuse);
+  return true;
+}
+
+bool camera::scatter_lobe(int lobe, const ray &incident,
+                          const hit_record &record, color &attenuation,
+                          ray &scattered, double &coeff, rng &gen) const {
+  if (lobe == lobe_diffuse)
+    return record.mat->scatter_diffuse(incident, record, attenuation,
+                                       scattered, coeff, gen);
+  if (lobe == lobe_reflective)
+    return record.mat->scatter_reflective(incident, record, attenuation,
+                                          scattered, coeff, gen);
+  return record.mat->scatter_refractive(incident, record, attenuation,
+                                        scattered, coeff, gen);
+}
+
+color camera::path_color(const ray &r, const world &w, rng &gen,
+                         const primary_hit *primary) const {
+  // Follows a single path, choosing one lobe per hit with probability
+  // proportional to its coefficient. Dividing by that probability keeps the
+  // expected color equal to the full ray tree's, at a cost linear in depth.
+  // With the mis integrator the bulbs are also sampled at every hit, and both
+  // ways of reaching them are weighted by the power heuristic
+  path_state path;
+  this->start_path(path, r, gen);
+
+  while (path.is_alive) {
+    hit_record record;
+    bool hit_anything;
+    if (path.bounce == 0 && primary) {
+      hit_anything = primary->found;
+      record = primary->record;
+    } else
+      hit_anything = w.check_hit(
+          path.current, interval(0.001f, mathconst::infinity), record);
+
+    this->extend_path(path, hit_anything, record, w);
+  }
+
+  return path.radiance;
+}
+
+void camera::start_path(path_state &path, const ray &r, const rng &gen) const {
+  path.current = r;
+  path.radiance = color(0.0f, 0.0f, 0.0f);
+  path.throughput = color(1.0f, 1.0f, 1.0f);
+  path.skips_emission = false;
+  path.last_bsdf_pdf = 0.0;
+  path.bounce = 0;
+  path.gen = gen;
+  path.is_alive = (this->max_recursion_depth > 0);
+}
+
+void camera::extend_path(path_state &path, bool hit_anything,
+                         const hit_record &record, const world &w) const {
+  // Shades the hit of the path's current ray, then picks its next ray
+  path.is_alive = false;
+
+  bool mis = (this->integrator == integrator_type::mis);
+  rng &gen = path.gen;
+  gen.set_bounce(path.bounce);
+
+  if (!hit_anything) {
+    path.radiance += path.throughput * this->sky_color(path.current);
+    return;
+  }
+
+  if (record.is_light) {
+    color emitted =
+        record.lig->emitted(record.tex_u, record.tex_v, record.point);
+    if (mis && path.last_bsdf_pdf > 0.0) {
+      double light_pdf = this->light_pdf(w, path.last_point, record.lig);
+      path.radiance +=
+          path.throughput *
+          (power_heuristic(path.last_bsdf_pdf, light_pdf) * emitted);
+    } else if (!path.skips_emission)
+      path.radiance += path.throughput * emitted;
+    return;
+  }
+
+  // Ambient color
+  double ambient_light_coeff;
+  color object_color = record.mat->get_ambient(
+      ambient_light_coeff, record.tex_u, record.tex_v, record.point);
+  path.radiance += path.throughput * (ambient_light_coeff * object_color);
+
+  // Picks the lobe to follow
+  double lobe_coeffs[num_lobes];
+  record.mat->get_lobe_coeffs(lobe_coeffs[lobe_diffuse],
+                              lobe_coeffs[lobe_reflective],
+                              lobe_coeffs[lobe_refractive]);
+  double total = 0.0;
+  for (int lobe = 0; lobe < num_lobes; lobe++)
+    total += std::fmax(0.0, lobe_coeffs[lobe]);
+  if (total <= 0.0)
+    return;
+
+  // Light reaching the non-specular lobes straight from the bulbs
+  if (mis)
+    path.radiance +=
+        path.throughput * this->sample_light_mis(path.current, record,
+                                                 lobe_coeffs, total,
+                                                 object_color, w, gen);
+  else if (this->light_sampling && lobe_coeffs[lobe_diffuse] > 0.0)
+    path.radiance +=
+        path.throughput * (lobe_coeffs[lobe_diffuse] * object_color *
+                           this->sample_direct_light(record, w, gen));
+
+  double choice = random_double(gen) * total;
+  int lobe = -1;
+  for (int l = 0; l < num_lobes; l++) {
+    if (lobe_coeffs[l] <= 0.0)
+      continue;
+    lobe = l; // Last positive lobe in case rounding overshoots
+    if (choice < lobe_coeffs[l])
+      break;
+    choice -= lobe_coeffs[l];
+  }
+
+  ray scattered;
+  color attenuation;
+  double coeff;
+  if (!this->scatter_lobe(lobe, path.current, record, attenuation, scattered,
+                          coeff, gen))
+    return;
+
+  // coeff / (coeff / total) is the weight of the chosen lobe
+  path.throughput = path.throughput * (total * attenuation);
+
+  bool is_specular =
+      (lobe == lobe_refractive) ||
+      (lobe == lobe_reflective && record.mat->is_reflection_specular());
+  path.last_point = record.point;
+  path.last_bsdf_pdf =
+      (mis && !is_specular)
+          ? this->bsdf_pdf(path.current, record, lobe_coeffs, total,
+                           unit_vector(scattered.get_direction()))
+          : 0.0;
+
+  // Russian roulette: dim paths survive with a probability equal to their
+  // throughput and are boosted to make up for the ones cut short
+  if (path.bounce >= roulette_start_bounce) {
+    double survival = std::fmin(
+        1.0, std::fmax(path.throughput.x(),
+                       std::fmax(path.throughput.y(), path.throughput.z())));
+    if (random_double(gen) >= survival)
+      return;
+    path.throughput /= survival;
+  }
+
+  path.current = scattered;
+  path.skips_emission = this->light_sampling && (lobe == lobe_diffuse);
+  path.bounce++;
+  path.is_alive = (path.bounce < this->max_recursion_depth);
+}
+
+color camera::sky_color(const ray &r) const {
+  // Vertical gradient from white to light blue
   vec3 unit_direction = unit_vector(r.get_direction());
   auto a = 0.5 * (unit_direction.y() + 1.0);
   return (1.0 - a) * color(1.0, 1.0, 1.0) + a * color(0.5, 0.7, 1.0);
+}
+
+color camera::sample_direct_light(const hit_record &record, const world &w,
+                                  rng &gen) const {
+  // Estimates the light arriving straight from the bulbs, weighted by the
+  // cosine distribution of diffuse scattering, by picking one bulb at random
+  // and sampling the cone it subtends
+  const std::vector<bulb *> &lights = w.get_lights();
+  if (lights.empty())
+    return color(0.0f, 0.0f, 0.0f);
+
+  int index = std::min(int(random_double(gen) * lights.size()),
+                       int(lights.size()) - 1);
+  const bulb *target = lights[index];
+
+  vec3 direction;
+  double pdf;
+  if (!target->sample_direction(record.point, direction, pdf, gen))
+    return color(0.0f, 0.0f, 0.0f);
+
+  double cosine = dot(record.normal, direction);
+  if (cosine <= 0.0)
+    return color(0.0f, 0.0f, 0.0f);
+
+  // Finds where the direction meets the bulb and checks if anything is in the
+  // way before that
+  ray shadow_ray(record.point, direction);
+  hit_record light_record;
+  if (!target->check_hit(shadow_ray, interval(0.001f, mathconst::infinity),
+                         light_record))
+    return color(0.0f, 0.0f, 0.0f);
+  if (w.check_occluded(shadow_ray,
+                       interval(0.001f, light_record.t - 0.001f)))
+    return color(0.0f, 0.0f, 0.0f);
+
+  color emitted = light_record.lig->emitted(
+      light_record.tex_u, light_record.tex_v, light_record.point);
+  double light_pdf = pdf / lights.size();
+  return (cosine / mathconst::pi / light_pdf) * emitted;
+}
+
+color camera::sample_light_mis(const ray &incident, const hit_record &record,
+                               const double lobe_coeffs[], double total,
+                               const color &albedo, const world &w,
+                               rng &gen) const {
+  // Samples a direction towards a random bulb, like sample_direct_light, but
+  // scatters it through every non-specular lobe and weights the result
+  // against the chance of the path finding the bulb on its own
+  const std::vector<bulb *> &lights = w.get_lights();
+  if (lights.empty())
+    return color(0.0f, 0.0f, 0.0f);
+
+  int index = std::min(int(random_double(gen) * lights.size()),
+                       int(lights.size()) - 1);
+  const bulb *target = lights[index];
+
+  vec3 direction;
+  double pdf;
+  if (!target->sample_direction(record.point, direction, pdf, gen))
+    return color(0.0f, 0.0f, 0.0f);
+
+  double bsdf_pdf =
+      this->bsdf_pdf(incident, record, lobe_coeffs, total, direction);
+  if (bsdf_pdf <= 0.0)
+    return color(0.0f, 0.0f, 0.0f);
+
+  ray shadow_ray(record.point, direction);
+  hit_record light_record;
+  if (!target->check_hit(shadow_ray, interval(0.001f, mathconst::infinity),
+                         light_record))
+    return color(0.0f, 0.0f, 0.0f);
+  if (w.check_occluded(shadow_ray,
+                       interval(0.001f, light_record.t - 0.001f)))
+    return color(0.0f, 0.0f, 0.0f);
+
+  // Every lobe turns light from the direction into coeff * albedo * its own
+  // density, which adds up to total * albedo * bsdf_pdf
+  color emitted = light_record.lig->emitted(
+      light_record.tex_u, light_record.tex_v, light_record.point);
+  double light_pdf = pdf / lights.size();
+  double weight = power_heuristic(light_pdf, bsdf_pdf);
+  return (weight * total * bsdf_pdf / light_pdf) * (albedo * emitted);
+}
+
+double camera::bsdf_pdf(const ray &incident, const hit_record &record,
+                        const double lobe_coeffs[], double total,
+                        const vec3 &direction) const {
+  // Density of the unit direction as picked by choosing a lobe and scattering
+  // through it, counting only the lobes that are not specular
+  double pdf = 0.0;
+  if (lobe_coeffs[lobe_diffuse] > 0.0)
+    pdf += (lobe_coeffs[lobe_diffuse] / total) *
+           record.mat->pdf_diffuse(record, direction);
+  if (lobe_coeffs[lobe_reflective] > 0.0)
+    pdf += (lobe_coeffs[lobe_reflective] / total) *
+           record.mat->pdf_reflective(incident, record, direction);
+  return pdf;
+}
+
+double camera::light_pdf(const world &w, const point3 &origin,
+                         const light *lig) const {
+  // Density of the light sampling techniques for a direction from origin that
+  // reaches the bulb emitting lig
+  const std::vector<bulb *> &lights = w.get_lights();
+  for (auto target : lights)
+    if (target->get_light() == lig)
+      return target->pdf_direction(origin) / lights.size();
+  return 0.0;
 }
\ No newline at end of file
@@ -0,0 +1,302 @@
+#include "compressed_bvh.hpp"
+#include "traversal_stats.hpp"
+#include "wide_traversal.hpp"
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstring>
+
+#if defined(__AVX512F__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+// Grid step covering the extent in 254 steps, rounded up to a float, which
+// leaves a step to spare for rounding outwards
+static float grid_scale(double extent) {
+  float scale = std::max(float(extent / 254.0), FLT_MIN);
+  if (scale * 254.0 < extent)
+    scale = std::nextafter(scale, FLT_MAX);
+  return scale;
+}
+
+// Grid points of a child's slab, moved outwards until the rounded slab
+// encloses it whether child_hits works it out with a fused multiply-add or
+// not
+static void quantize(const interval &slab, double origin, double scale,
+                     uint8_t &lower, uint8_t &upper) {
+  auto grid_point = [&](int q, bool lowest) {
+    double fused = std::fma(q, scale, origin);
+    double separate = origin + q * scale;
+    return lowest ? std::fmax(fused, separate) : std::fmin(fused, separate);
+  };
+
+  int low = std::clamp(int(std::floor((slab.min - origin) / scale)), 0, 255);
+  int high = std::clamp(int(std::ceil((slab.max - origin) / scale)), 0, 255);
+  while (low > 0 && grid_point(low, true) > slab.min)
+    low--;
+  while (high < 255 && grid_point(high, false) < slab.max)
+    high++;
+  lower = uint8_t(low);
+  upper = uint8_t(high);
+}
+
+compressed_bvh::compressed_bvh(const std::vector<object *> &objects,
+                               bool spatial_splits) {
+  bvh binary(objects, spatial_splits);
+  this->unbounded = std::move(binary.unbounded);
+  if (binary.nodes.empty())
+    return;
+
+  // Leaves in the order the binary tree placed their objects
+  std::vector<int> leaf_index(binary.nodes.size(), -1);
+  for (size_t i = 0; i < binary.nodes.size(); i++) {
+    const bvh::node &b = binary.nodes[i];
+    if (b.count > 0) {
+      leaf_index[i] = int(this->leaves.size());
+      this->leaves.push_back(leaf{b.offset, b.sphere_offset});
+    }
+  }
+  this->leaves.push_back(
+      leaf{int(binary.primitives.size()), binary.spheres.size()});
+
+  if (binary.nodes[0].count > 0) {
+    // A single leaf still gets a node above it, as traversal starts at one
+    this->nodes.emplace_back();
+    this->nodes[0].child[0] = ~0;
+    this->nodes[0].count = 1;
+    this->set_root_bounds(0, binary.nodes[0].bounds);
+  } else {
+    int children[width];
+    int count = binary.collapse_children(0, width, children);
+    for (int c = 0; c < count; c++)
+      this->set_root_bounds(c, binary.nodes[children[c]].bounds);
+    this->collapse(binary, 0, leaf_index);
+  }
+
+  this->primitives = std::move(binary.primitives);
+  this->spheres = std::move(binary.spheres);
+}
+
+int compressed_bvh::collapse(const bvh &binary, int binary_index,
+                             const std::vector<int> &leaf_index) {
+  int children[width];
+  int count = binary.collapse_children(binary_index, width, children);
+
+  int index = int(this->nodes.size());
+  this->nodes.emplace_back();
+  const aabb &bounds = binary.nodes[binary_index].bounds;
+  {
+    node &n = this->nodes[index];
+    n.count = count;
+    for (int axis = 0; axis < 3; axis++) {
+      n.origin[axis] = bounds.axis_interval(axis).min;
+      n.scale[axis] = grid_scale(bounds.axis_interval(axis).size());
+    }
+  }
+
+  for (int c = 0; c < count; c++) {
+    const bvh::node &b = binary.nodes[children[c]];
+    int reference = (b.count > 0)
+                        ? ~leaf_index[children[c]]
+                        : this->collapse(binary, children[c], leaf_index);
+
+    // Indexed again, as collapsing the child may have grown the vector
+    node &n = this->nodes[index];
+    n.child[c] = reference;
+    for (int axis = 0; axis < 3; axis++)
+      quantize(b.bounds.axis_interval(axis), n.origin[axis], n.scale[axis],
+               n.lower[axis][c], n.upper[axis][c]);
+  }
+  return index;
+}
+
+bool compressed_bvh::check_hit(const ray &r, interval ray_t,
+                               hit_record &record) const {
+  hit_record temp_rec;
+  bool hit_anything = this->check_unbounded(r, ray_t, record);
+  double closest_so_far = ray_t.max;
+
+  if (this->nodes.empty())
+    return hit_anything;
+
+  point3 origin = r.get_origin();
+  vec3 inv_direction = inverse_direction(r);
+
+  wide_traversal<node, width>::closest_hit(
+      this->nodes, interval(ray_t.min, closest_so_far),
+      [&](int index, double t_min, double t_max, double *t_entry) {
+        return child_hits(this->nodes[index],
+                          (index == 0) ? &this->root_bounds : nullptr, origin,
+                          inv_direction, t_min, t_max, t_entry);
+      },
+      [&](int index, interval search_t) {
+        if (this->check_leaf(index, r, search_t, temp_rec)) {
+          hit_anything = true;
+          search_t.max = temp_rec.t;
+          record = temp_rec;
+        }
+        return search_t;
+      });
+  return hit_anything;
+}
+
+bool compressed_bvh::check_occluded(const ray &r, interval ray_t) const {
+  if (this->check_unbounded_occluded(r, ray_t))
+    return true;
+
+  if (this->nodes.empty())
+    return false;
+
+  point3 origin = r.get_origin();
+  vec3 inv_direction = inverse_direction(r);
+
+  return wide_traversal<node, width>::any_hit(
+      this->nodes, ray_t,
+      [&](int index, double t_min, double t_max, double *t_entry) {
+        return child_hits(this->nodes[index],
+                          (index == 0) ? &this->root_bounds : nullptr, origin,
+                          inv_direction, t_min, t_max, t_entry);
+      },
+      [&](int index) {
+        const leaf &l = this->leaves[index];
+        const leaf &next = this->leaves[index + 1];
+        traversal_stats::count_objects(next.offset - l.offset +
+                                       next.sphere_offset - l.sphere_offset);
+        for (int i = l.offset; i < next.offset; i++)
+          if (this->primitives[i]->check_occluded(r, ray_t))
+            return true;
+        return this->spheres.check_occluded(r, ray_t, l.sphere_offset,
+                                            next.sphere_offset);
+      });
+}
+
+bool compressed_bvh::check_leaf(int index, const ray &r, interval ray_t,
+                                hit_record &record) const {
+  // Closest hit among the leaf's objects
+  const leaf &l = this->leaves[index];
+  const leaf &next = this->leaves[index + 1];
+  traversal_stats::count_objects(next.offset - l.offset + next.sphere_offset -
+                                 l.sphere_offset);
+  hit_record temp_rec;
+  bool hit_anything = false;
+  for (int i = l.offset; i < next.offset; i++) {
+    if (this->primitives[i]->check_hit(r, ray_t, temp_rec)) {
+      hit_anything = true;
+      ray_t.max = temp_rec.t;
+      record = temp_rec;
+    }
+  }
+
+  if (next.sphere_offset > l.sphere_offset &&
+      this->spheres.check_hit(r, ray_t, l.sphere_offset, next.sphere_offset,
+                              temp_rec)) {
+    hit_anything = true;
+    record = temp_rec;
+  }
+
+  return hit_anything;
+}
+
+// Rebuilds the child boxes from the grid, origin + q * scale with the product
+// exact, and runs the slab test of wide_bvh::child_hits on them
+unsigned compressed_bvh::child_hits(const node &n, const exact_bounds *exact,
+                                    const point3 &origin,
+                                    const vec3 &inv_direction, double t_min,
+                                    double t_max, double *t_entry) {
+  unsigned used = (1u << n.count) - 1;
+#if defined(__AVX512F__)
+  __m512d t_near = _mm512_set1_pd(t_min);
+  __m512d t_far = _mm512_set1_pd(t_max);
+  for (int axis = 0; axis < 3; axis++) {
+    __m512d lower, upper;
+    if (exact) {
+      lower = _mm512_load_pd(exact->lower[axis]);
+      upper = _mm512_load_pd(exact->upper[axis]);
+    } else {
+      __m512d grid_origin = _mm512_set1_pd(n.origin[axis]);
+      __m512d scale = _mm512_set1_pd(n.scale[axis]);
+      lower = _mm512_fmadd_pd(
+          _mm512_cvtepi32_pd(_mm256_cvtepu8_epi32(_mm_loadl_epi64(
+              reinterpret_cast<const __m128i *>(n.lower[axis])))),
+          scale, grid_origin);
+      upper = _mm512_fmadd_pd(
+          _mm512_cvtepi32_pd(_mm256_cvtepu8_epi32(_mm_loadl_epi64(
+              reinterpret_cast<const __m128i *>(n.upper[axis])))),
+          scale, grid_origin);
+    }
+
+    __m512d o = _mm512_set1_pd(origin[axis]);
+    __m512d inv = _mm512_set1_pd(inv_direction[axis]);
+    __m512d t0 = _mm512_mul_pd(_mm512_sub_pd(lower, o), inv);
+    __m512d t1 = _mm512_mul_pd(_mm512_sub_pd(upper, o), inv);
+    __mmask8 swap = _mm512_cmp_pd_mask(t0, t1, _CMP_GT_OQ);
+    __m512d entry = _mm512_mask_blend_pd(swap, t0, t1);
+    __m512d exit = _mm512_mask_blend_pd(swap, t1, t0);
+    t_near = _mm512_max_pd(entry, t_near);
+    t_far = _mm512_min_pd(exit, t_far);
+  }
+  _mm512_storeu_pd(t_entry, t_near);
+  return _mm512_cmp_pd_mask(t_far, t_near, _CMP_GE_OQ) & used;
+#elif defined(__AVX2__)
+  // Two halves of four children each
+  unsigned hit = 0;
+  for (int half = 0; half < width; half += 4) {
+    __m256d t_near = _mm256_set1_pd(t_min);
+    __m256d t_far = _mm256_set1_pd(t_max);
+    for (int axis = 0; axis < 3; axis++) {
+      __m256d lower, upper;
+      if (exact) {
+        lower = _mm256_load_pd(exact->lower[axis] + half);
+        upper = _mm256_load_pd(exact->upper[axis] + half);
+      } else {
+        int lower_bytes, upper_bytes;
+        std::memcpy(&lower_bytes, n.lower[axis] + half, 4);
+        std::memcpy(&upper_bytes, n.upper[axis] + half, 4);
+        __m256d grid_origin = _mm256_set1_pd(n.origin[axis]);
+        __m256d scale = _mm256_set1_pd(n.scale[axis]);
+        lower = _mm256_add_pd(
+            _mm256_mul_pd(_mm256_cvtepi32_pd(_mm_cvtepu8_epi32(
+                              _mm_cvtsi32_si128(lower_bytes))),
+                          scale),
+            grid_origin);
+        upper = _mm256_add_pd(
+            _mm256_mul_pd(_mm256_cvtepi32_pd(_mm_cvtepu8_epi32(
+                              _mm_cvtsi32_si128(upper_bytes))),
+                          scale),
+            grid_origin);
+      }
+
+      __m256d o = _mm256_set1_pd(origin[axis]);
+      __m256d inv = _mm256_set1_pd(inv_direction[axis]);
+      __m256d t0 = _mm256_mul_pd(_mm256_sub_pd(lower, o), inv);
+      __m256d t1 = _mm256_mul_pd(_mm256_sub_pd(upper, o), inv);
+      __m256d swap = _mm256_cmp_pd(t0, t1, _CMP_GT_OQ);
+      __m256d entry = _mm256_blendv_pd(t0, t1, swap);
+      __m256d exit = _mm256_blendv_pd(t1, t0, swap);
+      t_near = _mm256_max_pd(entry, t_near);
+      t_far = _mm256_min_pd(exit, t_far);
+    }
+    _mm256_storeu_pd(t_entry + half, t_near);
+    hit |= unsigned(_mm256_movemask_pd(
+               _mm256_cmp_pd(t_far, t_near, _CMP_GE_OQ)))
+           << half;
+  }
+  return hit & used;
+#else
+  unsigned hit = 0;
+  for (int c = 0; c < n.count; c++) {
+    interval slabs[3];
+    for (int axis = 0; axis < 3; axis++) {
+      double scale = n.scale[axis];
+      slabs[axis] =
+          exact ? interval(exact->lower[axis][c], exact->upper[axis][c])
+                : interval(n.origin[axis] + n.lower[axis][c] * scale,
+                           n.origin[axis] + n.upper[axis][c] * scale);
+    }
+    aabb box(slabs[0], slabs[1], slabs[2]);
+    if (box.hit(origin, inv_direction, interval(t_min, t_max), t_entry[c]))
+      hit |= 1u << c;
+  }
+  return hit & used;
+#endif
+}
@@ -0,0 +1,247 @@
+#include "grid.hpp"
+#include "traversal_stats.hpp"
+#include <algorithm>
+#include <cmath>
+
+// Cells per object aimed for, and the most cells along any axis
+static const double cells_per_object = 2.0;
+static const int max_resolution = 256;
+
+// Objects this many times larger than the median one stay out of the grid
+static const double large_factor = 16.0;
+
+static double largest_extent(const aabb &box) {
+  return std::max({box.x.size(), box.y.size(), box.z.size()});
+}
+
+grid::grid(const std::vector<object *> &objects) {
+  std::vector<aabb> boxes;
+  boxes.reserve(objects.size());
+  for (auto obj : objects) {
+    aabb box = obj->bounding_box();
+    if (!box.is_bounded()) {
+      this->out_of_band.emplace_back(obj);
+    } else if (!box.is_empty()) {
+      this->objects.emplace_back(obj);
+      boxes.emplace_back(box);
+    }
+  }
+
+  if (this->objects.empty())
+    return;
+
+  // Moves the large objects out of the grid, judging size by the median
+  std::vector<double> extents(boxes.size());
+  for (size_t i = 0; i < boxes.size(); i++)
+    extents[i] = largest_extent(boxes[i]);
+  std::nth_element(extents.begin(), extents.begin() + extents.size() / 2,
+                   extents.end());
+  double large_extent = large_factor * extents[extents.size() / 2];
+
+  size_t kept = 0;
+  for (size_t i = 0; i < boxes.size(); i++) {
+    if (large_extent > 0 && largest_extent(boxes[i]) > large_extent) {
+      this->out_of_band.emplace_back(this->objects[i]);
+      continue;
+    }
+    this->objects[kept] = this->objects[i];
+    boxes[kept] = boxes[i];
+    kept++;
+  }
+  this->objects.resize(kept);
+  boxes.resize(kept);
+
+  for (const aabb &box : boxes)
+    this->bounds = aabb(this->bounds, box);
+
+  // Flat axes get a sliver of thickness, so that no cell is empty in size
+  double scene_extent = largest_extent(this->bounds);
+  double min_extent = (scene_extent > 0) ? scene_extent * 1e-6 : 1e-6;
+  vec3 extent;
+  interval slabs[3];
+  for (int axis = 0; axis < 3; axis++) {
+    const interval &slab = this->bounds.axis_interval(axis);
+    double padding = std::max(0.0, min_extent - slab.size()) / 2;
+    slabs[axis] = interval(slab.min - padding, slab.max + padding);
+    extent[axis] = slabs[axis].size();
+  }
+  this->bounds = aabb(slabs[0], slabs[1], slabs[2]);
+
+  // Cells of the same size along every axis, about cells_per_object of them
+  // per object. Axes too thin for more than one cell are left out of the
+  // count, so that flat scenes get their cells spread over the other two
+  double target = cells_per_object * double(kept);
+  bool thin[3] = {false, false, false};
+  for (int pass = 0; pass < 3; pass++) {
+    double volume = 1.0;
+    int dimensions = 0;
+    for (int axis = 0; axis < 3; axis++) {
+      if (!thin[axis]) {
+        volume *= extent[axis];
+        dimensions++;
+      }
+    }
+    double cells_per_unit = std::pow(target / volume, 1.0 / dimensions);
+
+    bool changed = false;
+    for (int axis = 0; axis < 3; axis++) {
+      int count = int(std::round(extent[axis] * cells_per_unit));
+      this->cells[axis] = std::clamp(count, 1, max_resolution);
+      if (!thin[axis] && count <= 1) {
+        thin[axis] = true;
+        changed = true;
+      }
+    }
+    if (!changed || dimensions == 1)
+      break;
+  }
+  for (int axis = 0; axis < 3; axis++)
+    this->cell_size[axis] = extent[axis] / this->cells[axis];
+
+  // Counts the objects of every cell, turns the counts into offsets, and
+  // fills the cells in a second pass
+  int num_cells = this->cells[0] * this->cells[1] * this->cells[2];
+  this->cell_start.assign(num_cells + 1, 0);
+  int first[3], last[3];
+  for (const aabb &box : boxes) {
+    this->cell_range(box, first, last);
+    for (int z = first[2]; z <= last[2]; z++)
+      for (int y = first[1]; y <= last[1]; y++)
+        for (int x = first[0]; x <= last[0]; x++)
+          this->cell_start[this->cell_index(x, y, z) + 1]++;
+  }
+  for (int c = 0; c < num_cells; c++)
+    this->cell_start[c + 1] += this->cell_start[c];
+
+  this->cell_objects.resize(this->cell_start[num_cells]);
+  std::vector<int> cursor(this->cell_start.begin(), this->cell_start.end() - 1);
+  for (int i = 0; i < int(boxes.size()); i++) {
+    this->cell_range(boxes[i], first, last);
+    for (int z = first[2]; z <= last[2]; z++)
+      for (int y = first[1]; y <= last[1]; y++)
+        for (int x = first[0]; x <= last[0]; x++)
+          this->cell_objects[cursor[this->cell_index(x, y, z)]++] = i;
+  }
+}
+
+void grid::cell_range(const aabb &box, int *first, int *last) const {
+  for (int axis = 0; axis < 3; axis++) {
+    const interval &slab = box.axis_interval(axis);
+    double origin = this->bounds.axis_interval(axis).min;
+    int limit = this->cells[axis] - 1;
+    first[axis] =
+        std::clamp(int((slab.min - origin) / this->cell_size[axis]), 0, limit);
+    last[axis] =
+        std::clamp(int((slab.max - origin) / this->cell_size[axis]), 0, limit);
+  }
+}
+
+template <typename cell_visitor>
+void grid::walk(const ray &r, interval ray_t, const cell_visitor &visit) const {
+  if (this->cell_start.empty())
+    return;
+
+  point3 origin = r.get_origin();
+  vec3 direction = r.get_direction();
+  vec3 inv_direction = inverse_direction(r);
+
+  double t_enter;
+  if (!this->bounds.hit(origin, inv_direction, ray_t, t_enter))
+    return;
+
+  // Cell where the ray enters the grid, and where it crosses the next cell
+  // boundary along each axis
+  point3 entry = r.at(t_enter);
+  int cell[3], step[3];
+  double t_next[3], t_delta[3];
+  for (int axis = 0; axis < 3; axis++) {
+    double grid_min = this->bounds.axis_interval(axis).min;
+    cell[axis] =
+        std::clamp(int((entry[axis] - grid_min) / this->cell_size[axis]), 0,
+                   this->cells[axis] - 1);
+    if (direction[axis] > 0) {
+      step[axis] = 1;
+      t_next[axis] = (grid_min + (cell[axis] + 1) * this->cell_size[axis] -
+                      origin[axis]) *
+                     inv_direction[axis];
+      t_delta[axis] = this->cell_size[axis] * inv_direction[axis];
+    } else if (direction[axis] < 0) {
+      step[axis] = -1;
+      t_next[axis] =
+          (grid_min + cell[axis] * this->cell_size[axis] - origin[axis]) *
+          inv_direction[axis];
+      t_delta[axis] = -this->cell_size[axis] * inv_direction[axis];
+    } else {
+      step[axis] = 0;
+      t_next[axis] = mathconst::infinity;
+      t_delta[axis] = mathconst::infinity;
+    }
+  }
+
+  while (true) {
+    int axis = (t_next[0] < t_next[1]) ? ((t_next[0] < t_next[2]) ? 0 : 2)
+                                       : ((t_next[1] < t_next[2]) ? 1 : 2);
+    int c = this->cell_index(cell[0], cell[1], cell[2]);
+    traversal_stats::count_nodes(1);
+    traversal_stats::count_objects(this->cell_start[c + 1] -
+                                   this->cell_start[c]);
+    if (visit(this->cell_start[c], this->cell_start[c + 1], t_next[axis]))
+      return;
+    if (t_next[axis] > ray_t.max)
+      return;
+
+    cell[axis] += step[axis];
+    if (cell[axis] < 0 || cell[axis] >= this->cells[axis])
+      return;
+    t_next[axis] += t_delta[axis];
+  }
+}
+
+bool grid::check_hit(const ray &r, interval ray_t, hit_record &record) const {
+  hit_record temp_rec;
+  bool hit_anything = false;
+  double closest_so_far = ray_t.max;
+
+  // Objects out of the grid are always tested
+  for (auto obj : this->out_of_band) {
+    if (obj->check_hit(r, interval(ray_t.min, closest_so_far), temp_rec)) {
+      hit_anything = true;
+      closest_so_far = temp_rec.t;
+      record = temp_rec;
+    }
+  }
+
+  // A hit found in a cell may lie past it, inside a later cell the object
+  // also overlaps, so the walk only stops once the closest hit is behind the
+  // cell's exit
+  this->walk(r, interval(ray_t.min, closest_so_far),
+             [&](int begin, int end, double t_exit) {
+               for (int k = begin; k < end; k++) {
+                 object *obj = this->objects[this->cell_objects[k]];
+                 if (obj->check_hit(r, interval(ray_t.min, closest_so_far),
+                                    temp_rec)) {
+                   hit_anything = true;
+                   closest_so_far = temp_rec.t;
+                   record = temp_rec;
+                 }
+               }
+               return hit_anything && closest_so_far <= t_exit;
+             });
+
+  return hit_anything;
+}
+
+bool grid::check_occluded(const ray &r, interval ray_t) const {
+  for (auto obj : this->out_of_band)
+    if (obj->check_occluded(r, ray_t))
+      return true;
+
+  bool occluded = false;
+  this->walk(r, ray_t, [&](int begin, int end, double) {
+    for (int k = begin; k < end && !occluded; k++)
+      occluded =
+          this->objects[this->cell_objects[k]]->check_occluded(r, ray_t);
+    return occluded;
+  });
+  return occluded;
+}
@@ -0,0 +1,54 @@
+#include "instance.hpp"
+#include "material.hpp"
+
+instance::instance(const world *prototype, const transform &to_world,
+                   material *mat)
+    : prototype(prototype), to_world(to_world), to_local(to_world.inverse()),
+      mat(mat) {
+  for (auto obj : prototype->get_objects()) {
+    aabb box = obj->bounding_box();
+    if (!box.is_bounded()) {
+      this->bbox = aabb::universe;
+      return;
+    }
+    this->bbox = aabb(this->bbox, to_world.apply_box(box));
+  }
+}
+
+instance::~instance() { delete this->mat; }
+
+bool instance::check_hit(const ray &r, interval ray_t,
+                         hit_record &record) const {
+  // The local ray is not normalized, so that distances along it match the
+  // ones along r
+  ray local(this->to_local.apply_point(r.get_origin()),
+            this->to_local.apply_vector(r.get_direction()));
+  if (!this->prototype->check_hit(local, ray_t, record))
+    return false;
+
+  // The normal was already turned against the local ray, and the transform
+  // keeps which side of the surface the ray is on
+  record.point = r.at(record.t);
+  record.normal = unit_vector(this->to_local.apply_transposed(record.normal));
+  if (this->mat && !record.is_light)
+    record.mat = this->mat;
+  return true;
+}
+
+bool instance::check_occluded(const ray &r, interval ray_t) const {
+  ray local(this->to_local.apply_point(r.get_origin()),
+            this->to_local.apply_vector(r.get_direction()));
+  return this->prototype->check_occluded(local, ray_t);
+}
+
+bool instance::get_sphere(point3 &center, double &radius) const {
+  const std::vector<object *> &objects = this->prototype->get_objects();
+  double scale;
+  if (objects.size() != 1 || !objects[0]->get_sphere(center, radius) ||
+      !this->to_world.is_similarity(scale))
+    return false;
+
+  center = this->to_world.apply_point(center);
+  radius *= scale;
+  return true;
+}
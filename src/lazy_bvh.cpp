@@ -0,0 +1,189 @@
+#include "lazy_bvh.hpp"
+#include "traversal_stats.hpp"
+
+// Top nodes are split until they hold at most this many objects, which are
+// then left to a subtree. Building one takes about a millisecond
+static const int max_subtree_size = 1024;
+
+// Deeper top levels would overflow the traversal stack
+static const int max_depth = 60;
+
+lazy_bvh::lazy_bvh(const std::vector<object *> &objects, bool spatial_splits)
+    : spatial_splits(spatial_splits) {
+  this->entries.reserve(objects.size());
+  for (auto obj : objects) {
+    aabb bounds = obj->bounding_box();
+    if (!bounds.is_bounded())
+      this->unbounded.emplace_back(obj);
+    else if (!bounds.is_empty())
+      this->entries.push_back(bvh::build_entry{obj, bounds, bounds.centroid()});
+  }
+
+  if (this->entries.empty())
+    return;
+
+  // Partitioning leaves each subtree's objects together in the entries
+  this->build(0, int(this->entries.size()), 0);
+  this->subtree_offsets.push_back(int(this->entries.size()));
+  this->subtrees = std::vector<subtree>(this->subtree_offsets.size() - 1);
+}
+
+lazy_bvh::~lazy_bvh() {
+  for (const subtree &s : this->subtrees)
+    delete s.tree.load();
+}
+
+int lazy_bvh::build(int begin, int end, int depth) {
+  std::vector<bvh::build_entry> &entries = this->entries;
+  int index = int(this->nodes.size());
+  this->nodes.emplace_back();
+
+  aabb bounds;
+  aabb centroid_bounds;
+  for (int i = begin; i < end; i++) {
+    bounds = aabb(bounds, entries[i].bounds);
+    centroid_bounds =
+        aabb(centroid_bounds, aabb(entries[i].centroid, entries[i].centroid));
+  }
+  this->nodes[index].bounds = bounds;
+
+  // Splits whenever there is a split at all, as leaves here are subtrees
+  int axis = -1;
+  int split = 0;
+  if (end - begin > max_subtree_size && depth < max_depth)
+    bvh::find_object_split(entries, begin, end, bounds, centroid_bounds, axis,
+                           split);
+
+  if (axis < 0) {
+    this->nodes[index].offset = int(this->subtree_offsets.size());
+    this->nodes[index].axis = -1;
+    this->subtree_offsets.push_back(begin);
+    return index;
+  }
+
+  int mid = bvh::partition_objects(entries, begin, end, centroid_bounds, axis,
+                                   split);
+  this->build(begin, mid, depth + 1);
+  int second_child = this->build(mid, end, depth + 1);
+  this->nodes[index].offset = second_child;
+  this->nodes[index].axis = axis;
+  return index;
+}
+
+const bvh &lazy_bvh::expand(int index) const {
+  const subtree &s = this->subtrees[index];
+  bvh *tree = s.tree.load(std::memory_order_acquire);
+  if (tree != nullptr)
+    return *tree;
+
+  // Checked again under the lock, as another ray may have built it meanwhile
+  std::lock_guard<std::mutex> guard(s.lock);
+  tree = s.tree.load(std::memory_order_relaxed);
+  if (tree == nullptr) {
+    std::vector<bvh::build_entry> entries(
+        this->entries.begin() + this->subtree_offsets[index],
+        this->entries.begin() + this->subtree_offsets[index + 1]);
+    tree = new bvh();
+    tree->spatial_splits = this->spatial_splits;
+    tree->build_root(entries);
+    s.tree.store(tree, std::memory_order_release);
+  }
+  return *tree;
+}
+
+size_t lazy_bvh::memory_usage() const {
+  size_t bytes = vector_bytes(this->nodes) + vector_bytes(this->subtrees) +
+                 vector_bytes(this->entries) +
+                 vector_bytes(this->subtree_offsets) +
+                 vector_bytes(this->unbounded);
+  for (const subtree &s : this->subtrees) {
+    const bvh *tree = s.tree.load(std::memory_order_acquire);
+    if (tree != nullptr)
+      bytes += tree->memory_usage();
+  }
+  return bytes;
+}
+
+bool lazy_bvh::check_hit(const ray &r, interval ray_t,
+                         hit_record &record) const {
+  hit_record temp_rec;
+  bool hit_anything = this->check_unbounded(r, ray_t, record);
+  double closest_so_far = ray_t.max;
+
+  if (this->nodes.empty())
+    return hit_anything;
+
+  point3 origin = r.get_origin();
+  vec3 direction = r.get_direction();
+  vec3 inv_direction = inverse_direction(r);
+
+  int stack[max_depth + 1];
+  int stack_size = 0;
+  int current = 0;
+  while (true) {
+    const node &n = this->nodes[current];
+    traversal_stats::count_nodes(1);
+    if (n.bounds.hit(origin, inv_direction,
+                     interval(ray_t.min, closest_so_far))) {
+      if (n.axis < 0) {
+        if (this->expand(n.offset).check_hit(
+                r, interval(ray_t.min, closest_so_far), temp_rec)) {
+          hit_anything = true;
+          closest_so_far = temp_rec.t;
+          record = temp_rec;
+        }
+      } else {
+        // Visits the child nearest to the ray's origin first, as in bvh
+        if (direction[n.axis] < 0) {
+          stack[stack_size++] = current + 1;
+          current = n.offset;
+        } else {
+          stack[stack_size++] = n.offset;
+          current = current + 1;
+        }
+        continue;
+      }
+    }
+
+    if (stack_size == 0)
+      break;
+    current = stack[--stack_size];
+  }
+
+  return hit_anything;
+}
+
+bool lazy_bvh::check_occluded(const ray &r, interval ray_t) const {
+  if (this->check_unbounded_occluded(r, ray_t))
+    return true;
+
+  if (this->nodes.empty())
+    return false;
+
+  point3 origin = r.get_origin();
+  vec3 inv_direction = inverse_direction(r);
+
+  // Any blocker will do, so children are visited in storage order
+  int stack[max_depth + 1];
+  int stack_size = 0;
+  int current = 0;
+  while (true) {
+    const node &n = this->nodes[current];
+    traversal_stats::count_nodes(1);
+    if (n.bounds.hit(origin, inv_direction, ray_t)) {
+      if (n.axis < 0) {
+        if (this->expand(n.offset).check_occluded(r, ray_t))
+          return true;
+      } else {
+        stack[stack_size++] = n.offset;
+        current = current + 1;
+        continue;
+      }
+    }
+
+    if (stack_size == 0)
+      break;
+    current = stack[--stack_size];
+  }
+  return false;
+}
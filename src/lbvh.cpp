@@ -0,0 +1,302 @@
+#include "lbvh.hpp"
+#include "morton.hpp"
+#include "thread_pool.hpp"
+#include "traversal_stats.hpp"
+#include <algorithm>
+#include <atomic>
+#include <bit>
+
+// Objects handled by each task of the build
+static const int build_chunk_size = 16384;
+
+// Pending subtrees during traversal; the tree is at most 64 levels deep, as
+// every level splits on one more bit of the code or of the leaf index
+static const int max_stack_size = 64;
+
+// Runs task(begin, end) over [0, count) in chunks on the pool
+template <typename chunk_function>
+static void run_chunks(thread_pool &pool, int count,
+                       const chunk_function &task) {
+  int num_chunks = (count + build_chunk_size - 1) / build_chunk_size;
+  pool.run(num_chunks, [&](int chunk) {
+    task(chunk * build_chunk_size,
+         std::min(count, (chunk + 1) * build_chunk_size));
+  });
+}
+
+// Stable least significant digit radix sort of the keys, carrying the values
+// along. Each pass counts the digits of every chunk, turns the counts into
+// offsets ordered by digit and then chunk, and scatters each chunk in order
+static void radix_sort(std::vector<uint32_t> &keys, std::vector<int> &values,
+                       thread_pool &pool) {
+  int n = int(keys.size());
+  int num_chunks = (n + build_chunk_size - 1) / build_chunk_size;
+  std::vector<uint32_t> sorted_keys(n);
+  std::vector<int> sorted_values(n);
+  std::vector<int> offsets(num_chunks * 256);
+
+  for (int shift = 0; shift < 32; shift += 8) {
+    run_chunks(pool, n, [&](int begin, int end) {
+      int *count = &offsets[(begin / build_chunk_size) * 256];
+      std::fill(count, count + 256, 0);
+      for (int i = begin; i < end; i++)
+        count[(keys[i] >> shift) & 0xFF]++;
+    });
+
+    int sum = 0;
+    for (int digit = 0; digit < 256; digit++) {
+      for (int chunk = 0; chunk < num_chunks; chunk++) {
+        int count = offsets[chunk * 256 + digit];
+        offsets[chunk * 256 + digit] = sum;
+        sum += count;
+      }
+    }
+
+    run_chunks(pool, n, [&](int begin, int end) {
+      int *offset = &offsets[(begin / build_chunk_size) * 256];
+      for (int i = begin; i < end; i++) {
+        int destination = offset[(keys[i] >> shift) & 0xFF]++;
+        sorted_keys[destination] = keys[i];
+        sorted_values[destination] = values[i];
+      }
+    });
+
+    keys.swap(sorted_keys);
+    values.swap(sorted_values);
+  }
+}
+
+lbvh::lbvh(const std::vector<object *> &objects, thread_pool &pool) {
+  int num_objects = int(objects.size());
+  std::vector<aabb> boxes(num_objects);
+  run_chunks(pool, num_objects, [&](int begin, int end) {
+    for (int i = begin; i < end; i++)
+      boxes[i] = objects[i]->bounding_box();
+  });
+
+  std::vector<int> order;
+  order.reserve(num_objects);
+  for (int i = 0; i < num_objects; i++) {
+    if (!boxes[i].is_bounded())
+      this->unbounded.emplace_back(objects[i]);
+    else if (!boxes[i].is_empty())
+      order.emplace_back(i);
+  }
+
+  int n = int(order.size());
+  if (n == 0)
+    return;
+
+  // Box of the centroids, gathered per chunk and then merged
+  int num_chunks = (n + build_chunk_size - 1) / build_chunk_size;
+  std::vector<aabb> chunk_bounds(num_chunks);
+  run_chunks(pool, n, [&](int begin, int end) {
+    aabb bounds;
+    for (int i = begin; i < end; i++) {
+      point3 centroid = boxes[order[i]].centroid();
+      bounds = aabb(bounds, aabb(centroid, centroid));
+    }
+    chunk_bounds[begin / build_chunk_size] = bounds;
+  });
+  aabb centroid_bounds;
+  for (const aabb &bounds : chunk_bounds)
+    centroid_bounds = aabb(centroid_bounds, bounds);
+
+  this->codes.resize(n);
+  run_chunks(pool, n, [&](int begin, int end) {
+    for (int i = begin; i < end; i++)
+      this->codes[i] = morton_code(boxes[order[i]].centroid(), centroid_bounds);
+  });
+  radix_sort(this->codes, order, pool);
+
+  this->primitives.resize(n);
+  this->leaf_bounds.resize(n);
+  run_chunks(pool, n, [&](int begin, int end) {
+    for (int i = begin; i < end; i++) {
+      this->primitives[i] = objects[order[i]];
+      this->leaf_bounds[i] = boxes[order[i]];
+    }
+  });
+
+  if (n == 1) {
+    this->root = ~0;
+    this->codes.clear();
+    return;
+  }
+
+  // Every internal node finds its range of leaves and split on its own
+  this->nodes.resize(n - 1);
+  this->leaf_parent.resize(n);
+  this->node_parent.resize(n - 1);
+  this->node_parent[0] = -1;
+  run_chunks(pool, n - 1, [&](int begin, int end) {
+    for (int i = begin; i < end; i++)
+      this->emit_node(i);
+  });
+
+  // Bounds from the leaves up: of the two threads reaching a node, the second
+  // one finds both children done and carries on to the parent
+  std::vector<std::atomic<int>> arrivals(n - 1);
+  run_chunks(pool, n, [&](int begin, int end) {
+    for (int leaf = begin; leaf < end; leaf++) {
+      int current = this->leaf_parent[leaf];
+      while (current >= 0 &&
+             arrivals[current].fetch_add(1, std::memory_order_acq_rel) == 1) {
+        node &parent = this->nodes[current];
+        parent.bounds = aabb(this->child_bounds(parent.left),
+                             this->child_bounds(parent.right));
+        current = this->node_parent[current];
+      }
+    }
+  });
+
+  this->codes = std::vector<uint32_t>();
+  this->leaf_parent = std::vector<int>();
+  this->node_parent = std::vector<int>();
+}
+
+int lbvh::common_prefix(int i, int j) const {
+  // Length of the common prefix of two sorted codes, with the leaf index
+  // appended to tell equal codes apart; -1 outside the leaves
+  if (j < 0 || j >= int(this->codes.size()))
+    return -1;
+  if (this->codes[i] == this->codes[j])
+    return 32 + std::countl_zero(uint32_t(i ^ j));
+  return std::countl_zero(this->codes[i] ^ this->codes[j]);
+}
+
+void lbvh::emit_node(int i) {
+  // Direction of the node's range, towards the neighbor sharing more bits
+  int d = (this->common_prefix(i, i + 1) > this->common_prefix(i, i - 1)) ? 1
+                                                                           : -1;
+
+  // Other end of the range: every leaf in it shares more than delta_min bits
+  int delta_min = this->common_prefix(i, i - d);
+  int length_max = 2;
+  while (this->common_prefix(i, i + length_max * d) > delta_min)
+    length_max *= 2;
+  int length = 0;
+  for (int t = length_max / 2; t >= 1; t /= 2)
+    if (this->common_prefix(i, i + (length + t) * d) > delta_min)
+      length += t;
+  int j = i + length * d;
+
+  // Split: the last leaf sharing more than the range's common prefix with i
+  int delta_node = this->common_prefix(i, j);
+  int split = 0;
+  int step = length;
+  do {
+    step = (step + 1) / 2;
+    if (this->common_prefix(i, i + (split + step) * d) > delta_node)
+      split += step;
+  } while (step > 1);
+  int gamma = i + split * d + std::min(d, 0);
+
+  node &n = this->nodes[i];
+  if (std::min(i, j) == gamma) {
+    n.left = ~gamma;
+    this->leaf_parent[gamma] = i;
+  } else {
+    n.left = gamma;
+    this->node_parent[gamma] = i;
+  }
+  if (std::max(i, j) == gamma + 1) {
+    n.right = ~(gamma + 1);
+    this->leaf_parent[gamma + 1] = i;
+  } else {
+    n.right = gamma + 1;
+    this->node_parent[gamma + 1] = i;
+  }
+}
+
+bool lbvh::check_hit(const ray &r, interval ray_t, hit_record &record) const {
+  hit_record temp_rec;
+  bool hit_anything = this->check_unbounded(r, ray_t, record);
+  double closest_so_far = ray_t.max;
+
+  if (this->primitives.empty())
+    return hit_anything;
+
+  point3 origin = r.get_origin();
+  vec3 inv_direction = inverse_direction(r);
+
+  double t_entry;
+  if (!this->child_bounds(this->root).hit(
+          origin, inv_direction, interval(ray_t.min, closest_so_far), t_entry))
+    return hit_anything;
+
+  // Children are tested before being entered, nearest first
+  int stack[max_stack_size];
+  int stack_size = 0;
+  int current = this->root;
+  while (true) {
+    if (current < 0) {
+      traversal_stats::count_objects(1);
+      if (this->primitives[~current]->check_hit(
+              r, interval(ray_t.min, closest_so_far), temp_rec)) {
+        hit_anything = true;
+        closest_so_far = temp_rec.t;
+        record = temp_rec;
+      }
+    } else {
+      const node &n = this->nodes[current];
+      traversal_stats::count_nodes(1);
+      double t_left, t_right;
+      interval search(ray_t.min, closest_so_far);
+      bool hits_left = this->child_bounds(n.left).hit(origin, inv_direction,
+                                                      search, t_left);
+      bool hits_right = this->child_bounds(n.right).hit(origin, inv_direction,
+                                                        search, t_right);
+      if (hits_left && hits_right) {
+        bool left_first = (t_left <= t_right);
+        stack[stack_size++] = left_first ? n.right : n.left;
+        current = left_first ? n.left : n.right;
+        continue;
+      }
+      if (hits_left || hits_right) {
+        current = hits_left ? n.left : n.right;
+        continue;
+      }
+    }
+
+    if (stack_size == 0)
+      break;
+    current = stack[--stack_size];
+  }
+
+  return hit_anything;
+}
+
+bool lbvh::check_occluded(const ray &r, interval ray_t) const {
+  if (this->check_unbounded_occluded(r, ray_t))
+    return true;
+
+  if (this->primitives.empty())
+    return false;
+
+  point3 origin = r.get_origin();
+  vec3 inv_direction = inverse_direction(r);
+
+  // Any blocker will do, so children are visited in storage order
+  int stack[max_stack_size];
+  int stack_size = 0;
+  int current = this->root;
+  while (true) {
+    if (this->child_bounds(current).hit(origin, inv_direction, ray_t)) {
+      if (current < 0) {
+        traversal_stats::count_objects(1);
+        if (this->primitives[~current]->check_occluded(r, ray_t))
+          return true;
+      } else {
+        traversal_stats::count_nodes(1);
+        stack[stack_size++] = this->nodes[current].right;
+        current = this->nodes[current].left;
+        continue;
+      }
+    }
+
+    if (stack_size == 0)
+      return false;
+    current = stack[--stack_size];
+  }
+}
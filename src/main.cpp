@@ -2,9 +2,11 @@
 #include "color.hpp"
 #include "material.hpp"
 #include "texture.hpp"
+#include "traversal_stats.hpp"
 #include "vec3.hpp"
 #include "world.hpp"
 #include <fstream>
+#include <map>
 #include <string>
 #include <vector>
 
@@ -31,11 +33,63 @@ public:
   double ka, kd, ks, alpha, kr, kt, ior = 0.0f;
 };
 
+class options {
+public:
+  // Splits the command line into positional arguments and "--name value"
+  // options; an option followed by another one (or by nothing) is a switch
+  options(int argc, char *argv[]) {
+    for (int i = 0; i < argc; i++) {
+      std::string arg = argv[i];
+      if (arg.rfind("--", 0) != 0) {
+        positional.emplace_back(argv[i]);
+        continue;
+      }
+
+      std::string name = arg.substr(2);
+      std::string value = "1";
+      size_t equals = name.find('=');
+      if (equals != std::string::npos) {
+        value = name.substr(equals + 1);
+        name = name.substr(0, equals);
+      } else if (i + 1 < argc && std::string(argv[i + 1]).rfind("--", 0) != 0)
+        value = argv[++i];
+      named[name] = value;
+    }
+  }
+
+  bool has(const std::string &name) const { return named.count(name) > 0; }
+
+  int get_int(const std::string &name, int fallback) const {
+    return has(name) ? std::stoi(named.at(name)) : fallback;
+  }
+
+  double get_double(const std::string &name, double fallback) const {
+    return has(name) ? std::stod(named.at(name)) : fallback;
+  }
+
+  std::string get_string(const std::string &name,
+                         const std::string &fallback) const {
+    return has(name) ? named.at(name) : fallback;
+  }
+
+  unsigned long long get_unsigned(const std::string &name,
+                                  unsigned long long fallback) const {
+    return has(name) ? std::stoull(named.at(name)) : fallback;
+  }
+
+  std::vector<char *> positional;
+  std::map<std::string, std::string> named;
+};
+
 int parse(int argc, char *argv[]) {
   /////////////////////////////////
   // Setting up files and arguments
   /////////////////////////////////
 
+  options opts(argc, argv);
+  argc = int(opts.positional.size());
+  argv = opts.positional.data();
+
   if (argc < 3) {
     std::cout
         << "Please provide input and output files as command-line arguments!"
@@ -48,7 +102,6 @@ int parse(int argc, char *argv[]) {
   char *output_file_name = argv[2];
 
   std::ifstream input_file(input_file_name);
-  std::ofstream output_file(output_file_name);
 
   int width = 1200;
   int height = 900;
@@ -71,6 +124,60 @@ int parse(int argc, char *argv[]) {
     focus_distance = std::stod(argv[8]);
   }
 
+  integrator_type integrator;
+  std::string integrator_name = opts.get_string("integrator", "tree");
+  if (integrator_name == "tree")
+    integrator = integrator_type::tree;
+  else if (integrator_name == "path")
+    integrator = integrator_type::path;
+  else if (integrator_name == "mis")
+    integrator = integrator_type::mis;
+  else {
+    std::cout << "Unknown integrator '" << integrator_name << "'!"
+              << std::endl;
+    return -1;
+  }
+  if (opts.has("wavefront") && integrator == integrator_type::tree) {
+    std::cout << "Wavefront rendering needs the path or mis integrator!"
+              << std::endl;
+    return -1;
+  }
+  if (opts.has("sort-rays") && !opts.has("wavefront")) {
+    std::cout << "Ray sorting needs wavefront rendering!" << std::endl;
+    return -1;
+  }
+
+  accel_type accel;
+  std::string accel_name = opts.get_string("accel", "wide");
+  if (accel_name == "list")
+    accel = accel_type::list;
+  else if (accel_name == "bvh")
+    accel = accel_type::bvh;
+  else if (accel_name == "wide")
+    accel = accel_type::wide_bvh;
+  else if (accel_name == "compressed")
+    accel = accel_type::compressed_bvh;
+  else if (accel_name == "lbvh")
+    accel = accel_type::lbvh;
+  else if (accel_name == "grid")
+    accel = accel_type::grid;
+  else if (accel_name == "lazy")
+    accel = accel_type::lazy_bvh;
+  else {
+    std::cout << "Unknown acceleration structure '" << accel_name << "'!"
+              << std::endl;
+    return -1;
+  }
+  bool spatial_splits = opts.has("spatial-splits");
+  if (spatial_splits && accel != accel_type::bvh &&
+      accel != accel_type::wide_bvh && accel != accel_type::compressed_bvh &&
+      accel != accel_type::lazy_bvh) {
+    std::cout << "Spatial splits need the bvh, wide, compressed or lazy "
+                 "accelerator!"
+              << std::endl;
+    return -1;
+  }
+
   // Shared variables
   double x, y, z, w;
 
@@ -110,6 +217,26 @@ int parse(int argc, char *argv[]) {
   rt_cam.max_recursion_depth = max_recursion_depth;
   rt_cam.defocus_angle = defocus_angle;
   rt_cam.focus_distance = focus_distance;
+  rt_cam.num_threads = opts.get_int("threads", 0);
+  rt_cam.seed = opts.get_unsigned("seed", 0);
+  rt_cam.integrator = integrator;
+  rt_cam.light_sampling = opts.has("nee");
+  rt_cam.adaptive_error = opts.get_double("adaptive", 0.0);
+  rt_cam.min_samples_per_pixel = opts.get_int("min-spp", 8);
+  rt_cam.sample_map_path = opts.get_string("spp-map", "");
+  rt_cam.samples_per_pass = opts.get_int("progressive", 0);
+  rt_cam.preview_every_passes = opts.get_int("preview-passes", 0);
+  rt_cam.preview_every_seconds = opts.get_double("preview-seconds", 0.0);
+  rt_cam.time_budget = opts.get_double("time-budget", 0.0);
+  rt_cam.wavefront = opts.has("wavefront");
+  rt_cam.wavefront_batch_size = opts.get_int("wavefront-batch", 1 << 16);
+  rt_cam.sort_rays = opts.has("sort-rays");
+  rt_cam.packet_size =
+      opts.get_int("packet-size", accelerator::max_packet_size);
+  rt_cam.prune_epsilon = opts.get_double("prune-epsilon", 0.0);
+  rt_cam.max_diffuse_depth = opts.get_int("max-diffuse-depth", -1);
+  rt_cam.max_reflection_depth = opts.get_int("max-reflection-depth", -1);
+  rt_cam.max_refraction_depth = opts.get_int("max-refraction-depth", -1);
 
   //////////////
   // Light setup
@@ -240,26 +367,49 @@ int parse(int argc, char *argv[]) {
       int num_of_faces;
       input_file >> num_of_faces;
 
-      // vec3 *normals = new vec3[num_of_faces];
-      // double *intercepts = new double[num_of_faces];
+      vec3 *normals = new vec3[num_of_faces];
+      double *intercepts = new double[num_of_faces];
       for (int j = 0; j < num_of_faces; j++) {
         double intercept;
         input_file >> x >> y >> z >> intercept;
-        // normals[j] = vec3(x, y, z);
-        // intercepts[j] = intercept;
+        normals[j] = vec3(x, y, z);
+        intercepts[j] = intercept;
       }
 
-      // rt_world.add_polyhedron(num_of_faces, normals, intercepts, mat);
+      // A single face is a plane, tested faster on its own
+      if (num_of_faces == 1) {
+        rt_world.add_plane(normals[0], intercepts[0], mat);
+        delete[] normals;
+        delete[] intercepts;
+      } else {
+        rt_world.add_polyhedron(num_of_faces, normals, intercepts, mat);
+      }
+    }
+
+    else if (object_type == "mesh") {
+      std::string mesh_path;
+      input_file >> mesh_path;
+
+      rt_world.add_mesh(mesh_path, mat);
     }
   }
 
+  /////////////////////////
+  // Acceleration structure
+  /////////////////////////
+
+  std::cout << "Acceleration structure setup." << std::endl;
+
+  rt_world.build(accel, rt_cam.num_threads, spatial_splits);
+
   ////////////
   // Rendering
   ////////////
 
   std::cout << "Rendering." << std::endl;
 
-  rt_cam.render(rt_world, output_file);
+  rt_cam.render(rt_world, output_file_name);
+  traversal_stats::report();
 
   ////////////
   // Finishing
@@ -269,7 +419,6 @@ int parse(int argc, char *argv[]) {
 
   // Closing files
   input_file.close();
-  output_file.close();
 
   return 0;
 }
@@ -278,7 +427,6 @@ int scene1(int argc, char *argv[]) {
   char *input_file_name = argv[1];
   char *output_file_name = argv[2];
   std::ifstream input_file(input_file_name);
-  std::ofstream output_file(output_file_name);
 
   camera cam;
 
@@ -296,6 +444,7 @@ int scene1(int argc, char *argv[]) {
   cam.focus_distance = 10.0;
 
   world w;
+  rng gen;
 
   texture *tex = new solid(color(0.5, 0.5, 0.5));
   material *mat = new material(tex);
@@ -315,23 +464,24 @@ int scene1(int argc, char *argv[]) {
 
   for (int a = -11; a < 11; a++) {
     for (int b = -11; b < 11; b++) {
-      auto choose_mat = random_double();
-      point3 center(a + 0.9 * random_double(), 0.2, b + 0.9 * random_double());
+      auto choose_mat = random_double(gen);
+      point3 center(a + 0.9 * random_double(gen), 0.2,
+                    b + 0.9 * random_double(gen));
 
       if ((center - point3(4, 0.2, 0)).length() > 0.9) {
         material *sphere_material;
 
         if (choose_mat < 0.8) {
           // diffuse
-          auto albedo = color::random() * color::random();
+          auto albedo = color::random(gen) * color::random(gen);
           tex = new solid(albedo);
           sphere_material = new material(tex);
           w.add_sphere(center, 0.2, sphere_material);
 
         } else if (choose_mat < 0.95) {
           // metal
-          auto albedo = color::random(0.5, 1);
-          auto fuzz = random_double(0, 0.5);
+          auto albedo = color::random(gen, 0.5, 1);
+          auto fuzz = random_double(gen, 0, 0.5);
           tex = new solid(albedo);
           mat =
               new material(tex, fuzz, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f);
@@ -348,7 +498,9 @@ int scene1(int argc, char *argv[]) {
     }
   }
 
-  cam.render(w, output_file);
+  w.build();
+  cam.render(w, output_file_name);
+  traversal_stats::report();
 
   return 0;
 }
@@ -357,7 +509,6 @@ int scene2(int argc, char *argv[]) {
   char *input_file_name = argv[1];
   char *output_file_name = argv[2];
   std::ifstream input_file(input_file_name);
-  std::ofstream output_file(output_file_name);
 
   camera cam;
 
@@ -384,7 +535,9 @@ int scene2(int argc, char *argv[]) {
   mat = new material(tex);
   w.add_sphere(point3(0, 10, 0), 10, mat);
 
-  cam.render(w, output_file);
+  w.build();
+  cam.render(w, output_file_name);
+  traversal_stats::report();
 
   return 0;
 }
@@ -393,7 +546,6 @@ int scene3(int argc, char *argv[]) {
   char *input_file_name = argv[1];
   char *output_file_name = argv[2];
   std::ifstream input_file(input_file_name);
-  std::ofstream output_file(output_file_name);
 
   camera cam;
 
@@ -424,7 +576,9 @@ int scene3(int argc, char *argv[]) {
   mat = new material(tex, 0, 0, 0, 0, 0, 1, 0, 0);
   w.add_sphere(point3(1.0, 0.0, -1.0), 0.5, mat);
 
-  cam.render(w, output_file);
+  w.build();
+  cam.render(w, output_file_name);
+  traversal_stats::report();
 
   return 0;
 }
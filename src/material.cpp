@@ -1,4 +1,5 @@
 #include "material.hpp"
+#include <initializer_list>
 
 material::material(texture *coloration) { this->coloration = coloration; }
 
@@ -21,10 +22,10 @@ material::~material() { delete this->coloration; }
 
 bool material::scatter_diffuse(const ray &incident, const hit_record &record,
                                color &attenuation, ray &scattered,
-                               double &diffuse_coeff) const {
+                               double &diffuse_coeff, rng &gen) const {
   // Generates the direction to which the ray is reflected
   // In the case of diffuse material, "random" following the normal
-  vec3 scatter_direction = record.normal + random_unit_vector();
+  vec3 scatter_direction = record.normal + random_unit_vector(gen);
 
   // Catch degenerate scatter direction
   if (scatter_direction.near_zero())
@@ -39,14 +40,14 @@ bool material::scatter_diffuse(const ray &incident, const hit_record &record,
 
 bool material::scatter_reflective(const ray &incident, const hit_record &record,
                                   color &attenuation, ray &scattered,
-                                  double &reflection_coeff) const {
+                                  double &reflection_coeff, rng &gen) const {
   // Generates the direction to which the ray is reflected
   // In the case of reflective material, symmetric according to normal
   vec3 scatter_direction = reflect(incident.get_direction(), record.normal);
 
   // Generates the fuzziness
   scatter_direction =
-      unit_vector(scatter_direction) + (fuzz * random_unit_vector());
+      unit_vector(scatter_direction) + (fuzz * random_unit_vector(gen));
 
   // Catch degenerate scatter direction
   if (scatter_direction.near_zero())
@@ -61,7 +62,7 @@ bool material::scatter_reflective(const ray &incident, const hit_record &record,
 
 bool material::scatter_refractive(const ray &incident, const hit_record &record,
                                   color &attenuation, ray &scattered,
-                                  double &refraction_coeff) const {
+                                  double &refraction_coeff, rng &gen) const {
   // Adjusts the refraction index according to if the ray is entering or exiting
   // the material
   double refraction_index = record.is_ray_outside
@@ -78,7 +79,7 @@ bool material::scatter_refractive(const ray &incident, const hit_record &record,
   bool cannot_refract = (refraction_index * sin_theta) > 1.0;
   bool schlick_correction =
       (cannot_refract ||
-       this->reflectance(cos_theta, refraction_index) > random_double());
+       this->reflectance(cos_theta, refraction_index) > random_double(gen));
 
   vec3 scatter_direction =
       schlick_correction
@@ -89,4 +90,38 @@ bool material::scatter_refractive(const ray &incident, const hit_record &record,
   attenuation = color(1.0, 1.0, 1.0);
   refraction_coeff = this->refraction_coeff;
   return true;
+}
+
+double material::pdf_diffuse(const hit_record &record,
+                             const vec3 &direction) const {
+  // normal + random_unit_vector() is cosine distributed about the normal
+  double cosine = dot(record.normal, direction);
+  return (cosine > 0.0) ? cosine / mathconst::pi : 0.0;
+}
+
+double material::pdf_reflective(const ray &incident, const hit_record &record,
+                                const vec3 &direction) const {
+  // Directions below the surface are discarded by scatter_reflective
+  if (this->is_reflection_specular() || dot(direction, record.normal) <= 0.0)
+    return 0.0;
+
+  // The scattered direction points at mirror + fuzz * u, with u uniform on the
+  // unit sphere, so it is found where the ray s * direction meets the sphere of
+  // radius fuzz around the mirror direction. Each meeting point contributes
+  // the sphere's area density 1 / (4 pi fuzz^2), converted to solid angle by
+  // s^2 / |cos(alpha)|, where alpha is the angle to the sphere's normal and
+  // |cos(alpha)| = sqrt(discriminant) / fuzz
+  vec3 mirror = unit_vector(reflect(incident.get_direction(), record.normal));
+  double b = dot(direction, mirror);
+  double discriminant = b * b - 1.0 + this->fuzz * this->fuzz;
+  if (discriminant <= 0.0)
+    return 0.0;
+
+  double sqrtd = std::sqrt(discriminant);
+  double squared_distances = 0.0;
+  for (double s : {b - sqrtd, b + sqrtd})
+    if (s > 0.0)
+      squared_distances += s * s;
+
+  return squared_distances / (4.0 * mathconst::pi * this->fuzz * sqrtd);
 }
\ No newline at end of file
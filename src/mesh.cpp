@@ -0,0 +1,222 @@
+#include "mesh.hpp"
+#include "material.hpp"
+#include "traversal_stats.hpp"
+#include <cmath>
+#include <fcntl.h>
+#include <iostream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+mesh::mesh(const std::string &path, material *mat) : mat(mat) {
+  int fd = open(path.c_str(), O_RDONLY);
+  struct stat info;
+  if (fd >= 0 && fstat(fd, &info) == 0 && info.st_size > 0) {
+    void *mapping = mmap(nullptr, size_t(info.st_size), PROT_READ,
+                         MAP_PRIVATE, fd, 0);
+    if (mapping != MAP_FAILED) {
+      this->data = mapping;
+      this->size = size_t(info.st_size);
+    }
+  }
+  if (fd >= 0)
+    close(fd);
+
+  if (this->data == nullptr ||
+      !mesh_file::check(this->data, this->size)) {
+    std::cerr << "ERROR: Could not load mesh file '" << path << "'.\n";
+    if (this->data != nullptr)
+      munmap(this->data, this->size);
+    this->data = nullptr;
+    this->size = 0;
+    return;
+  }
+
+  const char *bytes = static_cast<const char *>(this->data);
+  const mesh_file::header &h =
+      *reinterpret_cast<const mesh_file::header *>(bytes);
+  this->vertices = reinterpret_cast<const float *>(bytes + h.vertex_offset);
+  this->triangles =
+      reinterpret_cast<const uint32_t *>(bytes + h.triangle_offset);
+  this->nodes =
+      reinterpret_cast<const mesh_file::node *>(bytes + h.node_offset);
+  this->num_of_triangles = h.triangle_count;
+  if (this->num_of_triangles > 0) {
+    const mesh_file::node &root = this->nodes[0];
+    this->bbox = aabb(point3(root.lower[0], root.lower[1], root.lower[2]),
+                      point3(root.upper[0], root.upper[1], root.upper[2]));
+  }
+}
+
+mesh::~mesh() {
+  if (this->data != nullptr)
+    munmap(this->data, this->size);
+  delete this->mat;
+}
+
+mesh::sheared_ray::sheared_ray(const ray &r) : origin(r.get_origin()) {
+  vec3 direction = r.get_direction();
+  this->inv_direction =
+      vec3(1.0 / direction.x(), 1.0 / direction.y(), 1.0 / direction.z());
+
+  // Swapping the other two axes when looking down the dominant one keeps
+  // the triangles' winding, and so the signs of the edge functions
+  this->kz = 0;
+  for (int axis = 1; axis < 3; axis++)
+    if (std::fabs(direction[axis]) > std::fabs(direction[this->kz]))
+      this->kz = axis;
+  this->kx = (this->kz + 1) % 3;
+  this->ky = (this->kx + 1) % 3;
+  if (direction[this->kz] < 0)
+    std::swap(this->kx, this->ky);
+
+  this->sx = direction[this->kx] / direction[this->kz];
+  this->sy = direction[this->ky] / direction[this->kz];
+  this->sz = 1.0 / direction[this->kz];
+}
+
+bool mesh::hit_triangle(const sheared_ray &s, uint32_t triangle,
+                        interval ray_t, double &t, double &b1,
+                        double &b2) const {
+  const uint32_t *indices = this->triangles + 3 * size_t(triangle);
+  vec3 a = this->vertex(indices[0]) - s.origin;
+  vec3 b = this->vertex(indices[1]) - s.origin;
+  vec3 c = this->vertex(indices[2]) - s.origin;
+
+  double ax = a[s.kx] - s.sx * a[s.kz];
+  double ay = a[s.ky] - s.sy * a[s.kz];
+  double bx = b[s.kx] - s.sx * b[s.kz];
+  double by = b[s.ky] - s.sy * b[s.kz];
+  double cx = c[s.kx] - s.sx * c[s.kz];
+  double cy = c[s.ky] - s.sy * c[s.kz];
+
+  // Triangles sharing an edge compute its edge function from the same two
+  // sheared vertices, getting exactly opposite signs, so no ray slips
+  // between them; one exactly on the edge gets zero and hits both. This
+  // file is built without contracting products into multiply-adds, which
+  // would round the two triangles' products differently
+  double u = cx * by - cy * bx;
+  double v = ax * cy - ay * cx;
+  double w = bx * ay - by * ax;
+  if ((u < 0 || v < 0 || w < 0) && (u > 0 || v > 0 || w > 0))
+    return false;
+
+  double det = u + v + w;
+  if (det == 0)
+    return false;
+
+  double az = s.sz * a[s.kz];
+  double bz = s.sz * b[s.kz];
+  double cz = s.sz * c[s.kz];
+  t = (u * az + v * bz + w * cz) / det;
+  if (!ray_t.surrounds(t))
+    return false;
+
+  b1 = v / det;
+  b2 = w / det;
+  return true;
+}
+
+template <typename visitor>
+void mesh::traverse(const sheared_ray &s, interval ray_t,
+                    visitor visit) const {
+  if (this->num_of_triangles == 0)
+    return;
+
+  int stack[mesh_file::max_depth + 1];
+  int stack_size = 0;
+  int current = 0;
+  while (true) {
+    const mesh_file::node &n = this->nodes[current];
+    traversal_stats::count_nodes(1);
+
+    // The slab test of aabb::hit, on the node's float bounds
+    interval slab_t = ray_t;
+    for (int axis = 0; axis < 3 && slab_t.min <= slab_t.max; axis++) {
+      double t0 = (n.lower[axis] - s.origin[axis]) * s.inv_direction[axis];
+      double t1 = (n.upper[axis] - s.origin[axis]) * s.inv_direction[axis];
+      if (t0 > t1)
+        std::swap(t0, t1);
+      slab_t.min = std::fmax(t0, slab_t.min);
+      slab_t.max = std::fmin(t1, slab_t.max);
+    }
+
+    if (slab_t.min <= slab_t.max) {
+      if (n.count > 0) {
+        traversal_stats::count_objects(n.count);
+        for (uint32_t i = n.offset; i < n.offset + n.count; i++) {
+          ray_t = visit(i, ray_t);
+          if (ray_t.min > ray_t.max)
+            return;
+        }
+      } else {
+        // Visits the child nearest to the ray's origin first, as in bvh
+        if (s.inv_direction[n.axis] < 0) {
+          stack[stack_size++] = current + 1;
+          current = int(n.offset);
+        } else {
+          stack[stack_size++] = int(n.offset);
+          current = current + 1;
+        }
+        continue;
+      }
+    }
+
+    if (stack_size == 0)
+      break;
+    current = stack[--stack_size];
+  }
+}
+
+bool mesh::check_hit(const ray &r, interval ray_t,
+                     hit_record &record) const {
+  sheared_ray s(r);
+  bool hit_anything = false;
+  uint32_t closest = 0;
+  double closest_t = 0, closest_b1 = 0, closest_b2 = 0;
+  this->traverse(s, ray_t, [&](uint32_t triangle, interval search_t) {
+    double t, b1, b2;
+    if (this->hit_triangle(s, triangle, search_t, t, b1, b2)) {
+      hit_anything = true;
+      closest = triangle;
+      closest_t = t;
+      closest_b1 = b1;
+      closest_b2 = b2;
+      search_t.max = t;
+    }
+    return search_t;
+  });
+
+  if (!hit_anything)
+    return false;
+
+  const uint32_t *indices = this->triangles + 3 * size_t(closest);
+  point3 a = this->vertex(indices[0]);
+  point3 b = this->vertex(indices[1]);
+  point3 c = this->vertex(indices[2]);
+
+  record.t = closest_t;
+  record.point = r.at(closest_t);
+  record.mat = this->mat;
+  record.lig = nullptr;
+  record.tex_u = closest_b1;
+  record.tex_v = closest_b2;
+  record.adjust_normal_for_ray(r, unit_vector(cross(b - a, c - a)));
+  record.is_light = false;
+  return true;
+}
+
+bool mesh::check_occluded(const ray &r, interval ray_t) const {
+  // Any hit will do, so the search stops at the first
+  sheared_ray s(r);
+  bool occluded = false;
+  this->traverse(s, ray_t, [&](uint32_t triangle, interval search_t) {
+    double t, b1, b2;
+    if (this->hit_triangle(s, triangle, search_t, t, b1, b2)) {
+      occluded = true;
+      return interval::empty;
+    }
+    return search_t;
+  });
+  return occluded;
+}
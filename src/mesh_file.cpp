@@ -0,0 +1,295 @@
+#include "mesh_file.hpp"
+#include "aabb.hpp"
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <limits>
+
+// The layout is the file format, so it must not depend on the compiler
+static_assert(sizeof(mesh_file::header) == 48);
+static_assert(sizeof(mesh_file::node) == 32);
+
+const char mesh_file::magic[8] = {'R', 'T', 'M', 'E', 'S', 'H', '\0', '\0'};
+
+// Binned SAH parameters, as in bvh
+static const int num_bins = 12;
+static const int max_leaf_size = 4;
+static const double traversal_cost = 1.0; // Relative to one triangle test
+
+static aabb box(const float *lower, const float *upper) {
+  return aabb(point3(lower[0], lower[1], lower[2]),
+              point3(upper[0], upper[1], upper[2]));
+}
+
+static int bin_index(float value, float min, float extent) {
+  // Bin of the given coordinate within the extent
+  int b = int(num_bins * (double(value) - min) / extent);
+  return std::clamp(b, 0, num_bins - 1);
+}
+
+static uint64_t align_section(uint64_t offset) {
+  uint64_t a = mesh_file::section_alignment;
+  return (offset + a - 1) / a * a;
+}
+
+bool mesh_file::check(const void *data, size_t size) {
+  if (size < sizeof(header))
+    return false;
+
+  const char *bytes = static_cast<const char *>(data);
+  const header &h = *reinterpret_cast<const header *>(bytes);
+  if (std::memcmp(h.magic, magic, sizeof(magic)) != 0 || h.version != version)
+    return false;
+
+  auto fits = [&](uint64_t offset, uint64_t count, uint64_t item_size) {
+    return offset % section_alignment == 0 && offset <= size &&
+           count <= (size - offset) / item_size;
+  };
+  if (!fits(h.vertex_offset, 3 * uint64_t(h.vertex_count), sizeof(float)) ||
+      !fits(h.triangle_offset, 3 * uint64_t(h.triangle_count),
+            sizeof(uint32_t)) ||
+      !fits(h.node_offset, h.node_count, sizeof(node)) ||
+      (h.triangle_count > 0 && h.node_count == 0))
+    return false;
+
+  const uint32_t *triangles =
+      reinterpret_cast<const uint32_t *>(bytes + h.triangle_offset);
+  for (uint64_t i = 0; i < 3 * uint64_t(h.triangle_count); i++)
+    if (triangles[i] >= h.vertex_count)
+      return false;
+
+  if (h.triangle_count == 0)
+    return true;
+
+  // Walks the tree from the root. Children come after their parents, so the
+  // walk ends, and counting the nodes it reaches catches nodes shared by
+  // several parents, which would otherwise make it exponential
+  const node *nodes = reinterpret_cast<const node *>(bytes + h.node_offset);
+  int stack[max_depth + 1];
+  int depth_of[max_depth + 1];
+  int stack_size = 1;
+  stack[0] = 0;
+  depth_of[0] = 0;
+  uint64_t reached = 0;
+  while (stack_size > 0) {
+    stack_size--;
+    uint32_t index = uint32_t(stack[stack_size]);
+    int depth = depth_of[stack_size];
+    const node &n = nodes[index];
+    if (++reached > h.node_count)
+      return false;
+
+    if (n.count > 0) {
+      if (uint64_t(n.offset) + n.count > h.triangle_count)
+        return false;
+      continue;
+    }
+
+    if (depth >= max_depth || index + 1 >= h.node_count ||
+        n.offset <= index + 1 || n.offset >= h.node_count || n.axis > 2)
+      return false;
+    stack[stack_size] = int(n.offset);
+    depth_of[stack_size++] = depth + 1;
+    stack[stack_size] = int(index + 1);
+    depth_of[stack_size++] = depth + 1;
+  }
+  return true;
+}
+
+bool mesh_file::write(const std::string &path,
+                      const std::vector<float> &vertices,
+                      std::vector<uint32_t> &triangles) {
+  uint64_t vertex_count = vertices.size() / 3;
+  uint64_t triangle_count = triangles.size() / 3;
+  if (vertex_count > std::numeric_limits<uint32_t>::max() ||
+      triangle_count > std::numeric_limits<uint32_t>::max()) {
+    std::cerr << "ERROR: Mesh too large for '" << path << "'.\n";
+    return false;
+  }
+
+  std::vector<build_entry> entries(triangle_count);
+  for (uint32_t t = 0; t < triangle_count; t++) {
+    build_entry &e = entries[t];
+    e.triangle = t;
+    for (int axis = 0; axis < 3; axis++) {
+      e.lower[axis] = std::numeric_limits<float>::infinity();
+      e.upper[axis] = -std::numeric_limits<float>::infinity();
+    }
+    for (int k = 0; k < 3; k++) {
+      uint32_t v = triangles[3 * t + k];
+      if (v >= vertex_count) {
+        std::cerr << "ERROR: Triangle " << t << " refers to vertex " << v
+                  << ", past the mesh's " << vertex_count << ".\n";
+        return false;
+      }
+      for (int axis = 0; axis < 3; axis++) {
+        e.lower[axis] = std::min(e.lower[axis], vertices[3 * v + axis]);
+        e.upper[axis] = std::max(e.upper[axis], vertices[3 * v + axis]);
+      }
+    }
+  }
+
+  std::vector<node> nodes;
+  if (!entries.empty()) {
+    nodes.reserve(entries.size() / 2 + 1);
+    if (build(entries, 0, int(entries.size()), 0, nodes) < 0) {
+      std::cerr << "ERROR: Mesh too deep to index for '" << path << "'.\n";
+      return false;
+    }
+  }
+
+  // Leaves refer to the triangles in the order the build left the entries
+  std::vector<uint32_t> ordered(triangles.size());
+  for (size_t i = 0; i < entries.size(); i++)
+    std::copy_n(&triangles[3 * size_t(entries[i].triangle)], 3,
+                &ordered[3 * i]);
+  triangles.swap(ordered);
+
+  header h{};
+  std::memcpy(h.magic, magic, sizeof(magic));
+  h.version = version;
+  h.vertex_count = uint32_t(vertex_count);
+  h.triangle_count = uint32_t(triangle_count);
+  h.node_count = uint32_t(nodes.size());
+  h.vertex_offset = align_section(sizeof(header));
+  h.triangle_offset =
+      align_section(h.vertex_offset + vertices.size() * sizeof(float));
+  h.node_offset =
+      align_section(h.triangle_offset + triangles.size() * sizeof(uint32_t));
+
+  std::ofstream out(path, std::ios::binary);
+  uint64_t written = 0;
+  auto put = [&](uint64_t offset, const void *data, size_t bytes) {
+    static const char padding[section_alignment] = {};
+    out.write(padding, std::streamsize(offset - written));
+    out.write(static_cast<const char *>(data), std::streamsize(bytes));
+    written = offset + bytes;
+  };
+  put(0, &h, sizeof(h));
+  put(h.vertex_offset, vertices.data(), vertices.size() * sizeof(float));
+  put(h.triangle_offset, triangles.data(),
+      triangles.size() * sizeof(uint32_t));
+  put(h.node_offset, nodes.data(), nodes.size() * sizeof(node));
+  out.close();
+
+  if (out.fail()) {
+    std::cerr << "ERROR: Could not write mesh file '" << path << "'.\n";
+    return false;
+  }
+  return true;
+}
+
+int mesh_file::build(std::vector<build_entry> &entries, int begin, int end,
+                     int depth, std::vector<node> &nodes) {
+  int index = int(nodes.size());
+  nodes.emplace_back();
+
+  float lower[3], upper[3], centroid_min[3], centroid_max[3];
+  for (int axis = 0; axis < 3; axis++) {
+    lower[axis] = centroid_min[axis] = std::numeric_limits<float>::infinity();
+    upper[axis] = centroid_max[axis] = -std::numeric_limits<float>::infinity();
+  }
+  for (int i = begin; i < end; i++) {
+    for (int axis = 0; axis < 3; axis++) {
+      float c = entries[i].centroid(axis);
+      lower[axis] = std::min(lower[axis], entries[i].lower[axis]);
+      upper[axis] = std::max(upper[axis], entries[i].upper[axis]);
+      centroid_min[axis] = std::min(centroid_min[axis], c);
+      centroid_max[axis] = std::max(centroid_max[axis], c);
+    }
+  }
+  std::copy_n(lower, 3, nodes[index].lower);
+  std::copy_n(upper, 3, nodes[index].upper);
+
+  // Looks for the cheapest split among the bin boundaries of every axis, as
+  // bvh::find_object_split does
+  int count = end - begin;
+  int best_axis = -1;
+  int best_split = 0;
+  double best_cost = mathconst::infinity;
+  double parent_area = box(lower, upper).surface_area();
+  for (int axis = 0; axis < 3 && count > 1 && depth < max_depth; axis++) {
+    float extent = centroid_max[axis] - centroid_min[axis];
+    if (extent <= 0.0f)
+      continue;
+
+    aabb bin_bounds[num_bins];
+    int bin_count[num_bins] = {0};
+    for (int i = begin; i < end; i++) {
+      int b = bin_index(entries[i].centroid(axis), centroid_min[axis], extent);
+      bin_bounds[b] =
+          aabb(bin_bounds[b], box(entries[i].lower, entries[i].upper));
+      bin_count[b]++;
+    }
+
+    double right_area[num_bins];
+    int right_count[num_bins];
+    aabb sweep;
+    int sweep_count = 0;
+    for (int b = num_bins - 1; b > 0; b--) {
+      sweep = aabb(sweep, bin_bounds[b]);
+      sweep_count += bin_count[b];
+      right_area[b] = sweep.surface_area();
+      right_count[b] = sweep_count;
+    }
+
+    sweep = aabb();
+    sweep_count = 0;
+    for (int b = 1; b < num_bins; b++) {
+      sweep = aabb(sweep, bin_bounds[b - 1]);
+      sweep_count += bin_count[b - 1];
+      if (sweep_count == 0 || right_count[b] == 0)
+        continue;
+
+      double cost = traversal_cost + (sweep.surface_area() * sweep_count +
+                                      right_area[b] * right_count[b]) /
+                                         parent_area;
+      if (cost < best_cost) {
+        best_cost = cost;
+        best_axis = axis;
+        best_split = b;
+      }
+    }
+  }
+
+  // Makes a leaf when splitting does not pay off, unless it would be too big
+  if (count <= max_leaf_size && best_cost >= count)
+    best_axis = -1;
+
+  int mid = begin;
+  if (best_axis >= 0) {
+    float min = centroid_min[best_axis];
+    float extent = centroid_max[best_axis] - min;
+    auto first_right =
+        std::partition(entries.begin() + begin, entries.begin() + end,
+                       [&](const build_entry &e) {
+                         return bin_index(e.centroid(best_axis), min, extent) <
+                                best_split;
+                       });
+    mid = int(first_right - entries.begin());
+  } else if (count > max_leaf_size && depth < max_depth) {
+    // Every centroid coincides, so any halving is as good as another
+    best_axis = box(lower, upper).longest_axis();
+    mid = begin + count / 2;
+  }
+
+  if (best_axis < 0) {
+    if (count > std::numeric_limits<uint16_t>::max())
+      return -1;
+    nodes[index].offset = uint32_t(begin);
+    nodes[index].count = uint16_t(count);
+    nodes[index].axis = 0;
+    return index;
+  }
+
+  if (build(entries, begin, mid, depth + 1, nodes) < 0)
+    return -1;
+  int second_child = build(entries, mid, end, depth + 1, nodes);
+  if (second_child < 0)
+    return -1;
+  nodes[index].offset = uint32_t(second_child);
+  nodes[index].count = 0;
+  nodes[index].axis = uint16_t(best_axis);
+  return index;
+}
@@ -4,6 +4,10 @@
 #include <algorithm>
 #include <vector>
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
 sphere::sphere(const point3 &center, double radius, material *mat)
     : center(center), radius(std::fmax(0, radius)), mat(mat) {}
 
@@ -18,6 +22,23 @@ void sphere::get_sphere_uv(const point3 &p, double &u, double &v) {
   v = theta / mathconst::pi;
 }
 
+aabb sphere::bounding_box() const {
+  vec3 extent = vec3(this->radius, this->radius, this->radius);
+  return aabb(this->center - extent, this->center + extent);
+}
+
+bool sphere::get_sphere(point3 &center, double &radius) const {
+  center = this->center;
+  radius = this->radius;
+  return true;
+}
+
+bool sphere::set_sphere(const point3 &center, double radius) {
+  this->center = center;
+  this->radius = std::fmax(0, radius);
+  return true;
+}
+
 bool sphere::check_hit(const ray &r, interval ray_t, hit_record &record) const {
   // Vector from the ray's origin to the sphere's center
   vec3 eye_to_sphere = this->center - r.get_origin();
@@ -56,6 +77,26 @@ bool sphere::check_hit(const ray &r, interval ray_t, hit_record &record) const {
   return true;
 }
 
+// Checks if a ray enters or leaves the given sphere within the interval
+static bool sphere_occludes(const point3 &center, double radius, const ray &r,
+                            interval ray_t) {
+  vec3 eye_to_sphere = center - r.get_origin();
+  double a = r.get_direction().length_squared();
+  double h = dot(r.get_direction(), eye_to_sphere);
+  double c = eye_to_sphere.length_squared() - radius * radius;
+
+  double discriminant = h * h - a * c;
+  if (discriminant < 0)
+    return false;
+
+  double sqrtd = std::sqrt(discriminant);
+  return ray_t.surrounds((h - sqrtd) / a) || ray_t.surrounds((h + sqrtd) / a);
+}
+
+bool sphere::check_occluded(const ray &r, interval ray_t) const {
+  return sphere_occludes(this->center, this->radius, r, ray_t);
+}
+
 bulb::bulb(const point3 &center, double radius, light *lig)
     : center(center), radius(std::fmax(0, radius)), lig(lig) {}
 
@@ -70,6 +111,23 @@ void bulb::get_sphere_uv(const point3 &p, double &u, double &v) {
 
 bulb::~bulb() { delete this->lig; }
 
+aabb bulb::bounding_box() const {
+  vec3 extent = vec3(this->radius, this->radius, this->radius);
+  return aabb(this->center - extent, this->center + extent);
+}
+
+bool bulb::get_sphere(point3 &center, double &radius) const {
+  center = this->center;
+  radius = this->radius;
+  return true;
+}
+
+bool bulb::set_sphere(const point3 &center, double radius) {
+  this->center = center;
+  this->radius = std::fmax(0, radius);
+  return true;
+}
+
 bool bulb::check_hit(const ray &r, interval ray_t, hit_record &record) const {
   // Vector from the ray's origin to the sphere's center
   vec3 eye_to_sphere = this->center - r.get_origin();
@@ -108,95 +166,385 @@ bool bulb::check_hit(const ray &r, interval ray_t, hit_record &record) const {
   return true;
 }
 
+// Checks if c is a non-negative combination of the given normals. By
+// Caratheodory's theorem it is enough to try every single normal, pair and
+// triple of them.
+static bool in_normal_cone(const vec3 &c, int num_of_faces,
+                           const vec3 *normals) {
+  const double eps = 1e-9;
+
+  for (int i = 0; i < num_of_faces; i++) {
+    const vec3 &a = normals[i];
+    if (cross(a, c).length_squared() <= eps * a.length_squared() &&
+        dot(a, c) > 0)
+      return true;
+
+    for (int j = i + 1; j < num_of_faces; j++) {
+      const vec3 &b = normals[j];
+      vec3 ab = cross(a, b);
+      double ab_sq = ab.length_squared();
+      if (ab_sq <= eps)
+        continue;
+
+      // c = la * a + lb * b, if c lies on the plane spanned by a and b
+      if (std::fabs(dot(ab, c)) <= eps * std::sqrt(ab_sq)) {
+        double la = dot(cross(c, b), ab) / ab_sq;
+        double lb = dot(cross(a, c), ab) / ab_sq;
+        if (la >= -eps && lb >= -eps)
+          return true;
+      }
+
+      for (int k = j + 1; k < num_of_faces; k++) {
+        const vec3 &d = normals[k];
+        double det = dot(a, cross(b, d));
+        if (std::fabs(det) <= eps)
+          continue;
+
+        // Cramer's rule for c = la * a + lb * b + ld * d
+        double la = dot(c, cross(b, d)) / det;
+        double lb = dot(a, cross(c, d)) / det;
+        double ld = dot(a, cross(b, c)) / det;
+        if (la >= -eps && lb >= -eps && ld >= -eps)
+          return true;
+      }
+    }
+  }
+
+  return false;
+}
+
+// Bounding box of the region where dot(normal, p) + intercept <= 0 for every
+// face, or an unbounded box if the region is infinite
+static aabb polyhedron_bounds(int num_of_faces, const vec3 *normals,
+                              const double *intercepts) {
+  // The region is bounded along a direction only if that direction is a
+  // non-negative combination of the face normals
+  for (int axis = 0; axis < 3; axis++) {
+    vec3 direction;
+    direction[axis] = 1.0;
+    if (!in_normal_cone(direction, num_of_faces, normals) ||
+        !in_normal_cone(-direction, num_of_faces, normals))
+      return aabb::universe;
+  }
+
+  // A bounded region is the hull of its vertices, which sit where three of the
+  // planes meet without violating the others
+  aabb bounds;
+  for (int i = 0; i < num_of_faces; i++) {
+    for (int j = i + 1; j < num_of_faces; j++) {
+      for (int k = j + 1; k < num_of_faces; k++) {
+        const vec3 &a = normals[i];
+        const vec3 &b = normals[j];
+        const vec3 &c = normals[k];
+        double det = dot(a, cross(b, c));
+        if (std::fabs(det) < 1e-12)
+          continue;
+
+        point3 vertex = (-intercepts[i] * cross(b, c) -
+                         intercepts[j] * cross(c, a) -
+                         intercepts[k] * cross(a, b)) /
+                        det;
+
+        bool inside = true;
+        for (int m = 0; m < num_of_faces && inside; m++)
+          inside = dot(normals[m], vertex) + intercepts[m] <=
+                   1e-9 * (1.0 + std::fabs(intercepts[m]));
+        if (inside)
+          bounds = aabb(bounds, aabb(vertex, vertex));
+      }
+    }
+  }
+
+  return bounds;
+}
+
+// 1 - cos(theta_max) of the cone a sphere subtends, written so it does not
+// cancel out for small, distant spheres
+static double sphere_cone_height(double distance_squared,
+                                 double radius_squared) {
+  double sin2_theta_max = radius_squared / distance_squared;
+  return sin2_theta_max / (1.0 + std::sqrt(1.0 - sin2_theta_max));
+}
+
+bool bulb::check_occluded(const ray &r, interval ray_t) const {
+  return sphere_occludes(this->center, this->radius, r, ray_t);
+}
+
+bool bulb::sample_direction(const point3 &origin, vec3 &direction,
+                            double &pdf, rng &gen) const {
+  // No cone to sample from inside the bulb
+  vec3 to_center = this->center - origin;
+  double distance_squared = to_center.length_squared();
+  double radius_squared = this->radius * this->radius;
+  if (distance_squared <= radius_squared)
+    return false;
+
+  double cone_height = sphere_cone_height(distance_squared, radius_squared);
+
+  // Uniform sample of the spherical cap around the direction to the center
+  double cos_theta = 1.0 - random_double(gen) * cone_height;
+  double sin_theta = std::sqrt(std::fmax(0.0, 1.0 - cos_theta * cos_theta));
+  double phi = 2.0 * mathconst::pi * random_double(gen);
+
+  vec3 axis = unit_vector(to_center);
+  vec3 tangent, bitangent;
+  orthonormal_basis(axis, tangent, bitangent);
+  direction = (std::cos(phi) * sin_theta) * tangent +
+              (std::sin(phi) * sin_theta) * bitangent + cos_theta * axis;
+  pdf = 1.0 / (2.0 * mathconst::pi * cone_height);
+  return true;
+}
+
+double bulb::pdf_direction(const point3 &origin) const {
+  double distance_squared = (this->center - origin).length_squared();
+  double radius_squared = this->radius * this->radius;
+  if (distance_squared <= radius_squared)
+    return 0.0;
+
+  double cone_height = sphere_cone_height(distance_squared, radius_squared);
+  return 1.0 / (2.0 * mathconst::pi * cone_height);
+}
+
+#if defined(__AVX2__)
+static const int plane_lanes = 4;
+#else
+static const int plane_lanes = 1;
+#endif
+
 polyhedron::polyhedron(int num_of_faces, vec3 *normals, double *intercepts,
                        material *mat) {
   this->num_of_faces = num_of_faces;
   this->normals = normals;
   this->intercepts = intercepts;
   this->mat = mat;
+
+  // Unit normals give unit normals to the hits, and scaling a face's
+  // intercept along with its normal leaves its plane where it was
+  for (int i = 0; i < num_of_faces; i++) {
+    double length = normals[i].length();
+    if (length > 0) {
+      normals[i] /= length;
+      intercepts[i] /= length;
+    }
+  }
+  this->bbox = polyhedron_bounds(num_of_faces, normals, intercepts);
+
+  // Padding planes have no normal and every point on their inner side
+  int padded =
+      (num_of_faces + plane_lanes - 1) / plane_lanes * plane_lanes;
+  this->plane_x.assign(padded, 0.0);
+  this->plane_y.assign(padded, 0.0);
+  this->plane_z.assign(padded, 0.0);
+  this->plane_d.assign(padded, -1.0);
+  for (int i = 0; i < num_of_faces; i++) {
+    this->plane_x[i] = normals[i].x();
+    this->plane_y[i] = normals[i].y();
+    this->plane_z[i] = normals[i].z();
+    this->plane_d[i] = intercepts[i];
+  }
 }
 
 polyhedron::~polyhedron() {
-  delete this->intercepts;
-  delete this->normals;
+  delete[] this->intercepts;
+  delete[] this->normals;
   delete this->mat;
 }
 
-bool polyhedron::check_hit(const ray &r, interval ray_t,
-                           hit_record &record) const {
-  std::vector<point3> intersection_points;
-  for (int i = 0; i < this->num_of_faces; i++) {
-    vec3 normal = this->normals[i];
-    double D = this->intercepts[i];
-    bool hit = true;
-
-    // Gets the point of interception between the ray and the plane
-    double denom = dot(normal, r.get_direction());
-    if (std::fabs(denom) < 1e-8) // No hit if the ray is parallel to the plane.
-      hit = false;
-    double t = (D - dot(normal, r.get_origin())) / denom;
-    if (!ray_t.contains(t)) // Clips on the interval
-      hit = false;
-    point3 intersection = r.at(t);
-
-    // Saves the point
-    if (hit)
-      intersection_points.emplace_back(intersection);
+// The ray crosses each face's plane once, entering the face's half-space if
+// it moves against the normal and leaving it otherwise. The polyhedron is
+// where the ray is inside them all, from the last entry to the first exit
+// (Kay and Kajiya, "Ray Tracing Complex Scenes", 1986). A ray parallel to a
+// plane is inside its half-space all along or never, in which case it misses
+#if defined(__AVX2__)
+
+bool polyhedron::find_hit(const ray &r, interval ray_t, double &t,
+                          int &face) const {
+  point3 origin = r.get_origin();
+  vec3 direction = r.get_direction();
+  __m256d ox = _mm256_set1_pd(origin.x());
+  __m256d oy = _mm256_set1_pd(origin.y());
+  __m256d oz = _mm256_set1_pd(origin.z());
+  __m256d dx = _mm256_set1_pd(direction.x());
+  __m256d dy = _mm256_set1_pd(direction.y());
+  __m256d dz = _mm256_set1_pd(direction.z());
+  __m256d zero = _mm256_setzero_pd();
+  __m256d infinity = _mm256_set1_pd(mathconst::infinity);
+  __m256d minus_infinity = _mm256_set1_pd(-mathconst::infinity);
+
+  // Lanes keep their own last entry and first exit, with their faces stored
+  // as doubles to be blended like the distances
+  __m256d t_near = minus_infinity;
+  __m256d t_far = infinity;
+  __m256d near_face = _mm256_set1_pd(-1.0);
+  __m256d far_face = _mm256_set1_pd(-1.0);
+  __m256d index = _mm256_setr_pd(0.0, 1.0, 2.0, 3.0);
+  __m256d step = _mm256_set1_pd(4.0);
+
+  for (int i = 0; i < int(this->plane_x.size()); i += 4) {
+    __m256d nx = _mm256_loadu_pd(&this->plane_x[i]);
+    __m256d ny = _mm256_loadu_pd(&this->plane_y[i]);
+    __m256d nz = _mm256_loadu_pd(&this->plane_z[i]);
+    __m256d nd = _mm256_loadu_pd(&this->plane_d[i]);
+
+    __m256d denom = _mm256_add_pd(
+        _mm256_add_pd(_mm256_mul_pd(nx, dx), _mm256_mul_pd(ny, dy)),
+        _mm256_mul_pd(nz, dz));
+    __m256d distance = _mm256_add_pd(
+        _mm256_add_pd(
+            _mm256_add_pd(_mm256_mul_pd(nx, ox), _mm256_mul_pd(ny, oy)),
+            _mm256_mul_pd(nz, oz)),
+        nd);
+    __m256d t_plane = _mm256_div_pd(_mm256_sub_pd(zero, distance), denom);
+
+    __m256d entering = _mm256_cmp_pd(denom, zero, _CMP_LT_OQ);
+    __m256d leaving = _mm256_cmp_pd(denom, zero, _CMP_GT_OQ);
+    __m256d blocked = _mm256_andnot_pd(
+        _mm256_or_pd(entering, leaving),
+        _mm256_cmp_pd(distance, zero, _CMP_GT_OQ));
+
+    __m256d entry = _mm256_blendv_pd(minus_infinity, t_plane, entering);
+    entry = _mm256_blendv_pd(entry, infinity, blocked);
+    __m256d exit = _mm256_blendv_pd(infinity, t_plane, leaving);
+    exit = _mm256_blendv_pd(exit, minus_infinity, blocked);
+
+    __m256d later = _mm256_cmp_pd(entry, t_near, _CMP_GT_OQ);
+    t_near = _mm256_blendv_pd(t_near, entry, later);
+    near_face = _mm256_blendv_pd(near_face, index, later);
+    __m256d earlier = _mm256_cmp_pd(exit, t_far, _CMP_LT_OQ);
+    t_far = _mm256_blendv_pd(t_far, exit, earlier);
+    far_face = _mm256_blendv_pd(far_face, index, earlier);
+
+    index = _mm256_add_pd(index, step);
   }
 
-  // Orders the points by distance from the ray's origin
-  std::sort(intersection_points.begin(), intersection_points.end(),
-            [&r](const point3 &a, const point3 &b) {
-              return squared_distance(a, r.get_origin()) <
-                     squared_distance(b, r.get_origin());
-            });
-
-  // Traverses them
-  for (int i = 0; i < intersection_points.size(); i++) {
-    point3 point = intersection_points[i];
-
-    // Checks if they are on the same orientation for every plane
-    double D;
-    vec3 normal;
-
-    int count_outside_or_on = 0;
-    for (int j = 0; j < this->num_of_faces; j++) {
-      D = this->intercepts[j];
-      normal = this->normals[j];
-      double result = dot(normal, point) + D;
-      if (result >= 0)
-        count_outside_or_on++;
+  // Reduces the lanes, preferring the lowest face on ties
+  double near_lanes[4], far_lanes[4], near_faces[4], far_faces[4];
+  _mm256_storeu_pd(near_lanes, t_near);
+  _mm256_storeu_pd(far_lanes, t_far);
+  _mm256_storeu_pd(near_faces, near_face);
+  _mm256_storeu_pd(far_faces, far_face);
+  double entry_t = -mathconst::infinity;
+  double exit_t = mathconst::infinity;
+  int entry_face = -1;
+  int exit_face = -1;
+  for (int l = 0; l < 4; l++) {
+    if (near_lanes[l] > entry_t ||
+        (near_lanes[l] == entry_t && near_faces[l] < entry_face)) {
+      entry_t = near_lanes[l];
+      entry_face = int(near_faces[l]);
     }
-
-    int count_inside_or_on = 0;
-    for (int j = 0; j < this->num_of_faces; j++) {
-      D = this->intercepts[j];
-      normal = this->normals[j];
-      double result = dot(normal, point) + D;
-      if (result <= 0)
-        count_inside_or_on++;
+    if (far_lanes[l] < exit_t ||
+        (far_lanes[l] == exit_t && far_faces[l] < exit_face)) {
+      exit_t = far_lanes[l];
+      exit_face = int(far_faces[l]);
     }
+  }
+
+  if (entry_t > exit_t)
+    return false;
+  if (entry_face >= 0 && ray_t.surrounds(entry_t)) {
+    t = entry_t;
+    face = entry_face;
+    return true;
+  }
+  if (exit_face >= 0 && ray_t.surrounds(exit_t)) {
+    t = exit_t;
+    face = exit_face;
+    return true;
+  }
+  return false;
+}
 
-    // If they are, returns
-    bool hit = (count_outside_or_on == this->num_of_faces) ||
-               (count_inside_or_on == this->num_of_faces);
-    if (hit) {
-      record.t =
-          (D - dot(normal, r.get_origin())) / dot(normal, r.get_direction());
-      record.point = point;
-      record.mat = this->mat;
-      record.lig = nullptr;
-      this->get_polyhedron_uv(point, normal, record.tex_u, record.tex_v);
-      record.adjust_normal_for_ray(r, normal);
-      record.is_light = false;
+#else
 
-      return true;
+bool polyhedron::find_hit(const ray &r, interval ray_t, double &t,
+                          int &face) const {
+  point3 origin = r.get_origin();
+  vec3 direction = r.get_direction();
+  double entry_t = -mathconst::infinity;
+  double exit_t = mathconst::infinity;
+  int entry_face = -1;
+  int exit_face = -1;
+  for (int i = 0; i < this->num_of_faces; i++) {
+    double denom = this->plane_x[i] * direction.x() +
+                   this->plane_y[i] * direction.y() +
+                   this->plane_z[i] * direction.z();
+    double distance = this->plane_x[i] * origin.x() +
+                      this->plane_y[i] * origin.y() +
+                      this->plane_z[i] * origin.z() + this->plane_d[i];
+    if (denom < 0) {
+      double t_plane = -distance / denom;
+      if (t_plane > entry_t) {
+        entry_t = t_plane;
+        entry_face = i;
+      }
+    } else if (denom > 0) {
+      double t_plane = -distance / denom;
+      if (t_plane < exit_t) {
+        exit_t = t_plane;
+        exit_face = i;
+      }
+    } else if (distance > 0) {
+      return false;
     }
   }
 
+  if (entry_t > exit_t)
+    return false;
+  if (entry_face >= 0 && ray_t.surrounds(entry_t)) {
+    t = entry_t;
+    face = entry_face;
+    return true;
+  }
+  if (exit_face >= 0 && ray_t.surrounds(exit_t)) {
+    t = exit_t;
+    face = exit_face;
+    return true;
+  }
   return false;
 }
 
+#endif
+
+bool polyhedron::check_hit(const ray &r, interval ray_t,
+                           hit_record &record) const {
+  // Rays missing the box of a bounded polyhedron skip its planes
+  vec3 direction = r.get_direction();
+  vec3 inv_direction =
+      vec3(1.0 / direction.x(), 1.0 / direction.y(), 1.0 / direction.z());
+  if (this->bbox.is_bounded() &&
+      !this->bbox.hit(r.get_origin(), inv_direction, ray_t))
+    return false;
+
+  double t;
+  int face;
+  if (!this->find_hit(r, ray_t, t, face))
+    return false;
+
+  record.t = t;
+  record.point = r.at(t);
+  record.mat = this->mat;
+  record.lig = nullptr;
+  this->get_polyhedron_uv(record.point, this->normals[face], record.tex_u,
+                          record.tex_v);
+  record.adjust_normal_for_ray(r, this->normals[face]);
+  record.is_light = false;
+  return true;
+}
+
+bool polyhedron::check_occluded(const ray &r, interval ray_t) const {
+  vec3 direction = r.get_direction();
+  vec3 inv_direction =
+      vec3(1.0 / direction.x(), 1.0 / direction.y(), 1.0 / direction.z());
+  if (this->bbox.is_bounded() &&
+      !this->bbox.hit(r.get_origin(), inv_direction, ray_t))
+    return false;
+
+  double t;
+  int face;
+  return this->find_hit(r, ray_t, t, face);
+}
+
 void polyhedron::get_polyhedron_uv(const point3 &p, const point3 &normal,
                                    double &u, double &v) {
   // Maps the given point p to 2D space of uv
@@ -214,4 +562,47 @@ void polyhedron::get_polyhedron_uv(const point3 &p, const point3 &normal,
 
   v = v - int(v);
   v = v < 0 ? 1 + v : v;
-}
\ No newline at end of file
+}
+
+plane::plane(const vec3 &normal, double intercept, material *mat)
+    : normal(normal), intercept(intercept), mat(mat) {
+  double length = normal.length();
+  if (length > 0) {
+    this->normal /= length;
+    this->intercept /= length;
+  }
+
+  this->u_axis = unit_vector(cross(this->normal, vec3(1, 0, 0)));
+  if (this->u_axis.near_zero())
+    this->u_axis = unit_vector(cross(this->normal, vec3(0, 0, 1)));
+  this->v_axis = unit_vector(cross(this->normal, this->u_axis));
+}
+
+plane::~plane() { delete this->mat; }
+
+// A ray parallel to the plane gets an infinite or NaN distance, which no
+// interval surrounds, so it needs no branch of its own
+bool plane::check_hit(const ray &r, interval ray_t, hit_record &record) const {
+  double t = -(dot(this->normal, r.get_origin()) + this->intercept) /
+             dot(this->normal, r.get_direction());
+  if (!ray_t.surrounds(t))
+    return false;
+
+  record.t = t;
+  record.point = r.at(t);
+  record.mat = this->mat;
+  record.lig = nullptr;
+  double u = dot(this->u_axis, record.point);
+  double v = dot(this->v_axis, record.point);
+  record.tex_u = u - std::floor(u);
+  record.tex_v = v - std::floor(v);
+  record.adjust_normal_for_ray(r, this->normal);
+  record.is_light = false;
+  return true;
+}
+
+bool plane::check_occluded(const ray &r, interval ray_t) const {
+  double t = -(dot(this->normal, r.get_origin()) + this->intercept) /
+             dot(this->normal, r.get_direction());
+  return ray_t.surrounds(t);
+}
@@ -0,0 +1,42 @@
+#include "object_list.hpp"
+
+object_list::object_list(const std::vector<object *> &objects) {
+  point3 center;
+  double radius;
+  for (auto obj : objects) {
+    if (obj->get_sphere(center, radius))
+      this->spheres.add(obj, center, radius);
+    else
+      this->others.emplace_back(obj);
+  }
+}
+
+bool object_list::check_hit(const ray &r, interval ray_t,
+                            hit_record &record) const {
+  // Finds the first object the ray hits, if it hits any
+  hit_record temp_rec;
+  bool hit_anything = false;
+  double closest_so_far = ray_t.max;
+  for (auto obj : this->others) {
+    if (obj->check_hit(r, interval(ray_t.min, closest_so_far), temp_rec)) {
+      hit_anything = true;
+      closest_so_far = temp_rec.t;
+      record = temp_rec;
+    }
+  }
+
+  if (this->spheres.check_hit(r, interval(ray_t.min, closest_so_far), 0,
+                              this->spheres.size(), temp_rec)) {
+    hit_anything = true;
+    record = temp_rec;
+  }
+
+  return hit_anything;
+}
+
+bool object_list::check_occluded(const ray &r, interval ray_t) const {
+  for (auto obj : this->others)
+    if (obj->check_occluded(r, ray_t))
+      return true;
+  return this->spheres.check_occluded(r, ray_t, 0, this->spheres.size());
+}
@@ -0,0 +1,449 @@
+#include "sphere_set.hpp"
+#include <algorithm>
+
+#if defined(__AVX512F__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#if defined(__AVX512F__)
+const int sphere_set::lanes = 8;
+#elif defined(__AVX2__)
+const int sphere_set::lanes = 4;
+#else
+const int sphere_set::lanes = 1;
+#endif
+
+void sphere_set::add(const object *owner, const point3 &center,
+                     double radius) {
+  this->center_x.emplace_back(center.x());
+  this->center_y.emplace_back(center.y());
+  this->center_z.emplace_back(center.z());
+  this->radius_squared.emplace_back(radius * radius);
+  this->owners.emplace_back(owner);
+}
+
+void sphere_set::append(const sphere_set &other, int begin, int end) {
+  auto copy = [&](std::vector<double> &to, const std::vector<double> &from) {
+    to.insert(to.end(), from.begin() + begin, from.begin() + end);
+  };
+  copy(this->center_x, other.center_x);
+  copy(this->center_y, other.center_y);
+  copy(this->center_z, other.center_z);
+  copy(this->radius_squared, other.radius_squared);
+  this->owners.insert(this->owners.end(), other.owners.begin() + begin,
+                      other.owners.begin() + end);
+}
+
+void sphere_set::replace(int begin, const sphere_set &other) {
+  auto copy = [&](std::vector<double> &to, const std::vector<double> &from) {
+    std::copy(from.begin(), from.end(), to.begin() + begin);
+  };
+  copy(this->center_x, other.center_x);
+  copy(this->center_y, other.center_y);
+  copy(this->center_z, other.center_z);
+  copy(this->radius_squared, other.radius_squared);
+  std::copy(other.owners.begin(), other.owners.end(),
+            this->owners.begin() + begin);
+}
+
+void sphere_set::set(int index, const point3 &center, double radius) {
+  this->center_x[index] = center.x();
+  this->center_y[index] = center.y();
+  this->center_z[index] = center.z();
+  this->radius_squared[index] = radius * radius;
+}
+
+bool sphere_set::check_hit(const ray &r, interval ray_t, int begin, int end,
+                           hit_record &record) const {
+  int nearest = this->nearest_hit(r, ray_t, begin, end);
+  if (nearest < 0)
+    return false;
+
+  // Only the nearest sphere needs its normal, material and texture coordinates
+  if (this->owners[nearest]->check_hit(r, ray_t, record))
+    return true;
+
+  // The owner may still reject a grazing hit, as its own test rounds
+  // differently (or, for instances, runs on a transformed ray). The range is
+  // then searched one sphere at a time, so that farther ones are not lost
+  hit_record temp_rec;
+  bool hit_anything = false;
+  for (int i = begin; i < end; i++) {
+    if (this->owners[i]->check_hit(r, ray_t, temp_rec)) {
+      hit_anything = true;
+      ray_t.max = temp_rec.t;
+      record = temp_rec;
+    }
+  }
+  return hit_anything;
+}
+
+// Every kernel follows sphere::check_hit: with e the vector from the ray's
+// origin to the center, the roots of the quadratic are (h +- sqrt(h2 - ac))/a
+// for a = d.d, h = d.e and c = e.e - r2, and the nearer one inside the
+// interval is the hit. Lanes keep their own nearest hit, so each one bounds
+// its roots by it, and the lanes are reduced at the end preferring the lowest
+// index on ties, as a sequential loop would. Most rays miss most spheres, so
+// the roots are only worked out when some lane's discriminant allows a hit
+
+#if defined(__AVX512F__)
+
+int sphere_set::nearest_hit(const ray &r, interval ray_t, int begin,
+                            int end) const {
+  point3 origin = r.get_origin();
+  vec3 direction = r.get_direction();
+  __m512d ox = _mm512_set1_pd(origin.x());
+  __m512d oy = _mm512_set1_pd(origin.y());
+  __m512d oz = _mm512_set1_pd(origin.z());
+  __m512d dx = _mm512_set1_pd(direction.x());
+  __m512d dy = _mm512_set1_pd(direction.y());
+  __m512d dz = _mm512_set1_pd(direction.z());
+  __m512d a = _mm512_set1_pd(direction.length_squared());
+  __m512d t_min = _mm512_set1_pd(ray_t.min);
+  __m512d zero = _mm512_setzero_pd();
+
+  __m512d best_t = _mm512_set1_pd(ray_t.max);
+  __m512i best_index = _mm512_set1_epi64(-1);
+  __m512i index = _mm512_add_epi64(_mm512_set1_epi64(begin),
+                                   _mm512_setr_epi64(0, 1, 2, 3, 4, 5, 6, 7));
+  __m512i step = _mm512_set1_epi64(8);
+
+  for (int i = begin; i < end; i += 8) {
+    int remaining = end - i;
+    __mmask8 active = (remaining >= 8) ? 0xFF : __mmask8((1u << remaining) - 1);
+
+    __m512d ex = _mm512_sub_pd(
+        _mm512_maskz_loadu_pd(active, &this->center_x[i]), ox);
+    __m512d ey = _mm512_sub_pd(
+        _mm512_maskz_loadu_pd(active, &this->center_y[i]), oy);
+    __m512d ez = _mm512_sub_pd(
+        _mm512_maskz_loadu_pd(active, &this->center_z[i]), oz);
+    __m512d r2 = _mm512_maskz_loadu_pd(active, &this->radius_squared[i]);
+
+    __m512d h = _mm512_add_pd(
+        _mm512_add_pd(_mm512_mul_pd(dx, ex), _mm512_mul_pd(dy, ey)),
+        _mm512_mul_pd(dz, ez));
+    __m512d c = _mm512_sub_pd(
+        _mm512_add_pd(
+            _mm512_add_pd(_mm512_mul_pd(ex, ex), _mm512_mul_pd(ey, ey)),
+            _mm512_mul_pd(ez, ez)),
+        r2);
+    __m512d discriminant =
+        _mm512_sub_pd(_mm512_mul_pd(h, h), _mm512_mul_pd(a, c));
+    active &= _mm512_cmp_pd_mask(discriminant, zero, _CMP_GE_OQ);
+    if (!active) {
+      index = _mm512_add_epi64(index, step);
+      continue;
+    }
+
+    __m512d sqrtd = _mm512_sqrt_pd(_mm512_max_pd(discriminant, zero));
+    __m512d near_root = _mm512_div_pd(_mm512_sub_pd(h, sqrtd), a);
+    __m512d far_root = _mm512_div_pd(_mm512_add_pd(h, sqrtd), a);
+    __mmask8 near_ok = _mm512_cmp_pd_mask(near_root, t_min, _CMP_GT_OQ) &
+                       _mm512_cmp_pd_mask(near_root, best_t, _CMP_LT_OQ);
+    __mmask8 far_ok = _mm512_cmp_pd_mask(far_root, t_min, _CMP_GT_OQ) &
+                      _mm512_cmp_pd_mask(far_root, best_t, _CMP_LT_OQ);
+    __m512d root = _mm512_mask_blend_pd(near_ok, far_root, near_root);
+    __mmask8 hit = active & (near_ok | far_ok);
+
+    best_t = _mm512_mask_blend_pd(hit, best_t, root);
+    best_index = _mm512_mask_blend_epi64(hit, best_index, index);
+    index = _mm512_add_epi64(index, step);
+  }
+
+  alignas(64) double lane_t[8];
+  alignas(64) long long lane_index[8];
+  _mm512_store_pd(lane_t, best_t);
+  _mm512_store_si512(lane_index, best_index);
+
+  int nearest = -1;
+  double nearest_t = ray_t.max;
+  for (int lane = 0; lane < 8; lane++) {
+    if (lane_index[lane] < 0)
+      continue;
+    if (lane_t[lane] < nearest_t ||
+        (lane_t[lane] == nearest_t && lane_index[lane] < nearest)) {
+      nearest_t = lane_t[lane];
+      nearest = int(lane_index[lane]);
+    }
+  }
+  return nearest;
+}
+
+bool sphere_set::check_occluded(const ray &r, interval ray_t, int begin,
+                                int end) const {
+  point3 origin = r.get_origin();
+  vec3 direction = r.get_direction();
+  __m512d ox = _mm512_set1_pd(origin.x());
+  __m512d oy = _mm512_set1_pd(origin.y());
+  __m512d oz = _mm512_set1_pd(origin.z());
+  __m512d dx = _mm512_set1_pd(direction.x());
+  __m512d dy = _mm512_set1_pd(direction.y());
+  __m512d dz = _mm512_set1_pd(direction.z());
+  __m512d a = _mm512_set1_pd(direction.length_squared());
+  __m512d t_min = _mm512_set1_pd(ray_t.min);
+  __m512d t_max = _mm512_set1_pd(ray_t.max);
+  __m512d zero = _mm512_setzero_pd();
+
+  for (int i = begin; i < end; i += 8) {
+    int remaining = end - i;
+    __mmask8 active = (remaining >= 8) ? 0xFF : __mmask8((1u << remaining) - 1);
+
+    __m512d ex = _mm512_sub_pd(
+        _mm512_maskz_loadu_pd(active, &this->center_x[i]), ox);
+    __m512d ey = _mm512_sub_pd(
+        _mm512_maskz_loadu_pd(active, &this->center_y[i]), oy);
+    __m512d ez = _mm512_sub_pd(
+        _mm512_maskz_loadu_pd(active, &this->center_z[i]), oz);
+    __m512d r2 = _mm512_maskz_loadu_pd(active, &this->radius_squared[i]);
+
+    __m512d h = _mm512_add_pd(
+        _mm512_add_pd(_mm512_mul_pd(dx, ex), _mm512_mul_pd(dy, ey)),
+        _mm512_mul_pd(dz, ez));
+    __m512d c = _mm512_sub_pd(
+        _mm512_add_pd(
+            _mm512_add_pd(_mm512_mul_pd(ex, ex), _mm512_mul_pd(ey, ey)),
+            _mm512_mul_pd(ez, ez)),
+        r2);
+    __m512d discriminant =
+        _mm512_sub_pd(_mm512_mul_pd(h, h), _mm512_mul_pd(a, c));
+    active &= _mm512_cmp_pd_mask(discriminant, zero, _CMP_GE_OQ);
+    if (!active)
+      continue;
+
+    __m512d sqrtd = _mm512_sqrt_pd(_mm512_max_pd(discriminant, zero));
+    __m512d near_root = _mm512_div_pd(_mm512_sub_pd(h, sqrtd), a);
+    __m512d far_root = _mm512_div_pd(_mm512_add_pd(h, sqrtd), a);
+    __mmask8 near_ok = _mm512_cmp_pd_mask(near_root, t_min, _CMP_GT_OQ) &
+                       _mm512_cmp_pd_mask(near_root, t_max, _CMP_LT_OQ);
+    __mmask8 far_ok = _mm512_cmp_pd_mask(far_root, t_min, _CMP_GT_OQ) &
+                      _mm512_cmp_pd_mask(far_root, t_max, _CMP_LT_OQ);
+    if (active & (near_ok | far_ok))
+      return true;
+  }
+  return false;
+}
+
+#elif defined(__AVX2__)
+
+// Mask of the lanes holding spheres when fewer than four remain
+static __m256i active_lanes(int remaining) {
+  return _mm256_cmpgt_epi64(_mm256_set1_epi64x(remaining),
+                            _mm256_setr_epi64x(0, 1, 2, 3));
+}
+
+int sphere_set::nearest_hit(const ray &r, interval ray_t, int begin,
+                            int end) const {
+  point3 origin = r.get_origin();
+  vec3 direction = r.get_direction();
+  __m256d ox = _mm256_set1_pd(origin.x());
+  __m256d oy = _mm256_set1_pd(origin.y());
+  __m256d oz = _mm256_set1_pd(origin.z());
+  __m256d dx = _mm256_set1_pd(direction.x());
+  __m256d dy = _mm256_set1_pd(direction.y());
+  __m256d dz = _mm256_set1_pd(direction.z());
+  __m256d a = _mm256_set1_pd(direction.length_squared());
+  __m256d t_min = _mm256_set1_pd(ray_t.min);
+  __m256d zero = _mm256_setzero_pd();
+
+  // Indices are kept as doubles, which blend with the same instructions
+  __m256d best_t = _mm256_set1_pd(ray_t.max);
+  __m256d best_index = _mm256_set1_pd(-1.0);
+  __m256d index = _mm256_add_pd(_mm256_set1_pd(begin),
+                                _mm256_setr_pd(0.0, 1.0, 2.0, 3.0));
+  __m256d step = _mm256_set1_pd(4.0);
+
+  for (int i = begin; i < end; i += 4) {
+    __m256d ex, ey, ez, r2, active;
+    if (end - i >= 4) {
+      ex = _mm256_loadu_pd(&this->center_x[i]);
+      ey = _mm256_loadu_pd(&this->center_y[i]);
+      ez = _mm256_loadu_pd(&this->center_z[i]);
+      r2 = _mm256_loadu_pd(&this->radius_squared[i]);
+      active = _mm256_castsi256_pd(_mm256_set1_epi64x(-1));
+    } else {
+      __m256i mask = active_lanes(end - i);
+      ex = _mm256_maskload_pd(&this->center_x[i], mask);
+      ey = _mm256_maskload_pd(&this->center_y[i], mask);
+      ez = _mm256_maskload_pd(&this->center_z[i], mask);
+      r2 = _mm256_maskload_pd(&this->radius_squared[i], mask);
+      active = _mm256_castsi256_pd(mask);
+    }
+    ex = _mm256_sub_pd(ex, ox);
+    ey = _mm256_sub_pd(ey, oy);
+    ez = _mm256_sub_pd(ez, oz);
+
+    __m256d h = _mm256_add_pd(
+        _mm256_add_pd(_mm256_mul_pd(dx, ex), _mm256_mul_pd(dy, ey)),
+        _mm256_mul_pd(dz, ez));
+    __m256d c = _mm256_sub_pd(
+        _mm256_add_pd(
+            _mm256_add_pd(_mm256_mul_pd(ex, ex), _mm256_mul_pd(ey, ey)),
+            _mm256_mul_pd(ez, ez)),
+        r2);
+    __m256d discriminant =
+        _mm256_sub_pd(_mm256_mul_pd(h, h), _mm256_mul_pd(a, c));
+    active = _mm256_and_pd(active,
+                           _mm256_cmp_pd(discriminant, zero, _CMP_GE_OQ));
+    if (_mm256_movemask_pd(active) == 0) {
+      index = _mm256_add_pd(index, step);
+      continue;
+    }
+
+    __m256d sqrtd = _mm256_sqrt_pd(_mm256_max_pd(discriminant, zero));
+    __m256d near_root = _mm256_div_pd(_mm256_sub_pd(h, sqrtd), a);
+    __m256d far_root = _mm256_div_pd(_mm256_add_pd(h, sqrtd), a);
+    __m256d near_ok =
+        _mm256_and_pd(_mm256_cmp_pd(near_root, t_min, _CMP_GT_OQ),
+                      _mm256_cmp_pd(near_root, best_t, _CMP_LT_OQ));
+    __m256d far_ok =
+        _mm256_and_pd(_mm256_cmp_pd(far_root, t_min, _CMP_GT_OQ),
+                      _mm256_cmp_pd(far_root, best_t, _CMP_LT_OQ));
+    __m256d root = _mm256_blendv_pd(far_root, near_root, near_ok);
+    __m256d hit = _mm256_and_pd(active, _mm256_or_pd(near_ok, far_ok));
+
+    best_t = _mm256_blendv_pd(best_t, root, hit);
+    best_index = _mm256_blendv_pd(best_index, index, hit);
+    index = _mm256_add_pd(index, step);
+  }
+
+  alignas(32) double lane_t[4];
+  alignas(32) double lane_index[4];
+  _mm256_store_pd(lane_t, best_t);
+  _mm256_store_pd(lane_index, best_index);
+
+  int nearest = -1;
+  double nearest_t = ray_t.max;
+  for (int lane = 0; lane < 4; lane++) {
+    if (lane_index[lane] < 0.0)
+      continue;
+    if (lane_t[lane] < nearest_t ||
+        (lane_t[lane] == nearest_t && int(lane_index[lane]) < nearest)) {
+      nearest_t = lane_t[lane];
+      nearest = int(lane_index[lane]);
+    }
+  }
+  return nearest;
+}
+
+bool sphere_set::check_occluded(const ray &r, interval ray_t, int begin,
+                                int end) const {
+  point3 origin = r.get_origin();
+  vec3 direction = r.get_direction();
+  __m256d ox = _mm256_set1_pd(origin.x());
+  __m256d oy = _mm256_set1_pd(origin.y());
+  __m256d oz = _mm256_set1_pd(origin.z());
+  __m256d dx = _mm256_set1_pd(direction.x());
+  __m256d dy = _mm256_set1_pd(direction.y());
+  __m256d dz = _mm256_set1_pd(direction.z());
+  __m256d a = _mm256_set1_pd(direction.length_squared());
+  __m256d t_min = _mm256_set1_pd(ray_t.min);
+  __m256d t_max = _mm256_set1_pd(ray_t.max);
+  __m256d zero = _mm256_setzero_pd();
+
+  for (int i = begin; i < end; i += 4) {
+    __m256d ex, ey, ez, r2, active;
+    if (end - i >= 4) {
+      ex = _mm256_loadu_pd(&this->center_x[i]);
+      ey = _mm256_loadu_pd(&this->center_y[i]);
+      ez = _mm256_loadu_pd(&this->center_z[i]);
+      r2 = _mm256_loadu_pd(&this->radius_squared[i]);
+      active = _mm256_castsi256_pd(_mm256_set1_epi64x(-1));
+    } else {
+      __m256i mask = active_lanes(end - i);
+      ex = _mm256_maskload_pd(&this->center_x[i], mask);
+      ey = _mm256_maskload_pd(&this->center_y[i], mask);
+      ez = _mm256_maskload_pd(&this->center_z[i], mask);
+      r2 = _mm256_maskload_pd(&this->radius_squared[i], mask);
+      active = _mm256_castsi256_pd(mask);
+    }
+    ex = _mm256_sub_pd(ex, ox);
+    ey = _mm256_sub_pd(ey, oy);
+    ez = _mm256_sub_pd(ez, oz);
+
+    __m256d h = _mm256_add_pd(
+        _mm256_add_pd(_mm256_mul_pd(dx, ex), _mm256_mul_pd(dy, ey)),
+        _mm256_mul_pd(dz, ez));
+    __m256d c = _mm256_sub_pd(
+        _mm256_add_pd(
+            _mm256_add_pd(_mm256_mul_pd(ex, ex), _mm256_mul_pd(ey, ey)),
+            _mm256_mul_pd(ez, ez)),
+        r2);
+    __m256d discriminant =
+        _mm256_sub_pd(_mm256_mul_pd(h, h), _mm256_mul_pd(a, c));
+    active = _mm256_and_pd(active,
+                           _mm256_cmp_pd(discriminant, zero, _CMP_GE_OQ));
+    if (_mm256_movemask_pd(active) == 0)
+      continue;
+
+    __m256d sqrtd = _mm256_sqrt_pd(_mm256_max_pd(discriminant, zero));
+    __m256d near_root = _mm256_div_pd(_mm256_sub_pd(h, sqrtd), a);
+    __m256d far_root = _mm256_div_pd(_mm256_add_pd(h, sqrtd), a);
+    __m256d near_ok =
+        _mm256_and_pd(_mm256_cmp_pd(near_root, t_min, _CMP_GT_OQ),
+                      _mm256_cmp_pd(near_root, t_max, _CMP_LT_OQ));
+    __m256d far_ok =
+        _mm256_and_pd(_mm256_cmp_pd(far_root, t_min, _CMP_GT_OQ),
+                      _mm256_cmp_pd(far_root, t_max, _CMP_LT_OQ));
+    __m256d hit = _mm256_and_pd(active, _mm256_or_pd(near_ok, far_ok));
+    if (_mm256_movemask_pd(hit) != 0)
+      return true;
+  }
+  return false;
+}
+
+#else
+
+int sphere_set::nearest_hit(const ray &r, interval ray_t, int begin,
+                            int end) const {
+  point3 origin = r.get_origin();
+  vec3 direction = r.get_direction();
+  double a = direction.length_squared();
+
+  int nearest = -1;
+  for (int i = begin; i < end; i++) {
+    vec3 eye_to_sphere =
+        vec3(this->center_x[i], this->center_y[i], this->center_z[i]) - origin;
+    double h = dot(direction, eye_to_sphere);
+    double c = eye_to_sphere.length_squared() - this->radius_squared[i];
+    double discriminant = h * h - a * c;
+    if (discriminant < 0)
+      continue;
+
+    double sqrtd = std::sqrt(discriminant);
+    double root = (h - sqrtd) / a;
+    if (!ray_t.surrounds(root)) {
+      root = (h + sqrtd) / a;
+      if (!ray_t.surrounds(root))
+        continue;
+    }
+
+    ray_t.max = root;
+    nearest = i;
+  }
+  return nearest;
+}
+
+bool sphere_set::check_occluded(const ray &r, interval ray_t, int begin,
+                                int end) const {
+  point3 origin = r.get_origin();
+  vec3 direction = r.get_direction();
+  double a = direction.length_squared();
+
+  for (int i = begin; i < end; i++) {
+    vec3 eye_to_sphere =
+        vec3(this->center_x[i], this->center_y[i], this->center_z[i]) - origin;
+    double h = dot(direction, eye_to_sphere);
+    double c = eye_to_sphere.length_squared() - this->radius_squared[i];
+    double discriminant = h * h - a * c;
+    if (discriminant < 0)
+      continue;
+
+    double sqrtd = std::sqrt(discriminant);
+    if (ray_t.surrounds((h - sqrtd) / a) || ray_t.surrounds((h + sqrtd) / a))
+      return true;
+  }
+  return false;
+}
+
+#endif
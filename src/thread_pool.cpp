@@ -0,0 +1,112 @@
+#include "thread_pool.hpp"
+#include <algorithm>
+
+thread_pool::thread_pool(int num_threads)
+    : num_threads(std::max(1, num_threads)), queues(this->num_threads) {
+  // The calling thread acts as worker 0, so only the others are spawned
+  for (int i = 1; i < this->num_threads; i++)
+    this->workers.emplace_back(&thread_pool::worker_loop, this, i);
+}
+
+thread_pool::~thread_pool() {
+  {
+    std::lock_guard<std::mutex> guard(this->state_lock);
+    this->stopping = true;
+  }
+  this->job_posted.notify_all();
+
+  for (auto &worker : this->workers)
+    worker.join();
+}
+
+int thread_pool::hardware_threads() {
+  int count = int(std::thread::hardware_concurrency());
+  return (count > 0) ? count : 1;
+}
+
+void thread_pool::run(int num_tasks, const std::function<void(int)> &task) {
+  if (num_tasks <= 0)
+    return;
+
+  {
+    std::lock_guard<std::mutex> guard(this->state_lock);
+
+    // Deals the tasks out in contiguous blocks, so neighbouring tiles tend to
+    // stay on the same worker unless they get stolen
+    for (int k = 0; k < this->num_threads; k++) {
+      std::lock_guard<std::mutex> queue_guard(this->queues[k].lock);
+      int begin = int((long long)num_tasks * k / this->num_threads);
+      int end = int((long long)num_tasks * (k + 1) / this->num_threads);
+      for (int i = begin; i < end; i++)
+        this->queues[k].tasks.push_back(i);
+    }
+
+    this->job = &task;
+    this->workers_busy = this->num_threads - 1;
+    this->generation++;
+  }
+  this->job_posted.notify_all();
+
+  // Works alongside the pool and then waits for the stragglers
+  this->work(0);
+
+  std::unique_lock<std::mutex> lock(this->state_lock);
+  this->job_finished.wait(lock, [this] { return this->workers_busy == 0; });
+  this->job = nullptr;
+}
+
+void thread_pool::worker_loop(int worker_index) {
+  int seen_generation = 0;
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(this->state_lock);
+      this->job_posted.wait(lock, [&] {
+        return this->stopping || this->generation != seen_generation;
+      });
+      if (this->stopping)
+        return;
+      seen_generation = this->generation;
+    }
+
+    this->work(worker_index);
+
+    {
+      std::lock_guard<std::mutex> guard(this->state_lock);
+      if (--this->workers_busy == 0)
+        this->job_finished.notify_one();
+    }
+  }
+}
+
+void thread_pool::work(int worker_index) {
+  // Tasks are never added mid-job, so once every queue is empty we are done
+  int task_index;
+  while (this->pop_task(worker_index, task_index) ||
+         this->steal_task(worker_index, task_index))
+    (*this->job)(task_index);
+}
+
+bool thread_pool::pop_task(int worker_index, int &task_index) {
+  work_queue &own = this->queues[worker_index];
+  std::lock_guard<std::mutex> guard(own.lock);
+  if (own.tasks.empty())
+    return false;
+
+  task_index = own.tasks.front();
+  own.tasks.pop_front();
+  return true;
+}
+
+bool thread_pool::steal_task(int worker_index, int &task_index) {
+  for (int k = 1; k < this->num_threads; k++) {
+    work_queue &victim = this->queues[(worker_index + k) % this->num_threads];
+    std::lock_guard<std::mutex> guard(victim.lock);
+    if (victim.tasks.empty())
+      continue;
+
+    task_index = victim.tasks.back();
+    victim.tasks.pop_back();
+    return true;
+  }
+  return false;
+}
@@ -0,0 +1,128 @@
+#include "transform.hpp"
+#include <cmath>
+
+transform::transform() : linear{{1, 0, 0}, {0, 1, 0}, {0, 0, 1}} {}
+
+transform transform::translation(const vec3 &offset) {
+  transform result;
+  result.offset = offset;
+  return result;
+}
+
+transform transform::scaling(double factor) {
+  return scaling(vec3(factor, factor, factor));
+}
+
+transform transform::scaling(const vec3 &factors) {
+  transform result;
+  for (int i = 0; i < 3; i++)
+    result.linear[i][i] = factors[i];
+  return result;
+}
+
+transform transform::rotation(const vec3 &axis, double degrees) {
+  // Rodrigues' formula, counterclockwise looking down the axis
+  vec3 u = unit_vector(axis);
+  double c = std::cos(degrees_to_radians(degrees));
+  double s = std::sin(degrees_to_radians(degrees));
+  transform result;
+  for (int i = 0; i < 3; i++)
+    for (int j = 0; j < 3; j++)
+      result.linear[i][j] = (1 - c) * u[i] * u[j] + ((i == j) ? c : 0.0);
+  result.linear[0][1] -= s * u.z();
+  result.linear[0][2] += s * u.y();
+  result.linear[1][0] += s * u.z();
+  result.linear[1][2] -= s * u.x();
+  result.linear[2][0] -= s * u.y();
+  result.linear[2][1] += s * u.x();
+  return result;
+}
+
+transform transform::operator*(const transform &other) const {
+  transform result;
+  for (int i = 0; i < 3; i++)
+    for (int j = 0; j < 3; j++)
+      result.linear[i][j] = this->linear[i][0] * other.linear[0][j] +
+                            this->linear[i][1] * other.linear[1][j] +
+                            this->linear[i][2] * other.linear[2][j];
+  result.offset = this->apply_point(other.offset);
+  return result;
+}
+
+transform transform::inverse() const {
+  // Adjugate over determinant, then the offset mapped back
+  const double (*m)[3] = this->linear;
+  double cofactor[3][3];
+  for (int i = 0; i < 3; i++) {
+    for (int j = 0; j < 3; j++) {
+      int i1 = (i + 1) % 3, i2 = (i + 2) % 3;
+      int j1 = (j + 1) % 3, j2 = (j + 2) % 3;
+      cofactor[i][j] = m[i1][j1] * m[i2][j2] - m[i1][j2] * m[i2][j1];
+    }
+  }
+  double determinant = m[0][0] * cofactor[0][0] + m[0][1] * cofactor[0][1] +
+                       m[0][2] * cofactor[0][2];
+
+  transform result;
+  for (int i = 0; i < 3; i++)
+    for (int j = 0; j < 3; j++)
+      result.linear[i][j] = cofactor[j][i] / determinant;
+  result.offset = -result.apply_vector(this->offset);
+  return result;
+}
+
+point3 transform::apply_point(const point3 &p) const {
+  return this->apply_vector(p) + this->offset;
+}
+
+vec3 transform::apply_vector(const vec3 &v) const {
+  const double (*m)[3] = this->linear;
+  return vec3(m[0][0] * v.x() + m[0][1] * v.y() + m[0][2] * v.z(),
+              m[1][0] * v.x() + m[1][1] * v.y() + m[1][2] * v.z(),
+              m[2][0] * v.x() + m[2][1] * v.y() + m[2][2] * v.z());
+}
+
+vec3 transform::apply_transposed(const vec3 &v) const {
+  const double (*m)[3] = this->linear;
+  return vec3(m[0][0] * v.x() + m[1][0] * v.y() + m[2][0] * v.z(),
+              m[0][1] * v.x() + m[1][1] * v.y() + m[2][1] * v.z(),
+              m[0][2] * v.x() + m[1][2] * v.y() + m[2][2] * v.z());
+}
+
+aabb transform::apply_box(const aabb &box) const {
+  if (box.is_empty())
+    return box;
+
+  // Center and half extent, the latter through |L|
+  point3 center = box.centroid();
+  vec3 half(box.x.size() / 2, box.y.size() / 2, box.z.size() / 2);
+  point3 new_center = this->apply_point(center);
+  vec3 new_half;
+  for (int i = 0; i < 3; i++) {
+    for (int j = 0; j < 3; j++)
+      new_half[i] += std::fabs(this->linear[i][j]) * half[j];
+
+    // Padded for the rounding of the products above
+    new_half[i] += 1e-9 * (std::fabs(new_center[i]) + new_half[i]);
+  }
+  return aabb(new_center - new_half, new_center + new_half);
+}
+
+bool transform::is_similarity(double &scale) const {
+  // The columns of L must be orthogonal and of the same length
+  vec3 columns[3];
+  for (int j = 0; j < 3; j++)
+    columns[j] = vec3(this->linear[0][j], this->linear[1][j],
+                      this->linear[2][j]);
+
+  double length_squared = columns[0].length_squared();
+  double tolerance = 1e-9 * length_squared;
+  for (int j = 0; j < 3; j++) {
+    if (std::fabs(columns[j].length_squared() - length_squared) > tolerance)
+      return false;
+    if (std::fabs(dot(columns[j], columns[(j + 1) % 3])) > tolerance)
+      return false;
+  }
+  scale = std::sqrt(length_squared);
+  return true;
+}
@@ -0,0 +1,35 @@
+#include "traversal_stats.hpp"
+#include <iostream>
+#include <mutex>
+
+static std::mutex totals_lock;
+static long long total_rays = 0;
+static long long total_nodes = 0;
+static long long total_objects = 0;
+
+traversal_stats::counters::~counters() {
+  std::lock_guard<std::mutex> guard(totals_lock);
+  total_rays += this->rays;
+  total_nodes += this->nodes;
+  total_objects += this->objects;
+}
+
+traversal_stats::counters &traversal_stats::local() {
+  thread_local counters c;
+  return c;
+}
+
+void traversal_stats::report() {
+#if defined(RAYTRACER_TRAVERSAL_STATS)
+  const counters &own = local();
+  std::lock_guard<std::mutex> guard(totals_lock);
+  long long rays = total_rays + own.rays;
+  if (rays == 0)
+    return;
+
+  std::cout << "Traced " << rays << " rays, visiting "
+            << double(total_nodes + own.nodes) / rays << " nodes and testing "
+            << double(total_objects + own.objects) / rays
+            << " objects per ray." << std::endl;
+#endif
+}
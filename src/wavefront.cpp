@@ -0,0 +1,214 @@
+#include "camera.hpp"
+#include "morton.hpp"
+#include "thread_pool.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <unordered_map>
+
+// Paths handled by each task of a wavefront stage
+static const int stage_chunk_size = 256;
+
+// Runs stage(k) for every k in [0, count) on the pool, in chunks
+template <typename stage_function>
+static void run_stage(thread_pool &pool, int count,
+                      const stage_function &stage) {
+  int num_chunks = (count + stage_chunk_size - 1) / stage_chunk_size;
+  pool.run(num_chunks, [&](int chunk) {
+    int end = std::min(count, (chunk + 1) * stage_chunk_size);
+    for (int k = chunk * stage_chunk_size; k < end; k++)
+      stage(k);
+  });
+}
+
+// Sort key of a secondary ray, 33 bits wide: its direction octant, then the
+// 30-bit Morton code of its origin within the scene
+static uint64_t ray_sort_key(const ray &r, const aabb &bounds) {
+  vec3 direction = r.get_direction();
+  uint64_t octant = (direction.x() < 0 ? 4 : 0) |
+                    (direction.y() < 0 ? 2 : 0) | (direction.z() < 0 ? 1 : 0);
+  return (octant << 30) | morton_code(r.get_origin(), bounds);
+}
+
+void camera::render_wavefront(const world &w, std::vector<pixel_state> &pixels,
+                              int sample_end, int span_size, thread_pool &pool,
+                              ray_sort_stats &sort_stats) const {
+  // Each round takes the next sample of every pixel still sampling, like
+  // render_pixel does, and advances all of them one bounce at a time: every
+  // ray of a bounce is intersected first, the hits are then sorted by what
+  // they hit so that shading walks one material (and texture) at a time, and
+  // the paths that scatter form the queue of the next bounce. Each path keeps
+  // its own random stream, so the image matches the depth-first integrator's
+  int batch_size = std::max(1, this->wavefront_batch_size);
+
+  std::vector<int> active; // Pixels taking a sample this round
+  std::vector<path_state> paths;
+  std::vector<hit_record> records;
+  std::vector<char> found; // Not vector<bool>, which threads cannot share
+  std::vector<int> queue;
+  std::vector<int> sorted;
+  std::unordered_map<uintptr_t, int> bucket_index; // By material or light
+  std::vector<int> bucket_of;
+  std::vector<int> bucket_start;
+  std::vector<uint64_t> sort_keys;
+  std::vector<int> unsorted_queue;
+  aabb scene_bounds = w.bounding_box();
+
+  for (int round = 0;; round++) {
+    active.clear();
+    for (int p = 0; p < int(pixels.size()); p++)
+      if (!pixels[p].converged && pixels[p].samples < sample_end)
+        active.emplace_back(p);
+    if (active.empty())
+      break;
+
+    for (int batch = 0; batch < int(active.size()); batch += batch_size) {
+      int count = std::min(batch_size, int(active.size()) - batch);
+      paths.resize(count);
+      records.resize(count);
+      found.resize(count);
+
+      // Generation: one camera ray per pixel
+      run_stage(pool, count, [&](int k) {
+        int p = active[batch + k];
+        rng gen(this->seed, uint64_t(p), pixels[p].samples);
+        ray r = this->get_ray_sample(p / this->img_width, p % this->img_width,
+                                     gen);
+        this->start_path(paths[k], r, gen);
+      });
+
+      queue.clear();
+      for (int k = 0; k < count; k++)
+        if (paths[k].is_alive)
+          queue.emplace_back(k);
+
+      for (int bounce = 0; !queue.empty(); bounce++) {
+        // Intersection. Camera rays of neighboring pixels sit next to each
+        // other in the queue, so they are traced as packets
+        int queue_size = int(queue.size());
+        auto intersect = [&](int packet) {
+          int num_packets = (queue_size + packet - 1) / packet;
+          run_stage(pool, num_packets, [&](int n) {
+            int q_begin = n * packet;
+            int q_end = std::min(q_begin + packet, queue_size);
+            if (q_end - q_begin == 1) {
+              int k = queue[q_begin];
+              found[k] = w.check_hit(paths[k].current,
+                                     interval(0.001f, mathconst::infinity),
+                                     records[k]);
+              return;
+            }
+
+            ray rays[accelerator::max_packet_size];
+            hit_record hits[accelerator::max_packet_size];
+            bool hit_found[accelerator::max_packet_size];
+            for (int q = q_begin; q < q_end; q++)
+              rays[q - q_begin] = paths[queue[q]].current;
+            w.check_hit_packet(rays, q_end - q_begin,
+                               interval(0.001f, mathconst::infinity), hits,
+                               hit_found);
+            for (int q = q_begin; q < q_end; q++) {
+              found[queue[q]] = hit_found[q - q_begin];
+              records[queue[q]] = hits[q - q_begin];
+            }
+          });
+        };
+
+        if (bounce == 0 || !this->sort_rays) {
+          intersect((bounce == 0) ? span_size : 1);
+        } else {
+          // Sorting by ray key, with the path index (a non-negative int)
+          // in the 31 bits below it
+          using clock = std::chrono::steady_clock;
+          auto sorting_start = clock::now();
+          sort_keys.resize(queue_size);
+          run_stage(pool, queue_size, [&](int q) {
+            int k = queue[q];
+            sort_keys[q] =
+                (ray_sort_key(paths[k].current, scene_bounds) << 31) |
+                uint64_t(k);
+          });
+          std::sort(sort_keys.begin(), sort_keys.end());
+          unsorted_queue.swap(queue);
+          queue.resize(queue_size);
+          for (int q = 0; q < queue_size; q++)
+            queue[q] = int(sort_keys[q] & 0x7FFFFFFFu);
+          sort_stats.sorting_seconds +=
+              std::chrono::duration<double>(clock::now() - sorting_start)
+                  .count();
+
+          // The first queues are also traced in their original order, as the
+          // baseline of the speedup. Which order goes first alternates, so
+          // that neither always finds the caches warmed up by the other
+          bool trace_baseline = (sort_stats.unsorted_rays < sort_baseline_rays);
+          bool baseline_first = trace_baseline && (bounce % 2 == 1);
+          auto trace_unsorted = [&]() {
+            auto unsorted_start = clock::now();
+            queue.swap(unsorted_queue);
+            intersect(1);
+            queue.swap(unsorted_queue);
+            sort_stats.unsorted_seconds +=
+                std::chrono::duration<double>(clock::now() - unsorted_start)
+                    .count();
+            sort_stats.unsorted_rays += queue_size;
+          };
+
+          if (baseline_first)
+            trace_unsorted();
+          auto sorted_start = clock::now();
+          intersect(1);
+          sort_stats.sorted_seconds +=
+              std::chrono::duration<double>(clock::now() - sorted_start)
+                  .count();
+          sort_stats.sorted_rays += queue_size;
+          if (trace_baseline && !baseline_first)
+            trace_unsorted();
+        }
+
+        // Sorting by what each ray hit, misses first, with a counting sort
+        // over the distinct materials and lights
+        bucket_index.clear();
+        bucket_index[0] = 0;
+        bucket_of.resize(queue_size);
+        for (int q = 0; q < queue_size; q++) {
+          int k = queue[q];
+          uintptr_t key = 0;
+          if (found[k])
+            key = records[k].is_light ? uintptr_t(records[k].lig)
+                                      : uintptr_t(records[k].mat);
+          auto bucket = bucket_index.try_emplace(key, int(bucket_index.size()));
+          bucket_of[q] = bucket.first->second;
+        }
+
+        bucket_start.assign(bucket_index.size() + 1, 0);
+        for (int q = 0; q < queue_size; q++)
+          bucket_start[bucket_of[q] + 1]++;
+        for (size_t b = 1; b < bucket_start.size(); b++)
+          bucket_start[b] += bucket_start[b - 1];
+        sorted.resize(queue_size);
+        for (int q = 0; q < queue_size; q++)
+          sorted[bucket_start[bucket_of[q]]++] = queue[q];
+        queue.swap(sorted);
+
+        // Shading, which also draws the next ray of each path
+        run_stage(pool, queue_size, [&](int q) {
+          int k = queue[q];
+          this->extend_path(paths[k], found[k], records[k], w);
+        });
+
+        // Compaction into the queue of the next bounce
+        queue.erase(std::remove_if(queue.begin(), queue.end(),
+                                   [&](int k) { return !paths[k].is_alive; }),
+                    queue.end());
+      }
+
+      for (int k = 0; k < count; k++)
+        this->add_sample(pixels[active[batch + k]], paths[k].radiance);
+    }
+
+    // Logging
+    std::cout << "\rWavefront round " << (round + 1) << ", "
+              << active.size() << " pixels sampled " << std::flush;
+  }
+}
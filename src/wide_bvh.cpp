@@ -0,0 +1,382 @@
+#include "wide_bvh.hpp"
+#include "thread_pool.hpp"
+#include "traversal_stats.hpp"
+#include "wide_traversal.hpp"
+#include <algorithm>
+#include <functional>
+
+#if defined(__AVX512F__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+// SAH cost of a node's child relative to one object test, and the growth of
+// the tree's cost past which refit gives up, as in bvh
+static const double traversal_cost = 1.0;
+static const double max_cost_growth = 1.5;
+
+// Children refit by each task, as smaller levels are not worth sharing out
+static const int refit_chunk_size = 1024;
+
+wide_bvh::wide_bvh(const std::vector<object *> &objects, bool spatial_splits) {
+  bvh binary(objects, spatial_splits);
+  this->unbounded = std::move(binary.unbounded);
+  if (binary.nodes.empty())
+    return;
+
+  this->nodes.reserve(binary.nodes.size() / 2 + 1);
+  if (binary.nodes[0].count > 0) {
+    // A single leaf still gets a node above it, as traversal starts at one
+    const bvh::node &b = binary.nodes[0];
+    this->nodes.emplace_back();
+    this->leaves.push_back(
+        leaf{b.offset, b.count - b.sphere_count, b.sphere_offset,
+             b.sphere_count});
+    for (int axis = 0; axis < 3; axis++) {
+      this->nodes[0].lower[axis][0] = b.bounds.axis_interval(axis).min;
+      this->nodes[0].upper[axis][0] = b.bounds.axis_interval(axis).max;
+    }
+    this->nodes[0].child[0] = ~0;
+    this->nodes[0].count = 1;
+  } else {
+    this->collapse(binary, 0);
+  }
+
+  this->primitives = std::move(binary.primitives);
+  this->spheres = std::move(binary.spheres);
+}
+
+int wide_bvh::collapse(const bvh &binary, int binary_index) {
+  int children[width];
+  int count = binary.collapse_children(binary_index, width, children);
+
+  int index = int(this->nodes.size());
+  this->nodes.emplace_back();
+  this->nodes[index].count = count;
+  for (int c = 0; c < count; c++) {
+    const bvh::node &b = binary.nodes[children[c]];
+    int reference;
+    if (b.count > 0) {
+      reference = ~int(this->leaves.size());
+      this->leaves.push_back(leaf{b.offset, b.count - b.sphere_count,
+                                  b.sphere_offset, b.sphere_count});
+    } else {
+      reference = this->collapse(binary, children[c]);
+    }
+
+    // Indexed again, as collapsing the child may have grown the vector
+    node &n = this->nodes[index];
+    n.child[c] = reference;
+    for (int axis = 0; axis < 3; axis++) {
+      n.lower[axis][c] = b.bounds.axis_interval(axis).min;
+      n.upper[axis][c] = b.bounds.axis_interval(axis).max;
+    }
+  }
+  return index;
+}
+
+bool wide_bvh::refit(const std::vector<const object *> &changed,
+                     thread_pool &pool) {
+  if (this->node_slots.size() != this->nodes.size())
+    this->link_nodes();
+
+  // Moves the spheres, and sorts the leaves holding the changed objects by
+  // the depth of their slots
+  std::vector<std::vector<int>> levels;
+  auto add_child = [&](int child) {
+    int depth = this->child_depth(child);
+    if (depth >= int(levels.size()))
+      levels.resize(depth + 1);
+    levels[depth].push_back(child);
+  };
+  auto by_object = [](const reference &ref, const object *obj) {
+    return std::less<const object *>()(ref.obj, obj);
+  };
+  for (auto obj : changed) {
+    auto ref = std::lower_bound(this->references.begin(),
+                                this->references.end(), obj, by_object);
+    if (ref == this->references.end() || ref->obj != obj) {
+      // Objects outside the tree may only stay out while unbounded
+      if (!obj->bounding_box().is_bounded() &&
+          std::find(this->unbounded.begin(), this->unbounded.end(), obj) !=
+              this->unbounded.end())
+        continue;
+      return false;
+    }
+
+    point3 center;
+    double radius;
+    obj->get_sphere(center, radius);
+    for (; ref != this->references.end() && ref->obj == obj; ref++) {
+      if (ref->sphere >= 0)
+        this->spheres.set(ref->sphere, center, radius);
+      add_child(~ref->leaf);
+    }
+  }
+
+  // Children of the same depth write to different slots and do not depend
+  // on each other, so each level is refit in parallel once the one below it
+  // is done. The root has no slot, and is never refit
+  for (int depth = int(levels.size()) - 1; depth > 0; depth--) {
+    std::vector<int> &level = levels[depth];
+    if (level.empty())
+      continue;
+    std::sort(level.begin(), level.end());
+    level.erase(std::unique(level.begin(), level.end()), level.end());
+
+    int size = int(level.size());
+    int num_tasks = std::clamp(
+        (size + refit_chunk_size - 1) / refit_chunk_size, 1, pool.size());
+    std::vector<double> cost_change(num_tasks, 0.0);
+    std::vector<char> moved(size);
+    auto refit_range = [&](int task) {
+      int begin = int((long long)size * task / num_tasks);
+      int end = int((long long)size * (task + 1) / num_tasks);
+      for (int i = begin; i < end; i++)
+        moved[i] = this->refit_child(level[i], cost_change[task]);
+    };
+    if (num_tasks > 1)
+      pool.run(num_tasks, refit_range);
+    else
+      refit_range(0);
+
+    for (double change : cost_change)
+      this->cost += change;
+    for (int i = 0; i < size; i++) {
+      int child = level[i];
+      if (moved[i])
+        levels[depth - 1].push_back(child >= 0 ? this->node_slots[child].node
+                                               : this->leaf_slots[~child].node);
+    }
+  }
+
+  return this->cost <= max_cost_growth * this->built_cost;
+}
+
+void wide_bvh::link_nodes() {
+  this->node_slots.assign(this->nodes.size(), slot{-1, 0});
+  this->leaf_slots.assign(this->leaves.size(), slot{-1, 0});
+  this->references.clear();
+  this->references.reserve(this->reference_count());
+  this->cost = 0.0;
+  for (int i = 0; i < int(this->nodes.size()); i++) {
+    const node &n = this->nodes[i];
+    for (int c = 0; c < n.count; c++) {
+      if (n.child[c] >= 0)
+        this->node_slots[n.child[c]] = slot{i, c};
+      else
+        this->leaf_slots[~n.child[c]] = slot{i, c};
+      this->cost += this->slot_cost(slot{i, c});
+    }
+  }
+  this->built_cost = this->cost;
+
+  for (int i = 0; i < int(this->leaves.size()); i++) {
+    const leaf &l = this->leaves[i];
+    for (int k = l.offset; k < l.offset + l.count; k++)
+      this->references.push_back(reference{this->primitives[k], i, -1});
+    for (int k = l.sphere_offset; k < l.sphere_offset + l.sphere_count; k++)
+      this->references.push_back(reference{this->spheres.owner(k), i, k});
+  }
+
+  std::sort(this->references.begin(), this->references.end(),
+            [](const reference &a, const reference &b) {
+              return std::less<const object *>()(a.obj, b.obj);
+            });
+}
+
+double wide_bvh::slot_cost(const slot &s) const {
+  const node &n = this->nodes[s.node];
+  aabb bounds(interval(n.lower[0][s.index], n.upper[0][s.index]),
+              interval(n.lower[1][s.index], n.upper[1][s.index]),
+              interval(n.lower[2][s.index], n.upper[2][s.index]));
+  int child = n.child[s.index];
+  if (child >= 0)
+    return traversal_cost * bounds.surface_area();
+  const leaf &l = this->leaves[~child];
+  return bounds.surface_area() * (l.count + l.sphere_count);
+}
+
+bool wide_bvh::refit_child(int child, double &cost_change) {
+  // Parts of objects referenced by spatial splits grow back to the whole
+  // object, which always bounds them
+  aabb bounds;
+  if (child < 0) {
+    const leaf &l = this->leaves[~child];
+    for (int k = l.offset; k < l.offset + l.count; k++)
+      bounds = aabb(bounds, this->primitives[k]->bounding_box());
+    for (int k = l.sphere_offset; k < l.sphere_offset + l.sphere_count; k++)
+      bounds = aabb(bounds, this->spheres.owner(k)->bounding_box());
+  } else {
+    const node &n = this->nodes[child];
+    for (int c = 0; c < n.count; c++)
+      bounds = aabb(bounds, aabb(interval(n.lower[0][c], n.upper[0][c]),
+                                 interval(n.lower[1][c], n.upper[1][c]),
+                                 interval(n.lower[2][c], n.upper[2][c])));
+  }
+
+  const slot &s =
+      child >= 0 ? this->node_slots[child] : this->leaf_slots[~child];
+  node &n = this->nodes[s.node];
+  bool same = true;
+  for (int axis = 0; axis < 3; axis++) {
+    const interval &extent = bounds.axis_interval(axis);
+    same = same && n.lower[axis][s.index] == extent.min &&
+           n.upper[axis][s.index] == extent.max;
+  }
+  if (same)
+    return false;
+
+  cost_change -= this->slot_cost(s);
+  for (int axis = 0; axis < 3; axis++) {
+    n.lower[axis][s.index] = bounds.axis_interval(axis).min;
+    n.upper[axis][s.index] = bounds.axis_interval(axis).max;
+  }
+  cost_change += this->slot_cost(s);
+  return true;
+}
+
+int wide_bvh::child_depth(int child) const {
+  int depth = 0;
+  int parent =
+      child >= 0 ? this->node_slots[child].node : this->leaf_slots[~child].node;
+  for (; parent >= 0; parent = this->node_slots[parent].node)
+    depth++;
+  return depth;
+}
+
+bool wide_bvh::check_hit(const ray &r, interval ray_t,
+                         hit_record &record) const {
+  hit_record temp_rec;
+  bool hit_anything = this->check_unbounded(r, ray_t, record);
+  double closest_so_far = ray_t.max;
+
+  if (this->nodes.empty())
+    return hit_anything;
+
+  point3 origin = r.get_origin();
+  vec3 inv_direction = inverse_direction(r);
+
+  wide_traversal<node, width>::closest_hit(
+      this->nodes, interval(ray_t.min, closest_so_far),
+      [&](int index, double t_min, double t_max, double *t_entry) {
+        return child_hits(this->nodes[index], origin, inv_direction, t_min,
+                          t_max, t_entry);
+      },
+      [&](int index, interval search_t) {
+        if (this->check_leaf(this->leaves[index], r, search_t, temp_rec)) {
+          hit_anything = true;
+          search_t.max = temp_rec.t;
+          record = temp_rec;
+        }
+        return search_t;
+      });
+  return hit_anything;
+}
+
+bool wide_bvh::check_occluded(const ray &r, interval ray_t) const {
+  if (this->check_unbounded_occluded(r, ray_t))
+    return true;
+
+  if (this->nodes.empty())
+    return false;
+
+  point3 origin = r.get_origin();
+  vec3 inv_direction = inverse_direction(r);
+
+  return wide_traversal<node, width>::any_hit(
+      this->nodes, ray_t,
+      [&](int index, double t_min, double t_max, double *t_entry) {
+        return child_hits(this->nodes[index], origin, inv_direction, t_min,
+                          t_max, t_entry);
+      },
+      [&](int index) {
+        const leaf &l = this->leaves[index];
+        traversal_stats::count_objects(l.count + l.sphere_count);
+        for (int i = l.offset; i < l.offset + l.count; i++)
+          if (this->primitives[i]->check_occluded(r, ray_t))
+            return true;
+        return this->spheres.check_occluded(r, ray_t, l.sphere_offset,
+                                            l.sphere_offset + l.sphere_count);
+      });
+}
+
+bool wide_bvh::check_leaf(const leaf &l, const ray &r, interval ray_t,
+                          hit_record &record) const {
+  // Closest hit among the leaf's objects
+  traversal_stats::count_objects(l.count + l.sphere_count);
+  hit_record temp_rec;
+  bool hit_anything = false;
+  for (int i = l.offset; i < l.offset + l.count; i++) {
+    if (this->primitives[i]->check_hit(r, ray_t, temp_rec)) {
+      hit_anything = true;
+      ray_t.max = temp_rec.t;
+      record = temp_rec;
+    }
+  }
+
+  if (l.sphere_count > 0 &&
+      this->spheres.check_hit(r, ray_t, l.sphere_offset,
+                              l.sphere_offset + l.sphere_count, temp_rec)) {
+    hit_anything = true;
+    record = temp_rec;
+  }
+
+  return hit_anything;
+}
+
+// The slab test of aabb::hit against every child at once, with the same
+// handling of NaNs as bvh::packet_box_hits
+unsigned wide_bvh::child_hits(const node &n, const point3 &origin,
+                              const vec3 &inv_direction, double t_min,
+                              double t_max, double *t_entry) {
+  unsigned used = (1u << n.count) - 1;
+#if defined(__AVX512F__)
+  __m512d t_near = _mm512_set1_pd(t_min);
+  __m512d t_far = _mm512_set1_pd(t_max);
+  for (int axis = 0; axis < 3; axis++) {
+    __m512d o = _mm512_set1_pd(origin[axis]);
+    __m512d inv = _mm512_set1_pd(inv_direction[axis]);
+    __m512d t0 = _mm512_mul_pd(_mm512_sub_pd(_mm512_load_pd(n.lower[axis]), o),
+                               inv);
+    __m512d t1 = _mm512_mul_pd(_mm512_sub_pd(_mm512_load_pd(n.upper[axis]), o),
+                               inv);
+    __mmask8 swap = _mm512_cmp_pd_mask(t0, t1, _CMP_GT_OQ);
+    __m512d entry = _mm512_mask_blend_pd(swap, t0, t1);
+    __m512d exit = _mm512_mask_blend_pd(swap, t1, t0);
+    t_near = _mm512_max_pd(entry, t_near);
+    t_far = _mm512_min_pd(exit, t_far);
+  }
+  _mm512_storeu_pd(t_entry, t_near);
+  return _mm512_cmp_pd_mask(t_far, t_near, _CMP_GE_OQ) & used;
+#elif defined(__AVX2__)
+  __m256d t_near = _mm256_set1_pd(t_min);
+  __m256d t_far = _mm256_set1_pd(t_max);
+  for (int axis = 0; axis < 3; axis++) {
+    __m256d o = _mm256_set1_pd(origin[axis]);
+    __m256d inv = _mm256_set1_pd(inv_direction[axis]);
+    __m256d t0 = _mm256_mul_pd(_mm256_sub_pd(_mm256_load_pd(n.lower[axis]), o),
+                               inv);
+    __m256d t1 = _mm256_mul_pd(_mm256_sub_pd(_mm256_load_pd(n.upper[axis]), o),
+                               inv);
+    __m256d swap = _mm256_cmp_pd(t0, t1, _CMP_GT_OQ);
+    __m256d entry = _mm256_blendv_pd(t0, t1, swap);
+    __m256d exit = _mm256_blendv_pd(t1, t0, swap);
+    t_near = _mm256_max_pd(entry, t_near);
+    t_far = _mm256_min_pd(exit, t_far);
+  }
+  _mm256_storeu_pd(t_entry, t_near);
+  return unsigned(_mm256_movemask_pd(
+             _mm256_cmp_pd(t_far, t_near, _CMP_GE_OQ))) &
+         used;
+#else
+  unsigned hit = 0;
+  for (int c = 0; c < n.count; c++) {
+    aabb box(interval(n.lower[0][c], n.upper[0][c]),
+             interval(n.lower[1][c], n.upper[1][c]),
+             interval(n.lower[2][c], n.upper[2][c]));
+    if (box.hit(origin, inv_direction, interval(t_min, t_max), t_entry[c]))
+      hit |= 1u << c;
+  }
+  return hit & used;
+#endif
+}
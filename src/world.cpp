@@ -1,10 +1,27 @@
 #include "world.hpp"
+#include "bvh.hpp"
+#include "compressed_bvh.hpp"
+#include "grid.hpp"
+#include "instance.hpp"
+#include "lazy_bvh.hpp"
+#include "lbvh.hpp"
+#include "mesh.hpp"
 #include "object.hpp"
+#include "object_list.hpp"
+#include "thread_pool.hpp"
+#include "traversal_stats.hpp"
+#include "wide_bvh.hpp"
+#include <chrono>
+#include <iostream>
+
+// Refitting a few objects takes less than starting threads for it
+static const size_t min_parallel_updates = 4096;
 
 world::world() {}
 
 world::~world() {
   // Cleans memory
+  delete this->accel;
   for (auto obj : objects) {
     delete obj;
   }
@@ -18,6 +35,7 @@ void world::add_sphere(point3 center, double radius, material *mat) {
 void world::add_bulb(point3 center, double radius, light *lig) {
   bulb *ball = new bulb(center, radius, lig);
   objects.emplace_back(ball);
+  lights.emplace_back(ball);
 }
 
 void world::add_polyhedron(int num_of_faces, vec3 *normals, double *intercepts,
@@ -26,7 +44,161 @@ void world::add_polyhedron(int num_of_faces, vec3 *normals, double *intercepts,
   objects.emplace_back(poly);
 }
 
+void world::add_plane(const vec3 &normal, double intercept, material *mat) {
+  plane *ground = new plane(normal, intercept, mat);
+  objects.emplace_back(ground);
+}
+
+void world::add_mesh(const std::string &path, material *mat) {
+  mesh *triangles = new mesh(path, mat);
+  objects.emplace_back(triangles);
+}
+
+void world::add_instance(const world *prototype, const transform &to_world,
+                         material *mat) {
+  instance *copy = new instance(prototype, to_world, mat);
+  objects.emplace_back(copy);
+}
+
+void world::build(accel_type type, int num_threads, bool spatial_splits) {
+  delete this->accel;
+  this->accel = nullptr;
+  this->type = type;
+  this->num_threads = num_threads;
+  this->spatial_splits = spatial_splits;
+
+  using clock = std::chrono::steady_clock;
+  auto build_start = clock::now();
+  auto build_ms = [&]() {
+    return std::chrono::duration<double, std::milli>(clock::now() -
+                                                     build_start)
+        .count();
+  };
+
+  // Spatial splits reference some objects from more than one leaf
+  auto log_references = [&](int references, int unbounded) {
+    if (spatial_splits)
+      std::cout << "Spatial splits made " << references << " references to "
+                << this->objects.size() - unbounded << " objects."
+                << std::endl;
+  };
+
+  if (type == accel_type::wide_bvh) {
+    wide_bvh *hierarchy = new wide_bvh(this->objects, spatial_splits);
+    std::cout << "Built " << wide_bvh::width << "-wide BVH with "
+              << hierarchy->node_count() << " nodes and "
+              << hierarchy->leaf_count() << " leaves over "
+              << this->objects.size() << " objects ("
+              << hierarchy->unbounded_count() << " unbounded) in "
+              << build_ms() << " ms." << std::endl;
+    log_references(hierarchy->reference_count(),
+                   hierarchy->unbounded_count());
+    this->accel = hierarchy;
+  } else if (type == accel_type::compressed_bvh) {
+    compressed_bvh *hierarchy =
+        new compressed_bvh(this->objects, spatial_splits);
+    std::cout << "Built compressed BVH with " << hierarchy->node_count()
+              << " nodes and " << hierarchy->leaf_count() << " leaves over "
+              << this->objects.size() << " objects ("
+              << hierarchy->unbounded_count() << " unbounded) in "
+              << build_ms() << " ms." << std::endl;
+    log_references(hierarchy->reference_count(),
+                   hierarchy->unbounded_count());
+    this->accel = hierarchy;
+  } else if (type == accel_type::bvh) {
+    bvh *hierarchy = new bvh(this->objects, spatial_splits);
+    std::cout << "Built BVH with " << hierarchy->node_count() << " nodes over "
+              << this->objects.size() << " objects ("
+              << hierarchy->unbounded_count() << " unbounded) in "
+              << build_ms() << " ms." << std::endl;
+    log_references(hierarchy->reference_count(),
+                   hierarchy->unbounded_count());
+    this->accel = hierarchy;
+  } else if (type == accel_type::lbvh) {
+    thread_pool pool((num_threads > 0) ? num_threads
+                                       : thread_pool::hardware_threads());
+    build_start = clock::now();
+    lbvh *hierarchy = new lbvh(this->objects, pool);
+    std::cout << "Built LBVH with " << hierarchy->node_count()
+              << " nodes over " << this->objects.size() << " objects ("
+              << hierarchy->unbounded_count() << " unbounded) in "
+              << build_ms() << " ms on " << pool.size() << " threads."
+              << std::endl;
+    this->accel = hierarchy;
+  } else if (type == accel_type::grid) {
+    grid *cells = new grid(this->objects);
+    std::cout << "Built " << cells->resolution(0) << "x" << cells->resolution(1)
+              << "x" << cells->resolution(2) << " grid over "
+              << this->objects.size() << " objects ("
+              << cells->out_of_band_count() << " out of band) in "
+              << build_ms() << " ms." << std::endl;
+    this->accel = cells;
+  } else if (type == accel_type::lazy_bvh) {
+    lazy_bvh *hierarchy = new lazy_bvh(this->objects, spatial_splits);
+    std::cout << "Built lazy BVH top with " << hierarchy->node_count()
+              << " nodes over " << hierarchy->subtree_count()
+              << " subtrees to build on demand, for " << this->objects.size()
+              << " objects (" << hierarchy->unbounded_count()
+              << " unbounded) in " << build_ms() << " ms." << std::endl;
+    this->accel = hierarchy;
+  } else {
+    this->accel = new object_list(this->objects);
+  }
+
+  std::cout << "Acceleration structure takes "
+            << (this->accel->memory_usage() + 1023) / 1024 << " KiB."
+            << std::endl;
+}
+
+bool world::update(const std::vector<object_update> &updates,
+                   int num_threads) {
+  bool moved_all = true;
+  std::vector<const object *> changed;
+  changed.reserve(updates.size());
+  for (const auto &u : updates) {
+    if (u.obj->set_sphere(u.center, u.radius))
+      changed.emplace_back(u.obj);
+    else
+      moved_all = false;
+  }
+
+  if (this->accel == nullptr || changed.empty())
+    return moved_all;
+
+  if (num_threads <= 0)
+    num_threads = thread_pool::hardware_threads();
+  thread_pool pool((changed.size() >= min_parallel_updates) ? num_threads : 1);
+
+  using clock = std::chrono::steady_clock;
+  auto refit_start = clock::now();
+  if (this->accel->refit(changed, pool)) {
+    std::cout << "Refit acceleration structure for " << changed.size()
+              << " objects in "
+              << std::chrono::duration<double, std::milli>(clock::now() -
+                                                           refit_start)
+                     .count()
+              << " ms." << std::endl;
+  } else {
+    this->build(this->type, this->num_threads, this->spatial_splits);
+  }
+  return moved_all;
+}
+
+aabb world::bounding_box() const {
+  aabb bounds;
+  for (auto obj : this->objects) {
+    aabb box = obj->bounding_box();
+    if (box.is_bounded())
+      bounds = aabb(bounds, box);
+  }
+  return bounds;
+}
+
 bool world::check_hit(const ray &r, interval ray_t, hit_record &record) const {
+  traversal_stats::count_rays(1);
+  if (this->accel)
+    return this->accel->check_hit(r, ray_t, record);
+
   // Finds the first object the ray hits, if it hits any
   hit_record temp_rec;
   bool hit_anything = false;
@@ -40,4 +212,27 @@ bool world::check_hit(const ray &r, interval ray_t, hit_record &record) const {
   }
 
   return hit_anything;
+}
+
+void world::check_hit_packet(const ray *rays, int count, interval ray_t,
+                             hit_record *records, bool *hits) const {
+  if (this->accel) {
+    traversal_stats::count_rays(count);
+    this->accel->check_hit_packet(rays, count, ray_t, records, hits);
+    return;
+  }
+
+  for (int l = 0; l < count; l++)
+    hits[l] = this->check_hit(rays[l], ray_t, records[l]);
+}
+
+bool world::check_occluded(const ray &r, interval ray_t) const {
+  traversal_stats::count_rays(1);
+  if (this->accel)
+    return this->accel->check_occluded(r, ray_t);
+
+  for (auto obj : objects)
+    if (obj->check_occluded(r, ray_t))
+      return true;
+  return false;
 }
\ No newline at end of file
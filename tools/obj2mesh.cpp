@@ -0,0 +1,106 @@
+// Converts a Wavefront OBJ mesh to the binary format the ray tracer maps into
+// memory (see mesh_file), building its BVH once here instead of at every
+// load. Only vertex positions and faces are read; faces with more than
+// three vertices are split into fans of triangles
+#include "mesh_file.hpp"
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Index of a face's vertex, given as 1-based or negative from the end, and
+// followed by texture and normal indices that are skipped
+static bool parse_index(const char *&p, size_t vertex_count, uint32_t &index) {
+  char *end;
+  long i = std::strtol(p, &end, 10);
+  if (end == p)
+    return false;
+  p = end;
+  while (*p != '\0' && *p != ' ' && *p != '\t' && *p != '\r')
+    p++;
+
+  long resolved = i < 0 ? long(vertex_count) + i : i - 1;
+  if (i == 0 || resolved < 0 || resolved >= long(vertex_count))
+    return false;
+  index = uint32_t(resolved);
+  return true;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc != 3) {
+    std::cerr << "Usage: obj2mesh input.obj output.mesh" << std::endl;
+    return -1;
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  std::ifstream input_file(argv[1]);
+  if (!input_file) {
+    std::cerr << "ERROR: Could not open '" << argv[1] << "'." << std::endl;
+    return -1;
+  }
+
+  std::vector<float> vertices;
+  std::vector<uint32_t> triangles;
+  std::vector<uint32_t> face;
+  std::string line;
+  long line_number = 0;
+  while (std::getline(input_file, line)) {
+    line_number++;
+    const char *p = line.c_str();
+    while (*p == ' ' || *p == '\t')
+      p++;
+
+    if (p[0] == 'v' && (p[1] == ' ' || p[1] == '\t')) {
+      p++;
+      for (int axis = 0; axis < 3; axis++) {
+        char *end;
+        vertices.push_back(std::strtof(p, &end));
+        if (end == p) {
+          std::cerr << "ERROR: Bad vertex at line " << line_number << "."
+                    << std::endl;
+          return -1;
+        }
+        p = end;
+      }
+    }
+
+    else if (p[0] == 'f' && (p[1] == ' ' || p[1] == '\t')) {
+      p++;
+      face.clear();
+      size_t vertex_count = vertices.size() / 3;
+      while (true) {
+        while (*p == ' ' || *p == '\t')
+          p++;
+        if (*p == '\0' || *p == '\r')
+          break;
+        uint32_t index;
+        if (!parse_index(p, vertex_count, index)) {
+          std::cerr << "ERROR: Bad face at line " << line_number << "."
+                    << std::endl;
+          return -1;
+        }
+        face.push_back(index);
+      }
+
+      for (size_t k = 2; k < face.size(); k++) {
+        triangles.push_back(face[0]);
+        triangles.push_back(face[k - 1]);
+        triangles.push_back(face[k]);
+      }
+    }
+  }
+
+  std::cout << "Read " << vertices.size() / 3 << " vertices and "
+            << triangles.size() / 3 << " triangles." << std::endl;
+
+  if (!mesh_file::write(argv[2], vertices, triangles))
+    return -1;
+
+  double ms = std::chrono::duration<double, std::milli>(
+                  std::chrono::steady_clock::now() - start)
+                  .count();
+  std::cout << "Wrote " << argv[2] << " in " << ms << " ms." << std::endl;
+  return 0;
+}